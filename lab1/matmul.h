@@ -0,0 +1,308 @@
+/***************************************************************************
+ *
+ * Cache-blocked Matrix-Matrix multiplication shared by the matmul programs
+ *
+ * Include after defining SIZE. b is first copied into panels of a few
+ * columns (matmul_pack), and each block of a into panels of MATMUL_MR
+ * rows, so the inner loop reads both contiguously instead of walking
+ * down a column of b SIZE doubles apart. On x86-64 the inner loop uses
+ * SSE2, AVX2 with FMA or AVX-512, whichever is the widest the CPU has.
+ *
+ ***************************************************************************/
+
+#ifndef MATMUL_H
+#define MATMUL_H
+
+#include <stdio.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define MATMUL_X86 1
+#endif
+
+#ifndef SIZE
+#error "define SIZE before including matmul.h"
+#endif
+
+/* Register block: MR x NR elements of c stay in registers while k runs
+ * through a tile. A KC x NR panel of b (8 KiB) stays in L1 while all
+ * the MR row panels of an MC x KC block of a (128 KiB, in L2) pass it,
+ * and the KC x NC block of b (1 MiB) is reused by every MC block. NR is
+ * the width of the portable and SSE2 kernels; the AVX2 and AVX-512 ones
+ * use panels of 8 and 16 columns, and matmul_nr holds the one in use.
+ */
+#define MATMUL_MR 4
+#define MATMUL_NR 4
+#define MATMUL_KC 256
+#define MATMUL_MC 64
+#define MATMUL_NC 512
+
+#if SIZE % MATMUL_NR != 0
+#error "SIZE must be a multiple of MATMUL_NR"
+#endif
+#if MATMUL_MC % MATMUL_MR != 0
+#error "MATMUL_MC must be a multiple of MATMUL_MR"
+#endif
+
+#define MATMUL_MIN(x, y) ((x) < (y) ? (x) : (y))
+
+/* Multiplies an MR row panel of a with a panel of b over kc columns and
+ * stores the first mr rows into c. The first tile of k stores the
+ * result, later ones add to it.
+ */
+typedef void (*matmul_kernel_fn)(const double *ap, const double *bp, double *c, int mr, int kc, int first);
+
+static void
+matmul_kernel_c(const double *ap, const double *bp, double *c, int mr, int kc, int first)
+{
+    double acc[MATMUL_MR][MATMUL_NR] = {{0.0}};
+    int k, r, x;
+
+    if (mr == 1) {
+        /* A range of one row, as when each thread gets its own row */
+        for (k = 0; k < kc; k++, ap += MATMUL_MR, bp += MATMUL_NR)
+#pragma GCC unroll 16
+            for (x = 0; x < MATMUL_NR; x++)
+                acc[0][x] += ap[0] * bp[x];
+    } else {
+        for (k = 0; k < kc; k++, ap += MATMUL_MR, bp += MATMUL_NR)
+            /* Fully unrolled, so acc is kept in registers */
+#pragma GCC unroll 16
+            for (r = 0; r < MATMUL_MR; r++)
+#pragma GCC unroll 16
+                for (x = 0; x < MATMUL_NR; x++)
+                    acc[r][x] += ap[r] * bp[x];
+    }
+    for (r = 0; r < mr; r++)
+        for (x = 0; x < MATMUL_NR; x++)
+            c[r * SIZE + x] = first ? acc[r][x] : c[r * SIZE + x] + acc[r][x];
+}
+
+#ifdef MATMUL_X86
+/* The vector kernels hold a row of the panel of b in two registers and
+ * multiply it with each element of the a panel broadcast to a register.
+ */
+static void
+matmul_kernel_sse2(const double *ap, const double *bp, double *c, int mr, int kc, int first)
+{
+    __m128d acc[MATMUL_MR][2], b0, b1, av;
+    int k, r;
+
+    for (r = 0; r < MATMUL_MR; r++)
+        acc[r][0] = acc[r][1] = _mm_setzero_pd();
+    for (k = 0; k < kc; k++, ap += MATMUL_MR, bp += 4) {
+        b0 = _mm_loadu_pd(bp);
+        b1 = _mm_loadu_pd(bp + 2);
+        if (mr == 1) {
+            av = _mm_set1_pd(ap[0]);
+            acc[0][0] = _mm_add_pd(acc[0][0], _mm_mul_pd(av, b0));
+            acc[0][1] = _mm_add_pd(acc[0][1], _mm_mul_pd(av, b1));
+            continue;
+        }
+#pragma GCC unroll 16
+        for (r = 0; r < MATMUL_MR; r++) {
+            av = _mm_set1_pd(ap[r]);
+            acc[r][0] = _mm_add_pd(acc[r][0], _mm_mul_pd(av, b0));
+            acc[r][1] = _mm_add_pd(acc[r][1], _mm_mul_pd(av, b1));
+        }
+    }
+    for (r = 0; r < mr; r++) {
+        if (!first) {
+            acc[r][0] = _mm_add_pd(acc[r][0], _mm_loadu_pd(c + r * SIZE));
+            acc[r][1] = _mm_add_pd(acc[r][1], _mm_loadu_pd(c + r * SIZE + 2));
+        }
+        _mm_storeu_pd(c + r * SIZE, acc[r][0]);
+        _mm_storeu_pd(c + r * SIZE + 2, acc[r][1]);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void
+matmul_kernel_avx2(const double *ap, const double *bp, double *c, int mr, int kc, int first)
+{
+    __m256d acc[MATMUL_MR][2], b0, b1, av;
+    int k, r;
+
+    for (r = 0; r < MATMUL_MR; r++)
+        acc[r][0] = acc[r][1] = _mm256_setzero_pd();
+    for (k = 0; k < kc; k++, ap += MATMUL_MR, bp += 8) {
+        b0 = _mm256_loadu_pd(bp);
+        b1 = _mm256_loadu_pd(bp + 4);
+        if (mr == 1) {
+            av = _mm256_broadcast_sd(ap);
+            acc[0][0] = _mm256_fmadd_pd(av, b0, acc[0][0]);
+            acc[0][1] = _mm256_fmadd_pd(av, b1, acc[0][1]);
+            continue;
+        }
+#pragma GCC unroll 16
+        for (r = 0; r < MATMUL_MR; r++) {
+            av = _mm256_broadcast_sd(ap + r);
+            acc[r][0] = _mm256_fmadd_pd(av, b0, acc[r][0]);
+            acc[r][1] = _mm256_fmadd_pd(av, b1, acc[r][1]);
+        }
+    }
+    for (r = 0; r < mr; r++) {
+        if (!first) {
+            acc[r][0] = _mm256_add_pd(acc[r][0], _mm256_loadu_pd(c + r * SIZE));
+            acc[r][1] = _mm256_add_pd(acc[r][1], _mm256_loadu_pd(c + r * SIZE + 4));
+        }
+        _mm256_storeu_pd(c + r * SIZE, acc[r][0]);
+        _mm256_storeu_pd(c + r * SIZE + 4, acc[r][1]);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void
+matmul_kernel_avx512(const double *ap, const double *bp, double *c, int mr, int kc, int first)
+{
+    __m512d acc[MATMUL_MR][2], b0, b1, av;
+    int k, r;
+
+    for (r = 0; r < MATMUL_MR; r++)
+        acc[r][0] = acc[r][1] = _mm512_setzero_pd();
+    for (k = 0; k < kc; k++, ap += MATMUL_MR, bp += 16) {
+        b0 = _mm512_loadu_pd(bp);
+        b1 = _mm512_loadu_pd(bp + 8);
+        if (mr == 1) {
+            av = _mm512_set1_pd(ap[0]);
+            acc[0][0] = _mm512_fmadd_pd(av, b0, acc[0][0]);
+            acc[0][1] = _mm512_fmadd_pd(av, b1, acc[0][1]);
+            continue;
+        }
+#pragma GCC unroll 16
+        for (r = 0; r < MATMUL_MR; r++) {
+            av = _mm512_set1_pd(ap[r]);
+            acc[r][0] = _mm512_fmadd_pd(av, b0, acc[r][0]);
+            acc[r][1] = _mm512_fmadd_pd(av, b1, acc[r][1]);
+        }
+    }
+    for (r = 0; r < mr; r++) {
+        if (!first) {
+            acc[r][0] = _mm512_add_pd(acc[r][0], _mm512_loadu_pd(c + r * SIZE));
+            acc[r][1] = _mm512_add_pd(acc[r][1], _mm512_loadu_pd(c + r * SIZE + 8));
+        }
+        _mm512_storeu_pd(c + r * SIZE, acc[r][0]);
+        _mm512_storeu_pd(c + r * SIZE + 8, acc[r][1]);
+    }
+}
+#endif
+
+/* The kernel matmul_select picked and the width of its panels of b */
+static matmul_kernel_fn matmul_kernel = matmul_kernel_c;
+static int matmul_nr = MATMUL_NR;
+
+/* Picks the widest kernel the CPU runs and whose panels divide SIZE */
+static void
+matmul_select(void)
+{
+#ifdef MATMUL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && SIZE % 16 == 0) {
+        matmul_kernel = matmul_kernel_avx512;
+        matmul_nr = 16;
+    } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && SIZE % 8 == 0) {
+        matmul_kernel = matmul_kernel_avx2;
+        matmul_nr = 8;
+    } else {
+        matmul_kernel = matmul_kernel_sse2;
+        matmul_nr = 4;
+    }
+#endif
+}
+
+/* Picks the kernel and copies b so that panel p holds columns p * nr ..
+ * p * nr + nr - 1, one row of nr after the other. Column j row k ends up
+ * at j * SIZE + k * nr + j % nr. Call it before starting threads that
+ * run matmul_rows.
+ */
+static void
+matmul_pack(double b[][SIZE], double *bp)
+{
+    int j, k, x;
+
+    matmul_select();
+    for (j = 0; j < SIZE; j += matmul_nr)
+        for (k = 0; k < SIZE; k++)
+            for (x = 0; x < matmul_nr; x++)
+                bp[j * SIZE + k * matmul_nr + x] = b[k][j + x];
+}
+
+/* Copies kc columns from column kk of rows i .. i + mc - 1 of a into
+ * panels of MR rows, one column of MR after the other. Rows past the
+ * end are zero.
+ */
+static void
+matmul_pack_a(double a[][SIZE], double *ap, int i, int mc, int kk, int kc)
+{
+    int p, k, r;
+
+    for (p = 0; p < mc; p += MATMUL_MR)
+        for (k = 0; k < kc; k++)
+            for (r = 0; r < MATMUL_MR; r++)
+                ap[p * kc + k * MATMUL_MR + r] = p + r < mc ? a[i + p + r][kk + k] : 0.0;
+}
+
+/* Computes rows start .. stop - 1 of c = a * b from the packed b. Threads
+ * may run it on disjoint row ranges at the same time.
+ */
+static void
+matmul_rows(double a[][SIZE], const double *bp, double c[][SIZE], int start, int stop)
+{
+    double ap[MATMUL_MC * MATMUL_KC];
+    int jj, kk, ii, i, j, kc, mc;
+
+    for (jj = 0; jj < SIZE; jj += MATMUL_NC)
+        for (kk = 0; kk < SIZE; kk += MATMUL_KC) {
+            kc = MATMUL_MIN(MATMUL_KC, SIZE - kk);
+            for (ii = start; ii < stop; ii += MATMUL_MC) {
+                mc = MATMUL_MIN(MATMUL_MC, stop - ii);
+                matmul_pack_a(a, ap, ii, mc, kk, kc);
+                for (j = jj; j < MATMUL_MIN(jj + MATMUL_NC, SIZE); j += matmul_nr)
+                    for (i = 0; i < mc; i += MATMUL_MR)
+                        matmul_kernel(ap + i * kc, bp + j * SIZE + kk * matmul_nr, &c[ii + i][j],
+                                      MATMUL_MIN(MATMUL_MR, mc - i), kc, kk == 0);
+            }
+        }
+}
+
+/* Compares row i of c with the naive i-j-k product. Prints the first
+ * difference and returns -1 if there is one.
+ */
+static int
+matmul_check_row(double a[][SIZE], double b[][SIZE], double c[][SIZE], int i)
+{
+    int j, k;
+    double sum, size, term;
+
+    for (j = 0; j < SIZE; j++) {
+        sum = 0.0;
+        size = 0.0;
+        for (k = 0; k < SIZE; k++) {
+            term = a[i][k] * b[k][j];
+            sum = sum + term;
+            size = size + (term < 0.0 ? -term : term);
+        }
+        /* The blocked sum adds in another order, so allow rounding */
+        if (c[i][j] - sum > 1e-12 * SIZE * size || sum - c[i][j] > 1e-12 * SIZE * size) {
+            fprintf(stderr, "matmul: c[%d][%d] is %f, should be %f\n", i, j, c[i][j], sum);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Checks every 61st row of c and the last one, which covers every
+ * position within the register and cache blocks
+ */
+static int
+matmul_check(double a[][SIZE], double b[][SIZE], double c[][SIZE])
+{
+    int i;
+
+    for (i = 0; i < SIZE; i += 61)
+        if (matmul_check_row(a, b, c, i) == -1)
+            return -1;
+    return matmul_check_row(a, b, c, SIZE - 1);
+}
+
+#endif /* MATMUL_H */
@@ -10,9 +10,12 @@
 
 #define SIZE 1024
 
+#include "matmul.h"
+
 static double a[SIZE][SIZE];
 static double b[SIZE][SIZE];
 static double c[SIZE][SIZE];
+static double bp[SIZE * SIZE]; /* b packed for matmul_rows */
 
 pthread_t handle[SIZE];
 
@@ -41,29 +44,18 @@ init_matrix(void)
 static void
 matmul_seq()
 {
-    int i, j, k;
-
-    for (i = 0; i < SIZE; i++) {
-        for (j = 0; j < SIZE; j++) {
-            c[i][j] = 0.0;
-            for (k = 0; k < SIZE; k++)
-                c[i][j] = c[i][j] + a[i][k] * b[k][j];
-        }
-    }
+    matmul_pack(b, bp);
+    matmul_rows(a, bp, c, 0, SIZE);
 }
 
 void* matmul_thread(void* args) {
     struct threadArgs targs = *(struct threadArgs*)args;
     int row = targs.i;
-    for (int j = 0; j < SIZE; j++) {
-        c[row][j] = 0.0;
-        for(int k = 0; k < SIZE; k++) {
-            c[row][j] = c[row][j] + a[row][k] * b[k][j];
-        }
-    }
+    matmul_rows(a, bp, c, row, row + 1);
 }
 
 static void matmul_par() {
+    matmul_pack(b, bp);
     for(int i = 0; i < SIZE; i++) {
         mulArgs[i].i = i;
         pthread_create(&handle[i], NULL, matmul_thread, (void*)&mulArgs[i]);
@@ -92,4 +84,5 @@ main(int argc, char **argv)
     matmul_par();
     // matmul_seq();
     // print_matrix();
+    return matmul_check(a, b, c) == 0 ? 0 : 1;
 }
@@ -11,9 +11,12 @@
 #define SIZE 1024
 #define THREADS 8
 
+#include "matmul.h"
+
 static double a[SIZE][SIZE];
 static double b[SIZE][SIZE];
 static double c[SIZE][SIZE];
+static double bp[SIZE * SIZE]; /* b packed for matmul_rows */
 
 pthread_t handle[THREADS];
 
@@ -54,32 +57,19 @@ init_matrix(void)
 static void
 matmul_seq()
 {
-    int i, j, k;
-
-    for (i = 0; i < SIZE; i++) {
-        for (j = 0; j < SIZE; j++) {
-            c[i][j] = 0.0;
-            for (k = 0; k < SIZE; k++)
-                c[i][j] = c[i][j] + a[i][k] * b[k][j];
-        }
-    }
+    matmul_pack(b, bp);
+    matmul_rows(a, bp, c, 0, SIZE);
 }
 
 void* matmul_thread(void* args) {
     struct threadArgs targs = *(struct threadArgs*)args;
     int start = targs.start;
     int stop = targs.stop;
-    for (int row = start; row < stop; row ++) {
-        for (int j = 0; j < SIZE; j++) {
-            c[row][j] = 0.0;
-            for(int k = 0; k < SIZE; k++) {
-                c[row][j] = c[row][j] + a[row][k] * b[k][j];
-            }
-        }
-    }
+    matmul_rows(a, bp, c, start, stop);
 }
 
 static void matmul_par() {
+    matmul_pack(b, bp);
     for(int i = 0; i < THREADS; i++) {
         mulArgs[i].start = i * (SIZE/THREADS);
         mulArgs[i].stop = (i + 1) * (SIZE/THREADS);
@@ -109,4 +99,5 @@ main(int argc, char **argv)
     matmul_par();
     // matmul_seq();
     // print_matrix();
+    return matmul_check(a, b, c) == 0 ? 0 : 1;
 }
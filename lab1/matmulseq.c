@@ -9,9 +9,12 @@
 
 #define SIZE 1024
 
+#include "matmul.h"
+
 static double a[SIZE][SIZE];
 static double b[SIZE][SIZE];
 static double c[SIZE][SIZE];
+static double bp[SIZE * SIZE]; /* b packed for matmul_rows */
 
 static void
 init_matrix(void)
@@ -32,15 +35,8 @@ init_matrix(void)
 static void
 matmul_seq()
 {
-    int i, j, k;
-
-    for (i = 0; i < SIZE; i++) {
-        for (j = 0; j < SIZE; j++) {
-            c[i][j] = 0.0;
-            for (k = 0; k < SIZE; k++)
-                c[i][j] = c[i][j] + a[i][k] * b[k][j];
-        }
-    }
+    matmul_pack(b, bp);
+    matmul_rows(a, bp, c, 0, SIZE);
 }
 
 static void
@@ -61,4 +57,5 @@ main(int argc, char **argv)
     init_matrix();
     matmul_seq();
     //print_matrix();
+    return matmul_check(a, b, c) == 0 ? 0 : 1;
 }
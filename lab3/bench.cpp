@@ -0,0 +1,125 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include "bench.h"
+
+Bench::Bench(FS *fs, const bench_params &params)
+    : fs(fs), params(params), report(nullptr), input(nullptr)
+{
+}
+
+// Runs op with the file system printing into message. Returns -1 if op
+// failed or printed anything.
+int
+Bench::quiet(std::function<int()> op, std::string *message)
+{
+    std::ostringstream out;
+    fs->use_streams(input, &out);
+    int ret = op();
+    fs->use_streams(input, report);
+    *message = out.str();
+    return ret != 0 || !message->empty() ? -1 : 0;
+}
+
+// Runs an untimed step that the phases need, reporting why it failed
+int
+Bench::setup(std::function<int()> op)
+{
+    std::string message;
+    if (quiet(op, &message) == -1) {
+        *report << message << "bench: setup failed" << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+// Runs op(0) ... op(ops - 1) and prints one line of the report
+void
+Bench::phase(const std::string &name, int ops, std::function<int(int)> op)
+{
+    std::vector<double> latencies(ops);
+    std::string message;
+    int errors = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < ops; i++) {
+        auto begin = std::chrono::steady_clock::now();
+        errors += quiet([&]() { return op(i); }, &message) == -1;
+        std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - begin;
+        latencies[i] = elapsed.count();
+    }
+    std::chrono::duration<double> total = std::chrono::steady_clock::now() - start;
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) {
+        if (latencies.empty()) {
+            return 0.0;
+        }
+        size_t rank = (size_t)std::ceil(p * latencies.size());
+        return latencies[std::min(latencies.size(), std::max(rank, (size_t)1)) - 1];
+    };
+    *report << std::left << std::setw(10) << name << std::right << std::setw(8) << ops
+            << std::setw(8) << errors << std::fixed << std::setprecision(1)
+            << std::setw(12) << (total.count() > 0 ? ops / total.count() : 0)
+            << std::setw(10) << percentile(0.5) << std::setw(10) << percentile(0.99)
+            << std::setw(10) << percentile(0.999) << std::endl;
+}
+
+int
+Bench::run()
+{
+    report = &fs->out();
+    input = &fs->in();
+    std::string dir = BENCH_DIR;
+    if (setup([&]() { return fs->mkdir(dir); }) == -1) {
+        return -1;
+    }
+
+    std::vector<std::string> files(params.files);
+    for (int i = 0; i < params.files; i++) {
+        files[i] = dir + "/f" + std::to_string(i);
+    }
+    std::string data(params.file_size, 'x');
+    for (int i = 0; i < params.file_size; i++) {
+        data[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+    }
+    std::string deep = dir + "/deep";
+    int failed = setup([&]() { return fs->mkdir(deep); });
+    for (int d = 0; d < params.depth && failed == 0; d++) {
+        deep += "/d" + std::to_string(d);
+        failed = setup([&]() { return fs->mkdir(deep); });
+    }
+    std::string leaf = deep + "/leaf";
+    std::string log = dir + "/log";
+    if (failed == -1 ||
+        setup([&]() { return fs->create_file(leaf, &data); }) == -1 ||
+        setup([&]() { return fs->create_file(log, &data); }) == -1 ||
+        setup([&]() { return fs->mkdir(dir + "/m"); }) == -1) {
+        setup([&]() { return fs->rm_recursive(dir); });
+        return -1;
+    }
+
+    *report << std::left << std::setw(10) << "phase" << std::right << std::setw(8) << "ops"
+            << std::setw(8) << "errors" << std::setw(12) << "ops/s" << std::setw(10) << "p50 us"
+            << std::setw(10) << "p99 us" << std::setw(10) << "p999 us" << std::endl;
+    std::mt19937 rng(params.seed);
+    std::string buf;
+    phase("create", params.files, [&](int i) { return fs->create_file(files[i], &data); });
+    phase("seqread", params.files, [&](int i) { return fs->read_file(files[i], &buf); });
+    phase("randread", params.ops, [&](int i) {
+        return fs->read_file(files[rng() % params.files], &buf);
+    });
+    phase("cp", params.files, [&](int i) { return fs->cp(files[i], dir + "/c" + std::to_string(i)); });
+    phase("append", params.ops, [&](int i) { return fs->append(files[i % params.files], log); });
+    phase("lookup", params.ops, [&](int i) { return fs->read_file(leaf, &buf); });
+    phase("mkdir", params.ops, [&](int i) { return fs->mkdir(dir + "/m/" + std::to_string(i)); });
+
+    // Freed blocks are reused once the removal is committed, so wait for
+    // that before handing the space back
+    int ret = setup([&]() { return fs->rm_recursive(dir); });
+    fs->journal_sync();
+    return ret;
+}
@@ -0,0 +1,41 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <functional>
+#include "fs.h"
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#define BENCH_DIR "/bench"
+#define BENCH_DISKNAME "benchfile.bin" // disk file of filesystem --bench
+
+// Sizes of the workloads bench runs
+struct bench_params {
+    int files;     // files created, read in order and copied
+    int file_size; // bytes in each of them
+    int ops;       // random reads, appends, lookups and mkdirs
+    int depth;     // directories above the file the lookups read
+    unsigned seed; // of the random reads
+};
+
+// Runs synthetic workloads in BENCH_DIR and reports the throughput and
+// latency percentiles of each phase. Everything the commands print is
+// dropped; a command that returns an error or prints anything counts as
+// failed.
+class Bench {
+private:
+    FS *fs;
+    bench_params params;
+    std::ostream *report;
+    std::istream *input;
+
+    int quiet(std::function<int()> op, std::string *message);
+    int setup(std::function<int()> op);
+    void phase(const std::string &name, int ops, std::function<int(int)> op);
+public:
+    Bench(FS *fs, const bench_params &params);
+    int run();
+};
+
+#endif // __BENCH_H__
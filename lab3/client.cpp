@@ -0,0 +1,163 @@
+#include <iostream>
+#include <thread>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "client.h"
+
+Client::Client(std::string path) : path(path), fd(-1), next_id(0)
+{
+}
+
+Client::~Client()
+{
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+int
+Client::connect_server()
+{
+    sockaddr_un addr;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Client::connect_server: Socket path too long: " << path << std::endl;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (sockaddr*)&addr, sizeof(addr)) == -1) {
+        std::cerr << "Client::connect_server: Cannot connect to " << path << ": " << strerror(errno) << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+static int
+write_all(int fd, const char *buf, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = send(fd, buf, size, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int
+read_all(int fd, char *buf, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = read(fd, buf, size);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        size -= n;
+    }
+    return 0;
+}
+
+// sends one request without waiting for its response
+int
+Client::send_request(uint8_t op, const std::string &payload)
+{
+    request_header header;
+    memset(&header, 0, sizeof(header));
+    header.length = payload.size();
+    header.id = next_id++;
+    header.op = op;
+    if (write_all(fd, (char*)&header, sizeof(header)) == -1 ||
+        write_all(fd, payload.data(), payload.size()) == -1) {
+        std::cerr << "Client::send_request: Lost connection to " << path << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+// reads the next response; responses arrive in request order
+int
+Client::recv_response(response_header *header, std::string *payload)
+{
+    if (read_all(fd, (char*)header, sizeof(*header)) == -1) {
+        return -1;
+    }
+    payload->resize(header->length);
+    if (header->length > 0 && read_all(fd, &(*payload)[0], header->length) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+// reads shell commands from stdin and prints what the server answers.
+// Commands are sent as they are read, so a script is pipelined.
+int
+Client::run()
+{
+    if (connect_server() == -1) {
+        return -1;
+    }
+    std::thread receiver([this]() {
+        response_header header;
+        std::string payload;
+        while (recv_response(&header, &payload) == 0) {
+            std::cout << payload << std::flush;
+        }
+    });
+
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        std::string payload = line;
+        size_t heredoc = line.find(" <<");
+        if (line.compare(0, 7, "create ") == 0 && heredoc != std::string::npos) {
+            // create <file> <<N is followed by N bytes, create <file> <<TAG
+            // by lines up to TAG
+            std::string marker = line.substr(heredoc + 3);
+            std::string data;
+            payload += "\n";
+            if (!marker.empty() && marker.find_first_not_of("0123456789") == std::string::npos && marker.size() <= 9) {
+                data.resize(std::stoul(marker));
+                std::cin.read(&data[0], data.size());
+                payload += data.substr(0, std::cin.gcount());
+            } else {
+                while (std::getline(std::cin, data)) {
+                    payload += data + "\n";
+                    if (data == marker) {
+                        break;
+                    }
+                }
+            }
+        } else if (line.compare(0, 7, "create ") == 0) {
+            // The data of create follows on the next lines, up to an empty one
+            std::string data;
+            payload += "\n";
+            while (std::getline(std::cin, data) && !data.empty()) {
+                payload += data + "\n";
+            }
+            payload += "\n";
+        }
+        if (send_request(OP_COMMAND, payload) == -1) {
+            break;
+        }
+        if (line == "quit") {
+            break;
+        }
+    }
+    shutdown(fd, SHUT_WR);
+    receiver.join();
+    return 0;
+}
@@ -0,0 +1,27 @@
+#include <string>
+#include <cstdint>
+#include "server.h"
+
+#ifndef __CLIENT_H__
+#define __CLIENT_H__
+
+// Talks to a Server over its Unix domain socket
+class Client {
+private:
+    std::string path;
+    int fd;
+    uint32_t next_id;
+public:
+    Client(std::string path);
+    ~Client();
+    int connect_server();
+    // sends one request without waiting for its response
+    int send_request(uint8_t op, const std::string &payload);
+    // reads the next response; responses arrive in request order
+    int recv_response(response_header *header, std::string *payload);
+    // reads shell commands from stdin and prints what the server answers.
+    // Commands are sent as they are read, so a script is pipelined.
+    int run();
+};
+
+#endif // __CLIENT_H__
@@ -0,0 +1,165 @@
+#include <cstring>
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#endif
+
+#define CRC32C_POLY 0x82f63b78 // reflected
+// The hardware path runs three independent streams of CRC32C_STRIDE bytes,
+// as the instruction's latency is three times its throughput, and shifts
+// the partial CRCs together afterwards. Must be a power of two.
+#define CRC32C_STRIDE 256
+
+static uint32_t crc_table[8][256];     // software, slicing by 8
+static uint32_t stride_shift[4][256];  // appends CRC32C_STRIDE zero bytes to a CRC
+
+// Multiplies the 32x32 GF(2) matrix mat by vec
+static uint32_t
+gf2_times(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+    for (; vec != 0; vec >>= 1, mat++) {
+        if (vec & 1) {
+            sum ^= *mat;
+        }
+    }
+    return sum;
+}
+
+static void
+gf2_square(uint32_t *square, const uint32_t *mat)
+{
+    for (int n = 0; n < 32; n++) {
+        square[n] = gf2_times(mat, mat[n]);
+    }
+}
+
+// Builds the table that feeds len zero bytes, a power of two, to a CRC
+static void
+build_shift(uint32_t shift[4][256], size_t len)
+{
+    uint32_t odd[32], even[32];
+    odd[0] = CRC32C_POLY; // one zero bit
+    for (int n = 1; n < 32; n++) {
+        odd[n] = 1u << (n - 1);
+    }
+    gf2_square(even, odd); // two bits
+    gf2_square(odd, even); // four bits
+    uint32_t *op = odd;
+    for (size_t bytes = 1; bytes <= len; bytes <<= 1) {
+        uint32_t *next = op == odd ? even : odd;
+        gf2_square(next, op);
+        op = next;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        for (int b = 0; b < 4; b++) {
+            shift[b][n] = gf2_times(op, n << (8 * b));
+        }
+    }
+}
+
+static uint32_t
+apply_shift(uint32_t crc)
+{
+    return stride_shift[0][crc & 0xff] ^ stride_shift[1][(crc >> 8) & 0xff] ^
+           stride_shift[2][(crc >> 16) & 0xff] ^ stride_shift[3][crc >> 24];
+}
+
+static uint32_t
+crc32c_software(uint32_t crc, const uint8_t *p, size_t size)
+{
+    crc = ~crc;
+    while (size >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+              crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+              crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+        p += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *p, size_t size)
+{
+    uint64_t crc0 = ~crc;
+    while (size > 0 && ((uintptr_t)p & 7) != 0) {
+        crc0 = _mm_crc32_u8(crc0, *p++);
+        size--;
+    }
+    while (size >= 3 * CRC32C_STRIDE) {
+        uint64_t crc1 = 0, crc2 = 0;
+        const uint8_t *end = p + CRC32C_STRIDE;
+        for (; p < end; p += 8) {
+            crc0 = _mm_crc32_u64(crc0, *(const uint64_t*)p);
+            crc1 = _mm_crc32_u64(crc1, *(const uint64_t*)(p + CRC32C_STRIDE));
+            crc2 = _mm_crc32_u64(crc2, *(const uint64_t*)(p + 2 * CRC32C_STRIDE));
+        }
+        crc0 = apply_shift(crc0) ^ crc1;
+        crc0 = apply_shift(crc0) ^ crc2;
+        p += 2 * CRC32C_STRIDE;
+        size -= 3 * CRC32C_STRIDE;
+    }
+    for (; size >= 8; p += 8, size -= 8) {
+        crc0 = _mm_crc32_u64(crc0, *(const uint64_t*)p);
+    }
+    while (size-- > 0) {
+        crc0 = _mm_crc32_u8(crc0, *p++);
+    }
+    return ~(uint32_t)crc0;
+}
+#endif
+
+typedef uint32_t (*crc32c_fn)(uint32_t, const uint8_t*, size_t);
+
+// Builds the tables and picks the implementation once, before main
+static crc32c_fn
+crc32c_init()
+{
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc_table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        for (int k = 1; k < 8; k++) {
+            crc_table[k][n] = crc_table[0][crc_table[k - 1][n] & 0xff] ^ (crc_table[k - 1][n] >> 8);
+        }
+    }
+    build_shift(stride_shift, CRC32C_STRIDE);
+#ifdef CRC32C_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        return crc32c_sse42;
+    }
+#endif
+    return crc32c_software;
+}
+
+static const crc32c_fn crc32c_impl = crc32c_init();
+
+uint32_t
+crc32c(uint32_t crc, const void *data, size_t size)
+{
+    return crc32c_impl(crc, (const uint8_t*)data, size);
+}
+
+bool
+crc32c_hardware()
+{
+    return crc32c_impl != crc32c_software;
+}
@@ -0,0 +1,14 @@
+#include <cstdint>
+#include <cstddef>
+
+#ifndef __CRC32C_H__
+#define __CRC32C_H__
+
+// CRC32C (Castagnoli) of size bytes at data, continuing from crc; pass 0
+// to start. Uses the SSE4.2 crc32 instruction when the CPU has it.
+uint32_t crc32c(uint32_t crc, const void *data, size_t size);
+
+// Whether crc32c runs on the SSE4.2 instruction
+bool crc32c_hardware();
+
+#endif // __CRC32C_H__
@@ -1,38 +1,55 @@
 #include <iostream>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
 #include "disk.h"
+#include "crc32c.h"
 
-Disk::Disk()
+template <int BlockSize>
+BasicDisk<BlockSize>::BasicDisk(const std::string &name) : crcs(no_blocks)
 {
+    crc_enabled = false;
+    crc_skip_first = crc_skip_end = 0;
+    if (name == RAM_DISKNAME) {
+        diskfile = -1;
+        ram.assign(disk_size, 0);
+        return;
+    }
     // first check if the disk file exists, otherwise create it.
-    if (!disk_file_exists(DISKNAME)) {
+    if (!disk_file_exists(name)) {
         std::cout << "No disk file found...\n";
-        std::cout << "Creating disk file: " << DISKNAME << std::endl;
-        std::ofstream f(DISKNAME, std::ios::binary | std::ios::out);
-        f.seekp((1<<23)-1);
+        std::cout << "Creating disk file: " << name << std::endl;
+        std::ofstream f(name, std::ios::binary | std::ios::out);
+        f.seekp(disk_size - 1);
         f.write("", 1);
     }
-    // the disk is simulated as a binary file
-    diskfile.open(DISKNAME, std::ios::in | std::ios::out | std::ios::binary);
-    if (!diskfile.is_open()) {
-        std::cerr << "ERROR: Can't open diskfile: " << DISKNAME << ", exiting..."<< std::endl;
+    // the disk is simulated as a binary file, accessed with pread/pwrite so
+    // several threads can read and write blocks at the same time
+    diskfile = open(name.c_str(), O_RDWR);
+    if (diskfile == -1) {
+        std::cerr << "ERROR: Can't open diskfile: " << name << ", exiting..."<< std::endl;
         exit(-1);
     }
 }
 
-Disk::~Disk()
+template <int BlockSize>
+BasicDisk<BlockSize>::~BasicDisk()
 {
-    diskfile.close();
+    if (diskfile != -1)
+        close(diskfile);
 }
 
+template <int BlockSize>
 bool
-Disk::disk_file_exists (const std::string& name) {
+BasicDisk<BlockSize>::disk_file_exists (const std::string& name) {
     std::ifstream f(name.c_str());
     return f.good();
 }
 
 // writes one block to the disk
+template <int BlockSize>
 int
-Disk::write(unsigned block_no, uint8_t *blk)
+BasicDisk<BlockSize>::write(unsigned block_no, uint8_t *blk)
 {
     if (DEBUG)
         std::cout << "Disk::write(" << block_no << ")\n";
@@ -41,16 +58,26 @@ Disk::write(unsigned block_no, uint8_t *blk)
         std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekp(offset, std::ios_base::beg);
-    diskfile.write((char*)blk, BLOCK_SIZE);
-    diskfile.flush();
+    if (crc_covered(block_no)) {
+        crcs[block_no] = block_checksum(blk);
+    }
+    off_t offset = (off_t)block_no * BlockSize;
+    if (diskfile == -1) {
+        memcpy(&ram[offset], blk, BlockSize);
+        return 0;
+    }
+    if (pwrite(diskfile, blk, BlockSize, offset) != BlockSize) {
+        std::cout << "Disk::write - ERROR: Failed to write block (" << block_no << ")\n";
+        return -1;
+    }
     return 0;
 }
 
-// reads one block from the disk
+// reads one block from the disk, failing if it does not match its
+// checksum unless verify is false
+template <int BlockSize>
 int
-Disk::read(unsigned block_no, uint8_t *blk)
+BasicDisk<BlockSize>::read(unsigned block_no, uint8_t *blk, bool verify)
 {
     if (DEBUG)
         std::cout << "Disk::read(" << block_no << ")\n";
@@ -59,8 +86,129 @@ Disk::read(unsigned block_no, uint8_t *blk)
         std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekg(offset, std::ios_base::beg);
-    diskfile.read((char*)blk, BLOCK_SIZE);
+    off_t offset = (off_t)block_no * BlockSize;
+    if (diskfile == -1) {
+        memcpy(blk, &ram[offset], BlockSize);
+    } else if (pread(diskfile, blk, BlockSize, offset) != BlockSize) {
+        std::cout << "Disk::read - ERROR: Failed to read block (" << block_no << ")\n";
+        return -1;
+    }
+    return verify ? crc_check(block_no, blk) : 0;
+}
+
+// writes count consecutive blocks starting at block_no in one call
+template <int BlockSize>
+int
+BasicDisk<BlockSize>::write_blocks(unsigned block_no, unsigned count, const uint8_t *blks)
+{
+    if (DEBUG)
+        std::cout << "Disk::write_blocks(" << block_no << ", " << count << ")\n";
+    if (block_no >= no_blocks || count > no_blocks - block_no) {
+        std::cout << "Disk::write_blocks - ERROR: Invalid block range (" << block_no << ", " << count << ")\n";
+        return -1;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        if (crc_covered(block_no + i)) {
+            crcs[block_no + i] = block_checksum(blks + (size_t)i * BlockSize);
+        }
+    }
+    off_t offset = (off_t)block_no * BlockSize;
+    size_t size = (size_t)count * BlockSize;
+    if (diskfile == -1) {
+        memcpy(&ram[offset], blks, size);
+        return 0;
+    }
+    if (pwrite(diskfile, blks, size, offset) != (ssize_t)size) {
+        std::cout << "Disk::write_blocks - ERROR: Failed to write blocks (" << block_no << ", " << count << ")\n";
+        return -1;
+    }
+    return 0;
+}
+
+// reads count consecutive blocks starting at block_no in one call
+template <int BlockSize>
+int
+BasicDisk<BlockSize>::read_blocks(unsigned block_no, unsigned count, uint8_t *blks)
+{
+    if (DEBUG)
+        std::cout << "Disk::read_blocks(" << block_no << ", " << count << ")\n";
+    if (block_no >= no_blocks || count > no_blocks - block_no) {
+        std::cout << "Disk::read_blocks - ERROR: Invalid block range (" << block_no << ", " << count << ")\n";
+        return -1;
+    }
+    off_t offset = (off_t)block_no * BlockSize;
+    size_t size = (size_t)count * BlockSize;
+    if (diskfile == -1) {
+        memcpy(blks, &ram[offset], size);
+    } else if (pread(diskfile, blks, size, offset) != (ssize_t)size) {
+        std::cout << "Disk::read_blocks - ERROR: Failed to read blocks (" << block_no << ", " << count << ")\n";
+        return -1;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        if (crc_check(block_no + i, blks + (size_t)i * BlockSize) == -1) {
+            return -1;
+        }
+    }
     return 0;
 }
+
+// waits until every block written so far is on stable storage
+template <int BlockSize>
+int
+BasicDisk<BlockSize>::sync()
+{
+    if (diskfile == -1) {
+        return 0;
+    }
+    if (fdatasync(diskfile) == -1) {
+        std::cout << "Disk::sync - ERROR: Failed to sync the disk file\n";
+        return -1;
+    }
+    return 0;
+}
+
+template <int BlockSize>
+void
+BasicDisk<BlockSize>::enable_checksums(const uint32_t *table, unsigned skip_first, unsigned skip_count)
+{
+    for (unsigned b = 0; b < no_blocks; b++) {
+        crcs[b] = table[b];
+    }
+    crc_skip_first = skip_first;
+    crc_skip_end = skip_first + skip_count;
+    crc_enabled = true;
+}
+
+template <int BlockSize>
+void
+BasicDisk<BlockSize>::get_checksums(uint32_t *table)
+{
+    for (unsigned b = 0; b < no_blocks; b++) {
+        table[b] = crcs[b];
+    }
+}
+
+template <int BlockSize>
+uint32_t
+BasicDisk<BlockSize>::block_checksum(const uint8_t *blk)
+{
+    uint32_t crc = crc32c(0, blk, BlockSize);
+    return crc != 0 ? crc : 1;
+}
+
+template <int BlockSize>
+int
+BasicDisk<BlockSize>::crc_check(unsigned block_no, const uint8_t *blk)
+{
+    if (!crc_covered(block_no)) {
+        return 0;
+    }
+    uint32_t stored = crcs[block_no];
+    if (stored != 0 && block_checksum(blk) != stored) {
+        std::cout << "Disk::read - ERROR: Checksum mismatch in block (" << block_no << ")\n";
+        return -1;
+    }
+    return 0;
+}
+
+INSTANTIATE_BLOCK_SIZES(BasicDisk)
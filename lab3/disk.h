@@ -1,28 +1,77 @@
 #include <iostream>
 #include <fstream>
+#include <cstdint>
+#include <vector>
+#include <atomic>
 
 #ifndef __DISK_H__
 #define __DISK_H__
 
 #define DISKNAME "diskfile.bin"
-#define BLOCK_SIZE 4096
+#define RAM_DISKNAME ":memory:" // a disk that lives in memory and starts out zeroed
 #define DEBUG false
 
-class Disk {
+// Block size of the Disk and FS the tools run on. Every build carries
+// BasicDisk and BasicFS for each size INSTANTIATE_BLOCK_SIZES lists, so
+// -DBLOCK_SIZE picks one of those.
+#ifndef BLOCK_SIZE
+#define BLOCK_SIZE 4096
+#endif
+#define INSTANTIATE_BLOCK_SIZES(cls) \
+    template class cls<1024>; template class cls<4096>; template class cls<8192>;
+static_assert(BLOCK_SIZE == 1024 || BLOCK_SIZE == 4096 || BLOCK_SIZE == 8192,
+              "BLOCK_SIZE must be one of the instantiated block sizes");
+
+template <int BlockSize>
+class BasicDisk {
 private:
-    std::fstream diskfile;
-    const unsigned no_blocks = 2048;
-    const unsigned disk_size = BLOCK_SIZE * no_blocks;
+    int diskfile;
+    std::vector<uint8_t> ram; // the blocks of a RAM_DISKNAME disk
+    // as many blocks as one FAT block of 16-bit entries can address
+    const unsigned no_blocks = BlockSize / 2;
+    const unsigned disk_size = BlockSize * no_blocks;
+    // Per-block CRC32C. While checksums are on, writing a covered block
+    // stores the checksum of what was written and reading it compares
+    // against that; 0 means none is known yet, so the block is not checked.
+    std::vector<std::atomic<uint32_t>> crcs;
+    std::atomic<bool> crc_enabled;
+    unsigned crc_skip_first, crc_skip_end; // blocks left uncovered
     bool disk_file_exists (const std::string& name);
+    bool crc_covered(unsigned block_no) {
+        return crc_enabled && (block_no < crc_skip_first || block_no >= crc_skip_end);
+    }
+    int crc_check(unsigned block_no, const uint8_t *blk);
 public:
-    Disk();
-    ~Disk();
+    // opens the disk file name, creating it if it does not exist.
+    // RAM_DISKNAME gives a disk in memory instead.
+    BasicDisk(const std::string &name = DISKNAME);
+    ~BasicDisk();
     unsigned get_no_blocks() { return no_blocks; }
     unsigned get_disk_size() { return disk_size; }
     // writes one block to the disk
     int write(unsigned block_no, uint8_t *blk);
-    // reads one block from the disk
-    int read(unsigned block_no, uint8_t *blk);
+    // reads one block from the disk, failing if it does not match its
+    // checksum unless verify is false
+    int read(unsigned block_no, uint8_t *blk, bool verify = true);
+    // writes count consecutive blocks starting at block_no in one call
+    int write_blocks(unsigned block_no, unsigned count, const uint8_t *blks);
+    // reads count consecutive blocks starting at block_no in one call
+    int read_blocks(unsigned block_no, unsigned count, uint8_t *blks);
+    // waits until every block written so far is on stable storage
+    int sync();
+
+    // turns checksums on with the table of stored checksums, leaving out
+    // the skip_count blocks from skip_first on
+    void enable_checksums(const uint32_t *table, unsigned skip_first, unsigned skip_count);
+    bool checksums_enabled() { return crc_enabled; }
+    // copies the stored checksums of every block to table
+    void get_checksums(uint32_t *table);
+    uint32_t stored_checksum(unsigned block_no) { return crcs[block_no]; }
+    void set_checksum(unsigned block_no, uint32_t crc) { crcs[block_no] = crc; }
+    // the checksum stored for a block holding blk; never 0
+    static uint32_t block_checksum(const uint8_t *blk);
 };
 
+typedef BasicDisk<BLOCK_SIZE> Disk;
+
 #endif // __DISK_H__
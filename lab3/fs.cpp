@@ -1,106 +1,250 @@
 #include <iostream>
 #include <iomanip>
+#include <sstream>
 #include <cstring>
 #include <algorithm>
 #include "fs.h"
 
-FS::FS()
+// Session the calling thread runs its commands in, nullptr for the default
+static thread_local fs_session *active_session = nullptr;
+// Streams the calling thread's commands read from and print to, nullptr
+// for std::cin and std::cout
+static thread_local std::istream *active_in = nullptr;
+static thread_local std::ostream *active_out = nullptr;
+
+template <int BlockSize>
+BasicFS<BlockSize>::BasicFS(const std::string &diskname) : disk(diskname)
 {
     std::cout << "FS::FS()... Creating file system\n";
     disk.read(FAT_BLOCK, (uint8_t*)fat);
-    disk.read(ROOT_BLOCK, (uint8_t*)root_dir);
-    memcpy(cwd.entries, root_dir, sizeof(root_dir));
-    cwd.info = root_dir[PARENT_DIR_ENTRY_INDEX];
-    cwd.blk = ROOT_BLOCK;
+    root_blk = ROOT_BLOCK;
+    mounted_snapshot = -1;
+    view_fat = fat;
+    trace.enabled = false;
+    verify_cached_dirs = true;
+    journal_mount();
+    load_path_index();
+    load_snapshots();
+    build_alloc_groups();
+    load_counters();
+    // Checking the FAT alone takes one pass over it, so it runs at every
+    // mount; fsck walks the tree
+    if (fat[ROOT_BLOCK] != FAT_FREE || fat[FAT_BLOCK] != FAT_FREE) {
+        fsck_report report = {true, false, false, 0, 0};
+        check_fat(&report);
+        if (report.problems > 0) {
+            std::cout << "FS::FS()... " << report.problems << " problems in the FAT, run fsck\n";
+        }
+    }
+    default_session = open_session();
 }
 
-FS::~FS()
+template <int BlockSize>
+BasicFS<BlockSize>::~BasicFS()
 {
-    disk.write(FAT_BLOCK, (uint8_t*)fat);
-    disk.write(cwd.blk, (uint8_t*)cwd.entries);
+    if (tracing()) {
+        trace_stop();
+    }
+    journal_stop();
+    // After a failed transaction the FAT holds changes that never reached
+    // the disk
+    if (!journal.failed) {
+        disk.write(FAT_BLOCK, (uint8_t*)fat);
+        save_counters();
+    }
+}
+
+op_locks::op_locks(rw_lock *ns, bool exclusive) : ns(ns), exclusive(exclusive)
+{
+    if (exclusive) {
+        ns->write();
+    } else {
+        ns->read();
+    }
+}
+
+op_locks::~op_locks()
+{
+    for (size_t i = held.size(); i-- > 0;) {
+        held[i]->lock.unlock();
+    }
+    ns->unlock();
 }
 
 void
-FS::get_filename_parts(std::string filepath, std::string *filename, std::string *dirpath) {
-    if (find_dir_from_path(filepath) == -1) {
-        *filename = filepath.substr(filepath.find_last_of("/") + 1);
-        if (filepath.rfind("/", 0) == std::string::npos) { // Convert relative path to absolute path
-            *dirpath = get_pwd_string() + "/" + filepath.substr(0, filepath.find_last_of("/") + 1);
+op_locks::lock_dirs(dir_struct *a, bool write_a, dir_struct *b, bool write_b)
+{
+    if (exclusive) {
+        return;
+    }
+    if (b == a) {
+        write_a = write_a || write_b;
+        b = nullptr;
+    }
+    if (b != nullptr && b->blk < a->blk) {
+        std::swap(a, b);
+        std::swap(write_a, write_b);
+    }
+    if (write_a) {
+        a->lock.write();
+    } else {
+        a->lock.read();
+    }
+    held.push_back(a);
+    if (b != nullptr) {
+        if (write_b) {
+            b->lock.write();
         } else {
-            *dirpath = filepath.substr(0, filepath.find_last_of("/") + 1);
+            b->lock.read();
         }
-    } else {
-        *filename = "";
-        *dirpath = filepath;
+        held.push_back(b);
     }
 }
 
-int
-FS::find_empty_block() { 
-    int blk_no = -1;
-    for(int i = 0; i < FAT_ENTRIES; i++) {
-        if (fat[i] == FAT_FREE) {
-            blk_no = i;
+// Creates a session whose cwd is the root directory
+template <int BlockSize>
+fs_session*
+BasicFS<BlockSize>::open_session()
+{
+    std::lock_guard<std::mutex> guard(sessions_lock);
+    fs_session s;
+    s.cwd_blk = root_blk;
+    sessions.push_back(s);
+    return &sessions.back();
+}
+
+template <int BlockSize>
+void
+BasicFS<BlockSize>::close_session(fs_session *s)
+{
+    if (active_session == s) {
+        active_session = nullptr;
+    }
+    std::lock_guard<std::mutex> guard(sessions_lock);
+    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+        if (&*it == s && s != default_session) {
+            sessions.erase(it);
             break;
         }
     }
-    if (blk_no == -1) {
-        std::cerr << "FS::find_empty_block: No free blocks" << std::endl;
-        return -1;
-    }
-    return blk_no;
 }
 
-int
-FS::write_data(int starting_block, std::string data) {
-    int blk_no = starting_block;
+// Makes the calling thread run its commands in s, nullptr for the default
+// session. A session must not be used by two threads at once.
+template <int BlockSize>
+void
+BasicFS<BlockSize>::use_session(fs_session *s)
+{
+    active_session = s;
+}
 
-    int write = disk.write(blk_no, (uint8_t*)data.c_str());
-    if (write == -1) {
-        std::cerr << "FS::write_data: Error writing block " << blk_no << " to disk" << std::endl;
-        return -1;
+template <int BlockSize>
+fs_session*
+BasicFS<BlockSize>::session()
+{
+    return active_session != nullptr ? active_session : default_session;
+}
+
+// Makes the calling thread's commands read from in and print to out,
+// nullptr for std::cin and std::cout
+template <int BlockSize>
+void
+BasicFS<BlockSize>::use_streams(std::istream *in, std::ostream *out)
+{
+    active_in = in;
+    active_out = out;
+}
+
+template <int BlockSize>
+std::istream&
+BasicFS<BlockSize>::in()
+{
+    return active_in != nullptr ? *active_in : std::cin;
+}
+
+template <int BlockSize>
+std::ostream&
+BasicFS<BlockSize>::out()
+{
+    return active_out != nullptr ? *active_out : std::cout;
+}
+
+// True if blk is the cwd of some session or lies on the path to one
+template <int BlockSize>
+bool
+BasicFS<BlockSize>::dir_in_use(int blk)
+{
+    std::lock_guard<std::mutex> guard(sessions_lock);
+    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+        if (it->cwd_blk == blk ||
+            std::find(it->cwd_path_blks.begin(), it->cwd_path_blks.end(), blk) != it->cwd_path_blks.end()) {
+            return true;
+        }
     }
-    fat[blk_no] = FAT_EOF;
+    return false;
+}
 
-    if (DEBUG) {
-        std::cout << "FS::write_data: data size: " << data.length() << ", block: no: " << blk_no << std::endl;
+template <int BlockSize>
+void
+BasicFS<BlockSize>::get_filename_parts(std::string filepath, std::string *filename, std::string *dirpath) {
+    if (find_dir_from_path(filepath) == -1) {
+        // Relative paths stay relative, resolve_dir walks them from the cwd
+        *filename = filepath.substr(filepath.find_last_of("/") + 1);
+        *dirpath = filepath.substr(0, filepath.find_last_of("/") + 1);
+    } else {
+        *filename = "";
+        *dirpath = filepath;
     }
-    while(data.length() >= BLOCK_SIZE) {
-        data = data.substr(BLOCK_SIZE);
-        
-        int prev_blk_no = blk_no;
-        int blk_no = find_empty_block();
-        if (blk_no == -1) {
-            std::cerr << "FS::write_data: Failed to find empty block" << std::endl;
-            return -1;
-        }
-        fat[prev_blk_no] = blk_no;        
+}
 
-        int write = disk.write(blk_no, (uint8_t*)data.c_str());
-        if (write == -1) {
+// Writes data, plus the NUL terminator files carry, to a chain starting at
+// starting_block. Every block is copied into a zero padded buffer first, so
+// the last one never reads past the end of data.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::write_data(int starting_block, std::string data) {
+    int blk_no = starting_block;
+    size_t offset = 0;
+    uint8_t buf[BlockSize];
+    set_fat(blk_no, FAT_EOF);
+    while (true) {
+        size_t length = std::min(data.length() - offset, (size_t)BlockSize);
+        memset(buf, 0, BlockSize);
+        memcpy(buf, data.data() + offset, length);
+        if (disk.write(blk_no, buf) == -1) {
             std::cerr << "FS::write_data: Error writing block " << blk_no << " to disk" << std::endl;
             return -1;
         }
-    
-        fat[blk_no] = FAT_EOF;
-        
         if (DEBUG) {
-            std::cout << "FS::write_data: data size: " << data.length() << ", block: no: " << blk_no << std::endl;
+            out() << "FS::write_data: data size: " << data.length() - offset << ", block: no: " << blk_no << std::endl;
+        }
+        offset += length;
+        if (length < BlockSize) { // the terminator fit in this block
+            break;
+        }
+
+        int prev_blk_no = blk_no;
+        blk_no = find_empty_block(prev_blk_no);
+        if (blk_no == -1) {
+            std::cerr << "FS::write_data: Failed to find empty block" << std::endl;
+            return -1;
         }
+        set_fat(prev_blk_no, blk_no);
     }
     return 0;
 }
 
+template <int BlockSize>
 int
-FS::read_data(int start_blk, uint8_t* out_buf, size_t size) { 
+BasicFS<BlockSize>::read_data(int start_blk, uint8_t* out_buf, size_t size) { 
     int current_blk = start_blk;
     size_t bytes_read = 0;
-    uint8_t buf[BLOCK_SIZE];
+    uint8_t buf[BlockSize];
     while (current_blk != FAT_EOF && bytes_read < size) {
-        // Ensure 0 <= bytes_to_read <= BLOCK_SIZE
-        size_t bytes_to_read = std::max(std::min((ulong)BLOCK_SIZE, size - bytes_read), 0ul);
+        // Ensure 0 <= bytes_to_read <= BlockSize
+        size_t bytes_to_read = std::max(std::min((ulong)BlockSize, size - bytes_read), 0ul);
         if (DEBUG) {
-            std::cout << "FS:read_data: size: " << size << ", bytes_to_read: " << bytes_to_read << ", bytes_read: " << bytes_read << std::endl;
+            out() << "FS:read_data: size: " << size << ", bytes_to_read: " << bytes_to_read << ", bytes_read: " << bytes_read << std::endl;
         }
         
         int read = disk.read(current_blk, buf);
@@ -112,14 +256,15 @@ FS::read_data(int start_blk, uint8_t* out_buf, size_t size) {
         memcpy(&out_buf[bytes_read], buf, bytes_to_read);
         bytes_read += bytes_to_read;
 
-        current_blk = fat[current_blk];
+        current_blk = view_fat[current_blk];
     }
     return 0;
 }
 
+template <int BlockSize>
 int
-FS::init_dir(struct dir_entry *dir, int parent_blk, uint8_t parent_access_rights) {
-    for (int i = 0; i < BLOCK_SIZE/sizeof(dir_entry); i++) {
+BasicFS<BlockSize>::init_dir(struct dir_entry *dir, int parent_blk, uint8_t parent_access_rights) {
+    for (int i = 0; i < BlockSize/sizeof(dir_entry); i++) {
         memset(dir[i].file_name, 0, 56);
         dir[i].size = 0;
         dir[i].first_blk = 0;
@@ -133,222 +278,608 @@ FS::init_dir(struct dir_entry *dir, int parent_blk, uint8_t parent_access_rights
     return 0;
 }
 
+template <int BlockSize>
 dir_entry*
-FS::find_dir_entry(std::string filename) {
-    int current_blk = -1;
-    for (int i = 0; i < DIR_SIZE; i++) {
-        if (strncmp(cwd.entries[i].file_name, filename.c_str(), 56) == 0) {
-            return &cwd.entries[i];
-        }
+BasicFS<BlockSize>::find_dir_entry(dir_struct *dir, std::string filename) {
+    int slot = lookup_dir_index(dir, filename.c_str());
+    if (slot != -1) {
+        return &dir->entries[slot];
     }
     if (DEBUG) {
-        std::cout << "FS::find_dir_entry: entry \"" << filename << "\" not found in " << cwd.info.file_name << std::endl;
+        out() << "FS::find_dir_entry: entry \"" << filename << "\" not found in " << dir->info.file_name << std::endl;
     }
     return nullptr;
 }
 
+template <int BlockSize>
 int
-FS::find_empty_dir_index() {
-    int dir_index = -1;
-    for (int i = 1; i < DIR_SIZE; i++) {
-        if (cwd.entries[i].first_blk == FAT_FREE) {
-            dir_index = i;
-            break;
+BasicFS<BlockSize>::find_empty_dir_index(dir_struct *dir) {
+    for (size_t w = 0; w < dir->index.free_slots.size(); w++) {
+        if (dir->index.free_slots[w] != 0) {
+            return w * 64 + __builtin_ctzll(dir->index.free_slots[w]);
         }
     }
-    if (dir_index == -1) {
-        std::cerr << "FS::find_empty_dir_index: No free space in directory" << cwd.info.file_name << std::endl;
+    int slot = grow_dir(dir);
+    if (slot == -1) {
+        std::cerr << "FS::find_empty_dir_index: No free space in directory" << dir->info.file_name << std::endl;
         return -1;
     }
-    return dir_index;
+    return slot;
 }
 
-int
-FS::find_dir_from_path(std::string dirpath) {
-    if (dirpath.empty()) {
-        return 0;
+// Returns the cached directory starting at blk, loading it on first use.
+// The directory is loaded without holding cache_lock, so two threads may
+// load it at once; the first copy to reach the cache wins. info is the
+// entry the parent holds for it, if the caller has it.
+template <int BlockSize>
+dir_struct*
+BasicFS<BlockSize>::get_dir(int blk, const dir_entry *info) {
+    {
+        std::lock_guard<std::mutex> guard(cache_lock);
+        auto it = dir_cache.find(blk);
+        if (it != dir_cache.end()) {
+            return &it->second;
+        }
     }
-    if (cwd.blk == ROOT_BLOCK) {
-        memcpy(root_dir, cwd.entries, sizeof(cwd.entries));
+    dir_struct loaded;
+    if (load_dir(blk, &loaded, info) == -1) {
+        return nullptr;
     }
+    std::lock_guard<std::mutex> guard(cache_lock);
+    return &dir_cache.emplace(blk, std::move(loaded)).first->second;
+}
 
-    std::string current_dir_name;
-    int current_blk = -1;
-    struct dir_entry current_dir[DIR_SIZE];
-    if (dirpath.rfind('/', 0) == 0) { // Absolute path
-        dirpath.erase(0, 1);
-        current_blk = ROOT_BLOCK;
-        memcpy(current_dir, root_dir, sizeof(root_dir));
-    } else { // Relative path
-        current_blk = cwd.blk;
-        memcpy(current_dir, cwd.entries, sizeof(cwd.entries));
+// Returns the directory entry points to
+template <int BlockSize>
+dir_struct*
+BasicFS<BlockSize>::get_dir(const dir_entry &entry) {
+    return get_dir(entry.first_blk);
+}
+
+// Collects the FAT chain starting at first_blk
+template <int BlockSize>
+int
+BasicFS<BlockSize>::get_chain(int first_blk, std::vector<int> *blocks) {
+    blocks->clear();
+    int current_blk = first_blk;
+    while (current_blk != FAT_EOF) {
+        if (current_blk < 0 || current_blk >= fat_entries || blocks->size() >= fat_entries) {
+            std::cerr << "FS::get_chain: Broken block chain starting at block " << first_blk << std::endl;
+            return -1;
+        }
+        blocks->push_back(current_blk);
+        current_blk = get_fat(current_blk);
+        if (current_blk == FAT_FREE) {
+            break;
+        }
     }
+    return 0;
+}
 
-    int str_pos = 0;
-    while (str_pos != std::string::npos) {
-        str_pos = dirpath.find("/", str_pos);
-        current_dir_name = dirpath.substr(0, str_pos);
-        int found = 0;
-        for (int i = 0; i < DIR_SIZE; i++) {
-            if (current_dir_name.empty() || strncmp(current_dir_name.c_str(), current_dir[i].file_name, 56) == 0 && current_dir[i].type == TYPE_DIR) {
-                current_blk = current_dir[i].first_blk;
-                int read = disk.read(current_blk, (uint8_t*)current_dir);
-                if (read == -1) {
-                    std::cout << "Error reading from disk" << std::endl;
-                    return -1;
+// Reads every block of the directory starting at blk without indexing it.
+// Only reads the FAT, so several threads may call it at once.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::read_dir_blocks(int blk, std::vector<int> *blocks, std::vector<dir_entry> *entries) {
+    if (get_chain(blk, blocks) == -1) {
+        std::cerr << "FS::read_dir_blocks: Broken block chain in directory block " << blk << std::endl;
+        return -1;
+    }
+    bool verify = true;
+    if (!verify_cached_dirs) {
+        std::lock_guard<std::mutex> guard(cache_lock);
+        verify = dir_cache.count(blk) == 0;
+    }
+    entries->resize(blocks->size() * dir_size);
+    for (size_t i = 0; i < blocks->size(); i++) {
+        if (read_meta((*blocks)[i], (uint8_t*)&(*entries)[i * dir_size], verify) == -1) {
+            std::cerr << "FS::read_dir_blocks: Error reading block " << (*blocks)[i] << " from disk" << std::endl;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Reads every block of the directory starting at blk and indexes it
+template <int BlockSize>
+int
+BasicFS<BlockSize>::load_dir(int blk, dir_struct *dir, const dir_entry *info) {
+    dir->blk = blk;
+    if (read_dir_blocks(blk, &dir->blocks, &dir->entries) == -1) {
+        return -1;
+    }
+    // A directory's access rights live in the entry its parent holds for
+    // it. Should the parent not hold one, the rights its children's ".."
+    // carry are the best guess.
+    dir->info = dir->entries[PARENT_DIR_ENTRY_INDEX];
+    dir->info.first_blk = blk;
+    if (info != nullptr) {
+        dir->info = *info;
+    } else if (blk != root_blk) {
+        dir_struct *parent = get_dir(dir->entries[PARENT_DIR_ENTRY_INDEX].first_blk);
+        if (parent != nullptr) {
+            parent->lock.read();
+            for (size_t i = 1; i < parent->entries.size(); i++) {
+                if (parent->entries[i].first_blk == blk && parent->entries[i].type == TYPE_DIR) {
+                    dir->info = parent->entries[i];
+                    break;
                 }
-                found = 1;
-                break;
             }
+            parent->lock.unlock();
         }
-        if (found == 0) {
+    }
+    build_dir_index(dir);
+    return 0;
+}
+
+template <int BlockSize>
+int
+BasicFS<BlockSize>::save_dir(dir_struct *dir) {
+    for (size_t i = 0; i < dir->blocks.size(); i++) {
+        if (write_meta(dir->blocks[i], (uint8_t*)&dir->entries[i * dir_size]) == -1) {
+            std::cerr << "FS::save_dir: Error writing block " << dir->blocks[i] << " to disk" << std::endl;
             return -1;
         }
-        dirpath.erase(0, str_pos + 1);
     }
     return 0;
 }
 
+// Links a new, empty block to the end of the directory and returns the
+// first slot in it. The block is written immediately so the on-disk chain
+// is always a valid directory, even if the caller never saves it.
+template <int BlockSize>
 int
-FS::change_cwd(std::string dirpath) {
-    if (dirpath.empty()) {
-        return 0;
+BasicFS<BlockSize>::grow_dir(dir_struct *dir) {
+    int new_blk = find_empty_block(dir->blocks.back());
+    if (new_blk == -1) {
+        return -1;
     }
-    int write = disk.write(cwd.blk, (uint8_t*) cwd.entries);
-    if (write == -1) {
-        std::cout << "Error writing to disk" << std::endl;
+    std::vector<dir_entry> empty(dir_size);
+    memset(empty.data(), 0, BlockSize);
+    if (disk.write(new_blk, (uint8_t*)empty.data()) == -1) {
+        std::cerr << "FS::grow_dir: Error writing block " << new_blk << " to disk" << std::endl;
         return -1;
     }
-    if (cwd.blk == ROOT_BLOCK) {
-        memcpy(root_dir, cwd.entries, sizeof(cwd.entries));
+    set_fat(dir->blocks.back(), new_blk);
+    dir->blocks.push_back(new_blk);
+
+    int first_slot = dir->entries.size();
+    dir->entries.insert(dir->entries.end(), empty.begin(), empty.end());
+    dir->index.tags.resize(dir->entries.size(), 0);
+    dir->index.free_slots.resize(dir->entries.size() / 64 + 1, 0);
+    for (int i = first_slot; i < (int)dir->entries.size(); i++) {
+        dir->index.free_slots[i / 64] |= 1ull << (i % 64);
     }
+    return first_slot;
+}
 
-    std::string current_dir_name;
-    int current_blk = -1;
-    struct dir_entry current_dir[BLOCK_SIZE/sizeof(dir_entry)];
-    struct dir_entry new_cwd_info;
-    if (dirpath.rfind('/', 0) == 0) { // Absolute path
-        dirpath.erase(0, 1);
-        current_blk = ROOT_BLOCK;
-        memcpy(current_dir, root_dir, sizeof(root_dir));
-        new_cwd_info = root_dir[0]; // root dir info is ..
-    } else { // Relative path
-        current_blk = cwd.blk;
-        memcpy(current_dir, cwd.entries, sizeof(cwd.entries));
-        new_cwd_info = cwd.info;
+static uint32_t
+name_hash(const char *name) {
+    // FNV-1a over at most the 56 bytes stored in a dir_entry
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 56 && name[i] != '\0'; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
     }
+    return h;
+}
 
-    int str_pos = 0;
-    while (str_pos != std::string::npos) {
-        str_pos = dirpath.find("/", str_pos);
-        current_dir_name = dirpath.substr(0, str_pos);
-        int found = 0;
-        for (int i = 0; i < BLOCK_SIZE/sizeof(dir_entry); i++) {
-            if (current_dir_name.empty()) {
-                found = 1;
-                break;
-            }
-            if (strncmp(current_dir_name.c_str(), current_dir[i].file_name, 56) == 0 && current_dir[i].type == TYPE_DIR) {
-                current_blk = current_dir[i].first_blk;
-                new_cwd_info = current_dir[i];
-                int read = disk.read(current_blk, (uint8_t*)current_dir);
-                if (read == -1) {
-                    std::cout << "Error reading from disk" << std::endl;
-                    return -1;
-                }
-                found = 1;
-                break;
+static uint16_t
+name_tag(uint32_t hash) {
+    return (uint16_t)(hash >> 16);
+}
+
+std::string
+entry_name(const dir_entry &entry) {
+    return std::string(entry.file_name, strnlen(entry.file_name, 56));
+}
+
+template <int BlockSize>
+void
+BasicFS<BlockSize>::build_dir_index(dir_struct *dir) {
+    dir_index *index = &dir->index;
+    int n = dir->entries.size();
+    size_t buckets = dir_min_buckets;
+    while (buckets < (size_t)n * 2) {
+        buckets *= 2;
+    }
+    index->buckets.assign(buckets, DIR_BUCKET_EMPTY);
+    index->tags.assign(n, 0);
+    index->free_slots.assign(n / 64 + 1, 0);
+    index->sorted.clear();
+    index->used = 0;
+    index->tombstones = 0;
+    for (int i = 0; i < n; i++) {
+        if (i != PARENT_DIR_ENTRY_INDEX && dir->entries[i].first_blk == FAT_FREE) {
+            index->free_slots[i / 64] |= 1ull << (i % 64);
+        } else {
+            insert_dir_index(dir, i);
+        }
+    }
+}
+
+template <int BlockSize>
+int
+BasicFS<BlockSize>::lookup_dir_index(const dir_struct *dir, const char *name) {
+    const dir_index *index = &dir->index;
+    if (name[0] == '\0') {
+        return -1;
+    }
+    uint32_t h = name_hash(name);
+    uint16_t tag = name_tag(h);
+    size_t mask = index->buckets.size() - 1;
+    for (size_t probe = 0; probe <= mask; probe++) {
+        uint32_t bucket = index->buckets[(h + probe) & mask];
+        if (bucket == DIR_BUCKET_EMPTY) {
+            break;
+        }
+        if (bucket == DIR_BUCKET_TOMBSTONE) {
+            continue;
+        }
+        int slot = bucket - 1;
+        if (index->tags[slot] == tag && strncmp(dir->entries[slot].file_name, name, 56) == 0) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+template <int BlockSize>
+void
+BasicFS<BlockSize>::insert_dir_index(dir_struct *dir, int slot) {
+    dir_index *index = &dir->index;
+    if ((size_t)(index->used + index->tombstones + 1) * 2 > index->buckets.size()) {
+        build_dir_index(dir); // also indexes slot if it is already in use
+        if (lookup_dir_index(dir, dir->entries[slot].file_name) == slot) {
+            return;
+        }
+    }
+    const char *name = dir->entries[slot].file_name;
+    uint32_t h = name_hash(name);
+    index->tags[slot] = name_tag(h);
+    index->free_slots[slot / 64] &= ~(1ull << (slot % 64));
+    index->sorted[entry_name(dir->entries[slot])] = slot;
+    index->used++;
+    size_t mask = index->buckets.size() - 1;
+    for (size_t probe = 0; probe <= mask; probe++) {
+        uint32_t *bucket = &index->buckets[(h + probe) & mask];
+        if (*bucket == DIR_BUCKET_EMPTY || *bucket == DIR_BUCKET_TOMBSTONE) {
+            if (*bucket == DIR_BUCKET_TOMBSTONE) {
+                index->tombstones--;
             }
+            *bucket = slot + 1;
+            return;
         }
-        if (found == 0) {
-            std::cout << "Path not found" << std::endl;
-            return -1;
+    }
+}
+
+template <int BlockSize>
+void
+BasicFS<BlockSize>::remove_dir_index(dir_struct *dir, int slot) {
+    dir_index *index = &dir->index;
+    uint32_t h = name_hash(dir->entries[slot].file_name);
+    size_t mask = index->buckets.size() - 1;
+    for (size_t probe = 0; probe <= mask; probe++) {
+        uint32_t *bucket = &index->buckets[(h + probe) & mask];
+        if (*bucket == DIR_BUCKET_EMPTY) {
+            break;
+        }
+        if (*bucket == (uint32_t)slot + 1) {
+            *bucket = DIR_BUCKET_TOMBSTONE;
+            index->tombstones++;
+            index->used--;
+            index->sorted.erase(entry_name(dir->entries[slot]));
+            break;
         }
-        dirpath.erase(0, str_pos + 1);
     }
-    cwd.info = new_cwd_info;
-    cwd.blk = current_blk;
-    memcpy(cwd.entries, current_dir, sizeof(current_dir));
-    return 0;
+    if (slot != PARENT_DIR_ENTRY_INDEX) {
+        index->free_slots[slot / 64] |= 1ull << (slot % 64);
+    }
 }
 
+// Looks up name in a loaded directory. type -1 matches any entry type.
+template <int BlockSize>
 int
-FS::exit_method(bool save = false) {
-    if (!save) {
-        memcpy(cwd.entries, cwd_backup.entries, sizeof(cwd.entries));
-        cwd.info = cwd_backup.info;
-        cwd.blk = cwd_backup.blk;
-        
-    } else {
-        if (cwd.blk != cwd_backup.blk) {
-            if (disk.write(cwd.blk, (uint8_t*) cwd.entries) == -1) {
-                std::cerr << "FS::exit_method: Fatal error when restoring cwd. Exiting." << std::endl;
-                exit(1);
-            };
-            cwd.blk = cwd_backup.blk;
-            cwd.info = cwd_backup.info;
-            memcpy(cwd.entries, cwd_backup.entries, sizeof(cwd.entries));
+BasicFS<BlockSize>::find_in_dir(const dir_struct *dir, const std::string &name, int type) {
+    int slot = lookup_dir_index(dir, name.c_str());
+    if (slot != -1 && type != -1 && dir->entries[slot].type != type) {
+        return -1;
+    }
+    return slot;
+}
+
+// Returns a pointer to entry slot of dir for in-place changes that keep the
+// name and the slot in use (size, access rights), remembering the old value.
+template <int BlockSize>
+dir_entry*
+BasicFS<BlockSize>::modify_entry(op_context *ctx, dir_struct *dir, int slot) {
+    ctx->dirs.push_back(dir);
+    ctx->slots.push_back(slot);
+    ctx->old_entries.push_back(dir->entries[slot]);
+    return &dir->entries[slot];
+}
+
+// Stores entry in slot of dir and keeps the index of dir in sync
+template <int BlockSize>
+void
+BasicFS<BlockSize>::set_entry(op_context *ctx, dir_struct *dir, int slot, const dir_entry &entry) {
+    modify_entry(ctx, dir, slot);
+    if (!(dir->index.free_slots[slot / 64] & (1ull << (slot % 64)))) {
+        remove_dir_index(dir, slot);
+    }
+    dir->entries[slot] = entry;
+    insert_dir_index(dir, slot);
+}
+
+// Wipes entry slot of dir and releases the slot in the index
+template <int BlockSize>
+void
+BasicFS<BlockSize>::clear_entry(op_context *ctx, dir_struct *dir, int slot) {
+    modify_entry(ctx, dir, slot);
+    remove_dir_index(dir, slot);
+    memset(&dir->entries[slot], 0, sizeof(dir_entry));
+    if (dir->index.tombstones > (int)dir->index.buckets.size() / 4) {
+        build_dir_index(dir);
+    }
+}
+
+// Collects the entries ctx changed for good: the old value of every slot
+// that held one before, with the directory's block, and every slot that
+// holds one now. Size changes are left out, and ".." never counts. An
+// access rights change is both, since the path index keeps the rights.
+template <int BlockSize>
+void
+BasicFS<BlockSize>::entry_changes(op_context *ctx, std::vector<std::pair<int, dir_entry>> *removed,
+                                  std::vector<std::pair<dir_struct*, int>> *inserted) {
+    std::vector<std::pair<dir_struct*, int>> seen;
+    for (size_t i = 0; i < ctx->dirs.size(); i++) {
+        std::pair<dir_struct*, int> slot(ctx->dirs[i], ctx->slots[i]);
+        if (slot.second == PARENT_DIR_ENTRY_INDEX || std::find(seen.begin(), seen.end(), slot) != seen.end()) {
+            continue;
+        }
+        seen.push_back(slot);
+        const dir_entry &old_entry = ctx->old_entries[i];
+        const dir_entry &new_entry = slot.first->entries[slot.second];
+        if (old_entry.first_blk == new_entry.first_blk && old_entry.type == new_entry.type &&
+            old_entry.access_rights == new_entry.access_rights &&
+            strncmp(old_entry.file_name, new_entry.file_name, 56) == 0) {
+            continue;
+        }
+        if (old_entry.first_blk != FAT_FREE) {
+            removed->push_back(std::make_pair(slot.first->blk, old_entry));
+        }
+        if (new_entry.first_blk != FAT_FREE) {
+            inserted->push_back(slot);
         }
     }
-    if (cwd.blk == ROOT_BLOCK) {
-        memcpy(root_dir, cwd.entries, sizeof(root_dir));
+}
+
+// Writes every directory block holding an entry changed through ctx, once,
+// and brings the path index and the counters in line. Puts the entries
+// back if the blocks do not fit in the running transaction.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::commit(op_context *ctx) {
+    std::vector<std::pair<dir_struct*, int>> written;
+    std::vector<int> blks;
+    std::vector<const uint8_t*> images;
+    for (size_t i = 0; i < ctx->dirs.size(); i++) {
+        std::pair<dir_struct*, int> blk(ctx->dirs[i], ctx->slots[i] / dir_size);
+        if (std::find(written.begin(), written.end(), blk) != written.end()) {
+            continue;
+        }
+        written.push_back(blk);
+        blks.push_back(blk.first->blocks[blk.second]);
+        images.push_back((const uint8_t*)&blk.first->entries[blk.second * dir_size]);
     }
+    if (write_dir_blocks(blks, images) == -1) {
+        std::cerr << "FS::commit: Error writing " << blks.size() << " directory blocks" << std::endl;
+        rollback(ctx);
+        return -1;
+    }
+    std::vector<std::pair<int, dir_entry>> removed;
+    std::vector<std::pair<dir_struct*, int>> inserted;
+    entry_changes(ctx, &removed, &inserted);
+    update_path_index(removed, inserted);
+    update_counters(removed, inserted);
+    ctx->dirs.clear();
+    ctx->slots.clear();
+    ctx->old_entries.clear();
     return 0;
 }
 
+// Puts back every entry changed through ctx, newest first
+template <int BlockSize>
+int
+BasicFS<BlockSize>::rollback(op_context *ctx) {
+    for (size_t i = ctx->dirs.size(); i-- > 0;) {
+        dir_struct *dir = ctx->dirs[i];
+        dir->entries[ctx->slots[i]] = ctx->old_entries[i];
+    }
+    for (size_t i = 0; i < ctx->dirs.size(); i++) {
+        if (std::find(ctx->dirs.begin(), ctx->dirs.begin() + i, ctx->dirs[i]) == ctx->dirs.begin() + i) {
+            build_dir_index(ctx->dirs[i]);
+        }
+    }
+    ctx->dirs.clear();
+    ctx->slots.clear();
+    ctx->old_entries.clear();
+    return 0;
+}
+
+template <int BlockSize>
+int
+BasicFS<BlockSize>::find_dir_from_path(std::string dirpath) {
+    if (dirpath.empty()) {
+        return 0;
+    }
+    return resolve_dir(dirpath) == nullptr ? -1 : 0;
+}
+
+// Walks dirpath from the root or the cwd and returns the directory it names,
+// or nullptr if it does not exist. The cwd is left untouched. Takes a read
+// lock on each directory it passes, so the caller must not hold any. With
+// the path index, only the directory it names is read.
+template <int BlockSize>
+dir_struct*
+BasicFS<BlockSize>::resolve_dir(std::string dirpath) {
+    if (path_index.enabled && mounted_snapshot == -1) {
+        bool answered = false;
+        dir_struct *dir = resolve_indexed(dirpath, &answered);
+        if (answered) {
+            return dir;
+        }
+    }
+    std::string current_dir_name;
+    dir_struct *current_dir;
+    if (dirpath.rfind('/', 0) == 0) { // Absolute path
+        dirpath.erase(0, 1);
+        current_dir = get_dir(root_blk);
+    } else { // Relative path
+        current_dir = get_dir(session()->cwd_blk);
+    }
+
+    size_t str_pos = 0;
+    while (str_pos != std::string::npos && current_dir != nullptr) {
+        str_pos = dirpath.find("/");
+        current_dir_name = dirpath.substr(0, str_pos);
+        if (!current_dir_name.empty()) {
+            current_dir->lock.read();
+            int slot = find_in_dir(current_dir, current_dir_name, TYPE_DIR);
+            int next_blk = slot == -1 ? -1 : current_dir->entries[slot].first_blk;
+            current_dir->lock.unlock();
+            if (slot == -1) {
+                return nullptr;
+            }
+            current_dir = get_dir(next_blk);
+        }
+        dirpath.erase(0, str_pos == std::string::npos ? str_pos : str_pos + 1);
+    }
+    return current_dir;
+}
+
 // formats the disk, i.e., creates an empty file system
+template <int BlockSize>
 int
-FS::format()
+BasicFS<BlockSize>::format()
 {
-    for (int i = 0; i < FAT_ENTRIES; i++) {
-        fat[i] = FAT_FREE;
-    }
-    fat[ROOT_BLOCK] = FAT_EOF;
-    fat[FAT_BLOCK] = FAT_EOF;
+    trace_scope trace(this, TRACE_FORMAT);
+    int ret;
+    {
+        tx_handle tx(&journal);
+        op_locks locks(&ns_lock, true);
+        if (check_writable() == -1) {
+            return -1;
+        }
+        // The flusher may be handing out blocks freed before the format,
+        // so the FAT is reset under the group locks
+        for (int g = 0; g < ALLOC_GROUPS; g++) {
+            std::lock_guard<std::mutex> guard(groups[g].lock);
+            for (int i = g * group_blocks; i < (g + 1) * group_blocks; i++) {
+                fat[i] = i < index_start + index_blocks ? FAT_EOF : FAT_FREE;
+                snap_refs[i] = 0;
+            }
+        }
+        build_alloc_groups();
+        if (!journal.enabled && init_journal() == -1) {
+            return -1;
+        }
+        memset(super.snapshots, 0, sizeof(super.snapshots));
+        file_count = 0;
+        dir_count = 0;
+        if (init_path_index() == -1 || init_checksums() == -1) {
+            return -1;
+        }
 
-    init_dir(root_dir, ROOT_BLOCK, READ | WRITE | EXECUTE);
-    memcpy(cwd.entries, root_dir, sizeof(root_dir));
-    cwd.blk = ROOT_BLOCK;
-    cwd.info = root_dir[PARENT_DIR_ENTRY_INDEX];
-    return 0;
+        std::lock_guard<std::mutex> guard(cache_lock);
+        dir_cache.clear();
+        dir_struct *root_dir = &dir_cache[ROOT_BLOCK];
+        root_dir->entries.resize(dir_size);
+        init_dir(root_dir->entries.data(), ROOT_BLOCK, READ | WRITE | EXECUTE);
+        root_dir->blocks.assign(1, ROOT_BLOCK);
+        root_dir->blk = ROOT_BLOCK;
+        root_dir->info = root_dir->entries[PARENT_DIR_ENTRY_INDEX];
+        build_dir_index(root_dir);
+        {
+            std::lock_guard<std::mutex> guard(sessions_lock);
+            for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+                it->cwd_blk = ROOT_BLOCK;
+                it->cwd_path.clear();
+                it->cwd_path_blks.clear();
+            }
+        }
+        ret = save_dir(root_dir);
+    }
+    // Blocks of the old file system are free at once, so the new one has
+    // to be on disk before a crash could bring the old one back
+    if (journal_sync() == -1) {
+        return -1;
+    }
+    return ret;
 }
 
 // create <filepath> creates a new file on the disk, the data content is
 // written on the following rows (ended with an empty row)
+template <int BlockSize>
 int
-FS::create(std::string filepath)
+BasicFS<BlockSize>::create(std::string filepath)
 {
-    enter_method();
+    return create_file(filepath, nullptr);
+}
+
+// Creates the file filepath holding data, or the lines read from the input
+// stream up to an empty line if data is nullptr
+template <int BlockSize>
+int
+BasicFS<BlockSize>::create_file(std::string filepath, const std::string *data_in)
+{
+    trace_scope trace(this, TRACE_CREATE, filepath);
+    // The data is read before the command joins a transaction, so a user
+    // typing it holds up neither group commit nor other commands
+    std::string data;
+    if (data_in != nullptr) {
+        data = *data_in;
+    } else {
+        std::string line;
+        while (std::getline(in(), line)) {
+            if (line.empty())
+                break;
+            data.append(line + '\n');
+        }
+    }
+    trace.size = data.length();
+
+    tx_handle tx(&journal);
+    op_locks locks(&ns_lock, false);
+    if (check_writable() == -1) {
+        return -1;
+    }
+    op_context ctx;
 
     std::string filename;
     std::string dirpath;
     get_filename_parts(filepath, &filename, &dirpath);
     if (filename.empty()) {
-        std::cout << "Cannot create file with same name as a directory." << std::endl;
+        out() << "Cannot create file with same name as a directory." << std::endl;
         return -1;
     }
-    if (change_cwd(dirpath) == -1) {
+    dir_struct *dir = resolve_dir(dirpath);
+    if (dir == nullptr) {
+        out() << "Path not found" << std::endl;
         return -1;
     }
-    if (!has_permission(cwd.info, WRITE | EXECUTE)) {
-        std::cout << "You do not have permission to create files in this directory." << std::endl;
-        return exit_method();
+    locks.lock_dirs(dir, true);
+    if (!has_permission(dir->info, WRITE | EXECUTE)) {
+        out() << "You do not have permission to create files in this directory." << std::endl;
+        return rollback(&ctx);
     }
 
-    dir_entry* existing = find_dir_entry(filename);
+    dir_entry* existing = find_dir_entry(dir, filename);
     if (existing != nullptr) {
-        std::cout << "A file or directory named " << filename << " already exists in this directory." << std::endl;
-        return exit_method();
+        out() << "A file or directory named " << filename << " already exists in this directory." << std::endl;
+        return rollback(&ctx);
     }
 
-    std::string data;
-    std::string in;
-    while (std::getline(std::cin, in)) {
-        if (in.empty())
-            break;
-        data.append(in + '\n');
-    }
-    
     dir_entry file;
     int size = data.length() + 1; // Include null terminator.
     strncpy(file.file_name, filename.c_str(), 56);
@@ -357,132 +888,276 @@ FS::create(std::string filepath)
     file.access_rights = READ | WRITE;
 
     if (DEBUG) {
-        std::cout << "FS::create: Data length: " << data.length() << ", size: " << size << std::endl;
-    }
-    
-    int blk_no = find_empty_block();
-    if (blk_no == -1) {
-        return exit_method();
+        out() << "FS::create: Data length: " << data.length() << ", size: " << size << std::endl;
     }
-    file.first_blk = blk_no;
 
-
-    int dir_index = find_empty_dir_index();
+    // Claim the slot first, growing the directory may allocate a block
+    int dir_index = find_empty_dir_index(dir);
     if (dir_index == -1) {
         std::cerr << "FS::create: No free space in directory\n";
-        exit_method();
+        rollback(&ctx);
         return -1;
     }
 
+    int blk_no = find_empty_block();
+    if (blk_no == -1) {
+        return rollback(&ctx);
+    }
+    file.first_blk = blk_no;
+
     if (write_data(file.first_blk, data) == -1) {
-        exit_method();
+        free_chain(file.first_blk);
+        rollback(&ctx);
         return -1;
     }
-    cwd.entries[dir_index] = file;
+    set_entry(&ctx, dir, dir_index, file);
 
-    exit_method(true);
-    return 0;
-}
-
-int
-FS::enter_method() {
-    cwd_backup.blk = cwd.blk;
-    cwd_backup.info = cwd.info;
-    memcpy(cwd_backup.entries, cwd.entries, sizeof(cwd.entries));
-    return 0;
+    return commit(&ctx);
 }
 
 // cat <filepath> reads the content of a file and prints it on the screen
+template <int BlockSize>
 int
-FS::cat(std::string filepath)
+BasicFS<BlockSize>::cat(std::string filepath)
 {
-    enter_method();
-    
+    trace_scope trace(this, TRACE_CAT, filepath);
+    op_locks locks(&ns_lock, false);
     std::string filename;
     std::string dirpath;
     get_filename_parts(filepath, &filename, &dirpath);
     if (filename.empty()) {
-        std::cout << "Filename is empty" << std::endl;
+        out() << "Filename is empty" << std::endl;
         return -1;
     }
-    if (change_cwd(dirpath) == -1) {
+    dir_struct *dir = resolve_dir(dirpath);
+    if (dir == nullptr) {
+        out() << "Path not found" << std::endl;
         return -1;
     }
-    
-    dir_entry* file = find_dir_entry(filename);
+    locks.lock_dirs(dir, false);
+
+    dir_entry* file = find_dir_entry(dir, filename);
     if (file == nullptr) {
-        std::cout << "File \"" << filename << "\" not found" << std::endl;
-        return exit_method();
+        out() << "File \"" << filename << "\" not found" << std::endl;
+        return 0;
     }
     if (file->type == TYPE_DIR) {
-        std::cout << filename << " is not a file" << std::endl;
-        return exit_method();
+        out() << filename << " is not a file" << std::endl;
+        return 0;
     }
     if (!has_permission(*file, READ))  {
-        std::cout << "You do not have permission to read " << filename << std::endl;
-        return exit_method();
+        out() << "You do not have permission to read " << filename << std::endl;
+        return 0;
     }
     int blk_no = file->first_blk;
     uint8_t buf[file->size];
 
     if (read_data(blk_no, buf, file->size) == -1) {
-        exit_method();
         return -1;
     }
-    
-    std::cout << buf << std::endl;
-    exit_method();
+
+    out() << buf << std::endl;
+    return 0;
+}
+
+// Reads the whole file filepath into data. Unlike cat it keeps any bytes
+// after a NUL, so binary files survive the round trip.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::read_file(std::string filepath, std::string *data)
+{
+    trace_scope trace(this, TRACE_READ, filepath);
+    op_locks locks(&ns_lock, false);
+    std::string filename;
+    std::string dirpath;
+    get_filename_parts(filepath, &filename, &dirpath);
+    dir_struct *dir = filename.empty() ? nullptr : resolve_dir(dirpath);
+    if (dir == nullptr) {
+        out() << "File not found" << std::endl;
+        return -1;
+    }
+    locks.lock_dirs(dir, false);
+
+    dir_entry *file = find_dir_entry(dir, filename);
+    if (file == nullptr || file->type == TYPE_DIR) {
+        out() << "File \"" << filename << "\" not found" << std::endl;
+        return -1;
+    }
+    if (!has_permission(*file, READ)) {
+        out() << "You do not have permission to read " << filename << std::endl;
+        return -1;
+    }
+    std::vector<uint8_t> buf(file->size);
+    if (read_data(file->first_blk, buf.data(), file->size) == -1) {
+        return -1;
+    }
+    // The stored size counts the NUL terminator create appends
+    data->assign((char*)buf.data(), file->size > 0 ? file->size - 1 : 0);
     return 0;
 }
 
 // ls lists the content in the currect directory (files and sub-directories)
+template <int BlockSize>
 int
-FS::ls()
+BasicFS<BlockSize>::ls()
 {
-    if (!has_permission(cwd.info, READ)) {
-        std::cout << "You do not have permissions to read the contents of this directory" << std::endl;
+    return ls("", false);
+}
+
+// ls [-l] <dirpath> lists the content of <dirpath>, with -l also the
+// number of blocks each entry uses
+template <int BlockSize>
+int
+BasicFS<BlockSize>::ls(std::string dirpath, bool long_format)
+{
+    trace_scope trace(this, TRACE_LS, dirpath, "", long_format);
+    op_locks locks(&ns_lock, false);
+    dir_struct *dir = resolve_dir(dirpath);
+    if (dir == nullptr) {
+        out() << "Path not found" << std::endl;
+        return -1;
+    }
+    if (!has_permission(dir->info, READ)) {
+        out() << "You do not have permissions to read the contents of this directory" << std::endl;
         return 0;
     }
-    std::cout << std::left;
-    std::cout << std::setw(56) << "name" << "\ttype\taccessrights\tsize\n";
-    for (int i = 0; i < DIR_SIZE; i++) {
-        dir_entry entry = cwd.entries[i];
-        if (!dir_entry_is_empty(entry)) {
+    dir_stream stream;
+    if (opendir(dirpath, &stream, true) == -1) {
+        return -1;
+    }
+    // Formatted in a local stream, so concurrent listings do not share the
+    // width and alignment state of out()
+    std::ostringstream listing;
+    listing << std::left;
+    listing << std::setw(56) << "name" << "\ttype\taccessrights\tsize" << (long_format ? "\tblocks\n" : "\n");
+    std::vector<dir_stat> batch;
+    int n;
+    while ((n = readdir(&stream, &batch, dir_size)) > 0) {
+        for (size_t i = 0; i < batch.size(); i++) {
+            dir_entry entry = batch[i].entry;
             std::string type_name = entry.type == TYPE_DIR ? "Dir" : "File";
-            std::cout << std::setw(56) << entry.file_name << "\t" << type_name << "\t";
-            std::cout << (((entry.access_rights & READ) != 0) ? "r" : "-");
-            std::cout << (((entry.access_rights & WRITE) != 0) ? "w" : "-");
-            std::cout << (((entry.access_rights & EXECUTE) != 0) ? "e" : "-");
-            std::cout << "\t\t" << (entry.type == TYPE_DIR ? "-" : std::to_string(entry.size)) << std::endl;
+            listing << std::setw(56) << batch[i].name << "\t" << type_name << "\t";
+            listing << (((entry.access_rights & READ) != 0) ? "r" : "-");
+            listing << (((entry.access_rights & WRITE) != 0) ? "w" : "-");
+            listing << (((entry.access_rights & EXECUTE) != 0) ? "e" : "-");
+            listing << "\t\t" << (entry.type == TYPE_DIR ? "-" : std::to_string(entry.size));
+            if (long_format) {
+                listing << "\t" << batch[i].blocks;
+            }
+            listing << "\n";
         }
+        batch.clear();
     }
+    out() << listing.str() << std::flush;
+    closedir(&stream);
+    return n;
+}
+
+template <int BlockSize>
+int
+BasicFS<BlockSize>::opendir(std::string dirpath, dir_stream *stream, bool sorted)
+{
+    dir_struct *dir = resolve_dir(dirpath);
+    if (dir == nullptr) {
+        return -1;
+    }
+    stream->blk = dir->blk;
+    stream->sorted = sorted;
+    stream->next_slot = 0;
+    stream->last_name.clear();
+    stream->at_end = false;
     return 0;
 }
 
+// Returns the next entries of the stream, reading them straight out of the
+// cached directory. Block counts come from the in-memory FAT, so no entry
+// costs a lookup or a disk read of its own.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::readdir(dir_stream *stream, std::vector<dir_stat> *batch, size_t max)
+{
+    if (stream->at_end) {
+        return 0;
+    }
+    dir_struct *dir = get_dir(stream->blk);
+    if (dir == nullptr) {
+        return -1;
+    }
+    dir->lock.read();
+    size_t added = 0;
+    std::vector<int> chain;
+    auto emit = [&](int slot) {
+        dir_stat stat;
+        stat.entry = dir->entries[slot];
+        stat.name = entry_name(stat.entry);
+        stat.blocks = get_chain(stat.entry.first_blk, &chain) == 0 ? chain.size() : 0;
+        batch->push_back(stat);
+        added++;
+    };
+
+    if (stream->sorted) {
+        auto it = stream->next_slot == 0
+            ? dir->index.sorted.begin()
+            : dir->index.sorted.upper_bound(stream->last_name);
+        for (; it != dir->index.sorted.end() && added < max; ++it) {
+            emit(it->second);
+            stream->last_name = it->first;
+            stream->next_slot++;
+        }
+        stream->at_end = it == dir->index.sorted.end();
+    } else {
+        for (; stream->next_slot < dir->entries.size() && added < max; stream->next_slot++) {
+            int slot = stream->next_slot;
+            if (slot == PARENT_DIR_ENTRY_INDEX || !dir_entry_is_empty(dir->entries[slot])) {
+                emit(slot);
+            }
+        }
+        stream->at_end = stream->next_slot >= dir->entries.size();
+    }
+    dir->lock.unlock();
+    return added;
+}
+
+template <int BlockSize>
+void
+BasicFS<BlockSize>::closedir(dir_stream *stream)
+{
+    stream->at_end = true;
+}
+
+template <int BlockSize>
 bool
-FS::dir_entry_is_empty(dir_entry entry) {
+BasicFS<BlockSize>::dir_entry_is_empty(dir_entry entry) {
     return entry.first_blk == FAT_FREE && entry.type == TYPE_FILE;
 }
 
-bool FS::has_permission(dir_entry entry, uint8_t required_access_rights) {
+template <int BlockSize>
+bool BasicFS<BlockSize>::has_permission(dir_entry entry, uint8_t required_access_rights) {
     return (entry.access_rights & required_access_rights) == required_access_rights;
 }
 
 // cp <sourcepath> <destpath> makes an exact copy of the file
 // <sourcepath> to a new file <destpath>
+template <int BlockSize>
 int
-FS::cp(std::string sourcepath, std::string destpath)
+BasicFS<BlockSize>::cp(std::string sourcepath, std::string destpath)
 {
-    enter_method();
+    trace_scope trace(this, TRACE_CP, sourcepath, destpath);
+    tx_handle tx(&journal);
+    op_locks locks(&ns_lock, false);
+    if (check_writable() == -1) {
+        return -1;
+    }
+    op_context ctx;
 
     std::string source_filename;
-    std::string source_dir;
+    std::string source_dirpath;
     std::string dest_filename;
-    std::string dest_dir;
-    get_filename_parts(sourcepath, &source_filename, &source_dir);
-    get_filename_parts(destpath, &dest_filename, &dest_dir);
+    std::string dest_dirpath;
+    get_filename_parts(sourcepath, &source_filename, &source_dirpath);
+    get_filename_parts(destpath, &dest_filename, &dest_dirpath);
     if (source_filename.empty()) {
-        std::cout << "Source file not found" << std::endl;
+        out() << "Source file not found" << std::endl;
         return -1;
     }
     if (dest_filename.empty()) {
@@ -493,380 +1168,609 @@ FS::cp(std::string sourcepath, std::string destpath)
     strncpy(new_file.file_name, dest_filename.c_str(), 56);
     new_file.first_blk = 0;
 
-    if (change_cwd(source_dir) == -1) {
+    dir_struct *source_dir = resolve_dir(source_dirpath);
+    dir_struct *dest_dir = resolve_dir(dest_dirpath);
+    if (source_dir == nullptr || dest_dir == nullptr) {
+        out() << "Path not found" << std::endl;
         return -1;
     }
-    dir_entry *source_file = find_dir_entry(source_filename);
+    locks.lock_dirs(source_dir, false, dest_dir, true);
+    dir_entry *source_file = find_dir_entry(source_dir, source_filename);
     if (source_file == nullptr) {
-        std::cout << "File not found" << std::endl;
-        return exit_method();
+        out() << "File not found" << std::endl;
+        return rollback(&ctx);
     }
     if (!has_permission(*source_file, READ)) {
-        std::cout << "You do not have permission to read " << source_filename << std::endl;
-        return exit_method();
+        out() << "You do not have permission to read " << source_filename << std::endl;
+        return rollback(&ctx);
     }
     new_file.size = source_file->size;
     new_file.type = source_file->type;
     new_file.access_rights = source_file->access_rights;
 
-    uint8_t buf[source_file->size];
-    if (read_data(source_file->first_blk, buf, source_file->size) == -1) {
-        exit_method();
-        return -1;
-    }
-    
-    int new_blk_no = find_empty_block();
-    if (new_blk_no == -1) {
-        exit_method();
-        return -1;
-    }
-    new_file.first_blk = new_blk_no;
-    
-    if (change_cwd(dest_dir) == -1) {
-        exit_method();
+    std::vector<int> source_blocks;
+    if (get_chain(source_file->first_blk, &source_blocks) == -1 || source_blocks.empty()) {
+        rollback(&ctx);
         return -1;
     }
 
-    if (!has_permission(cwd.info, WRITE)) {
-        std::cout << "You do not have permission to create files in this directory." << std::endl;
-        return exit_method();
+    if (!has_permission(dest_dir->info, WRITE)) {
+        out() << "You do not have permission to create files in this directory." << std::endl;
+        return rollback(&ctx);
     }
-    dir_entry *exists = find_dir_entry(new_file.file_name);
+    dir_entry *exists = find_dir_entry(dest_dir, new_file.file_name);
     if (exists != nullptr) {
-        std::cout << "File with name " << new_file.file_name << " already exists" << std::endl;
-        return exit_method();
+        out() << "File with name " << new_file.file_name << " already exists" << std::endl;
+        return rollback(&ctx);
     }
 
-    int dir_index = find_empty_dir_index();
+    int dir_index = find_empty_dir_index(dest_dir);
     if (dir_index == -1) {
         std::cerr << "No space in directory" << std::endl;
-        exit_method();
+        rollback(&ctx);
         return -1;
     }
-    if (write_data(new_file.first_blk, std::string((char*)buf)) == -1) {
-        exit_method(); 
+
+    // The copy gets a chain as long as the source's in one pass over the
+    // FAT, then the blocks are copied verbatim
+    std::vector<int> dest_blocks;
+    int cursor = -1;
+    if (allocate_chain(source_blocks.size(), &dest_blocks, &cursor) == -1) {
+        rollback(&ctx);
+        return -1;
+    }
+    new_file.first_blk = dest_blocks[0];
+
+    if (copy_blocks(source_blocks, dest_blocks) == -1) {
+        free_chain(new_file.first_blk);
+        rollback(&ctx);
+        return -1;
     };
 
-    cwd.entries[dir_index] = new_file;
+    set_entry(&ctx, dest_dir, dir_index, new_file);
 
-    exit_method(true);
-    return 0;
+    return commit(&ctx);
 }
 
 // mv <sourcepath> <destpath> renames the file <sourcepath> to the name <destpath>,
 // or moves the file <sourcepath> to the directory <destpath> (if dest is a directory)
+template <int BlockSize>
 int
-FS::mv(std::string sourcepath, std::string destpath)
+BasicFS<BlockSize>::mv(std::string sourcepath, std::string destpath)
 {
-    enter_method();
+    trace_scope trace(this, TRACE_MV, sourcepath, destpath);
+    // Renaming a file only changes the directories it leaves and enters, a
+    // directory also changes its own ".." and possibly every session's path
+    int ret = mv_entry(sourcepath, destpath, false);
+    if (ret == NEED_EXCLUSIVE) {
+        ret = mv_entry(sourcepath, destpath, true);
+    }
+    return ret;
+}
 
-    std::string source_filename, source_dir, dest_filename, dest_dir;
-    get_filename_parts(sourcepath, &source_filename, &source_dir);
-    get_filename_parts(destpath, &dest_filename, &dest_dir);
-    if (source_filename.empty()) {
-        std::cout << "Source file not found" << std::endl;
+template <int BlockSize>
+int
+BasicFS<BlockSize>::mv_entry(std::string sourcepath, std::string destpath, bool exclusive)
+{
+    tx_handle tx(&journal);
+    op_locks locks(&ns_lock, exclusive);
+    if (check_writable() == -1) {
+        return -1;
+    }
+    op_context ctx;
+
+    std::string source_filename, source_dirpath, dest_filename, dest_dirpath;
+    get_filename_parts(sourcepath, &source_filename, &source_dirpath);
+    get_filename_parts(destpath, &dest_filename, &dest_dirpath);
+    if (source_filename.empty()) { // Moving a directory, look it up in its parent
+        source_filename = source_dirpath.substr(source_dirpath.find_last_of("/") + 1);
+        source_dirpath = source_dirpath.substr(0, source_dirpath.find_last_of("/") + 1);
+    }
+    if (source_filename.empty() || source_filename == "..") {
+        out() << "Source file not found" << std::endl;
         return -1;
     }
     if (dest_filename.empty()) {
         dest_filename = source_filename;
     }
 
-    if (change_cwd(dest_dir) == -1) {
-        exit_method();
+    dir_struct *dest_dir = resolve_dir(dest_dirpath);
+    dir_struct *source_dir = resolve_dir(source_dirpath);
+    if (dest_dir == nullptr || source_dir == nullptr) {
+        out() << "Path not found" << std::endl;
         return -1;
     };
-    if (!has_permission(cwd.info, WRITE | EXECUTE)) {
-        std::cout << "You do not have permission to move files to this directory." << std::endl;
-        return exit_method();
+    locks.lock_dirs(source_dir, true, dest_dir, true);
+    if (!has_permission(dest_dir->info, WRITE | EXECUTE)) {
+        out() << "You do not have permission to move files to this directory." << std::endl;
+        return rollback(&ctx);
     }
-    dir_entry* exists = find_dir_entry(dest_filename);
+    dir_entry* exists = find_dir_entry(dest_dir, dest_filename);
     if (exists != nullptr) {
-        std::cout << "File with name " << dest_filename << " already exists" << std::endl;
-        return exit_method();
+        out() << "File with name " << dest_filename << " already exists" << std::endl;
+        return rollback(&ctx);
     }
-    int dir_index = find_empty_dir_index();
-    if (dir_index == -1) {
-        std::cerr << "No free space in directory\n";
-        exit_method();
-        return -1;
+
+    if (!has_permission(source_dir->info, WRITE | EXECUTE)) {
+        out() << "You do not have permission to move files from this directory." << std::endl;
+        return rollback(&ctx);
     }
 
-    if (change_cwd(source_dir) == -1) {
-        exit_method();
-        return -1;
+    int slot = find_in_dir(source_dir, source_filename, -1);
+    if (slot == -1 || slot == PARENT_DIR_ENTRY_INDEX) {
+        out() << "File not found" << std::endl;
+        return rollback(&ctx);
     }
-    if (!has_permission(cwd.info, WRITE | EXECUTE)) {
-        std::cout << "You do not have permission to move files from this directory." << std::endl;
-        return exit_method();
+    dir_entry file_cp = source_dir->entries[slot];
+
+    dir_struct *moved_dir = nullptr;
+    if (file_cp.type == TYPE_DIR) {
+        if (!exclusive) {
+            return NEED_EXCLUSIVE;
+        }
+        moved_dir = get_dir(file_cp);
+        if (moved_dir == nullptr) {
+            return -1;
+        }
+        // Refuse to move a directory into itself or one of its children
+        std::vector<std::string> dest_names;
+        std::vector<int> dest_blks;
+        get_dir_chain(dest_dir, &dest_names, &dest_blks);
+        if (std::find(dest_blks.begin(), dest_blks.end(), moved_dir->blk) != dest_blks.end()) {
+            out() << "Cannot move a directory into itself" << std::endl;
+            return rollback(&ctx);
+        }
     }
 
-    dir_entry *file = find_dir_entry(source_filename);
-    if (file == nullptr) {
-        std::cout << "File not found" << std::endl;
-        return exit_method();
+    int dir_index = find_empty_dir_index(dest_dir);
+    if (dir_index == -1) {
+        std::cerr << "No free space in directory\n";
+        rollback(&ctx);
+        return -1;
     }
-    // TODO: Create wipe_file method
-    dir_entry file_cp = *file;
-    file->first_blk = 0;
-    file->size = 0;
-    file->type = 0;
-    file->access_rights = 0;
-    strncpy(file->file_name, "", 56);
 
+    clear_entry(&ctx, source_dir, slot);
+    strncpy(file_cp.file_name, dest_filename.c_str(), 56);
+    set_entry(&ctx, dest_dir, dir_index, file_cp);
 
-    // Update saved cwd
-    if (cwd_backup.blk == cwd.blk) {
-        memcpy(cwd_backup.entries, cwd.entries, sizeof(cwd.entries));
+    if (moved_dir != nullptr) {
+        // Point ".." of the moved directory at its new parent
+        dir_entry *parent = modify_entry(&ctx, moved_dir, PARENT_DIR_ENTRY_INDEX);
+        parent->first_blk = dest_dir->blk;
+        parent->access_rights = dest_dir->info.access_rights;
+        moved_dir->info = file_cp;
     }
-    if(change_cwd(dest_dir) == -1) {
-        exit_method();
+    if (commit(&ctx) == -1) {
         return -1;
     }
-    cwd.entries[dir_index] = file_cp;
-    strncpy(cwd.entries[dir_index].file_name, dest_filename.c_str(), 56);
 
-    exit_method(true);
+    // Moving or renaming a directory above a cwd changes the cwd path
+    if (moved_dir != nullptr) {
+        std::vector<std::string> moved_path;
+        std::vector<int> moved_blks;
+        get_dir_chain(moved_dir, &moved_path, &moved_blks);
+        std::lock_guard<std::mutex> guard(sessions_lock);
+        for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+            auto moved = std::find(it->cwd_path_blks.begin(), it->cwd_path_blks.end(), file_cp.first_blk);
+            if (moved == it->cwd_path_blks.end()) {
+                continue;
+            }
+            std::vector<std::string> path = moved_path;
+            std::vector<int> blks = moved_blks;
+            size_t k = moved - it->cwd_path_blks.begin();
+            path.insert(path.end(), it->cwd_path.begin() + k + 1, it->cwd_path.end());
+            blks.insert(blks.end(), it->cwd_path_blks.begin() + k + 1, it->cwd_path_blks.end());
+            it->cwd_path = path;
+            it->cwd_path_blks = blks;
+        }
+    }
     return 0;
 }
 
 // rm <filepath> removes / deletes the file <filepath>
+template <int BlockSize>
 int
-FS::rm(std::string filepath)
+BasicFS<BlockSize>::rm(std::string filepath)
 {
-    enter_method();
+    trace_scope trace(this, TRACE_RM, filepath);
+    tx_handle tx(&journal);
+    op_locks locks(&ns_lock, false);
+    if (check_writable() == -1) {
+        return -1;
+    }
+    op_context ctx;
 
     std::string filename = filepath.substr(filepath.find_last_of("/") + 1);
     std::string dirpath = filepath.substr(0, filepath.find_last_of("/"));
     get_filename_parts(filepath, &filename, &dirpath);
     if (filename.empty()) {
-        std::cout << "File not found" << std::endl;
+        out() << "File not found" << std::endl;
         return -1;
     }
 
-    if (change_cwd(dirpath) == -1) {
+    dir_struct *dir = resolve_dir(dirpath);
+    if (dir == nullptr) {
+        out() << "Path not found" << std::endl;
         return -1;
     }
-    if (!has_permission(cwd.info, WRITE | EXECUTE)) {
-        std::cout << "You do not have permission to remove files in this directory." << std::endl;
-        return exit_method();
+    locks.lock_dirs(dir, true);
+    if (!has_permission(dir->info, WRITE | EXECUTE)) {
+        out() << "You do not have permission to remove files in this directory." << std::endl;
+        return rollback(&ctx);
     }
-    dir_entry *file = find_dir_entry(filename);
-    if (file == nullptr) {
-        std::cout << "File not found" << std::endl;
-        return exit_method();
-    }
-    if (file->type == TYPE_DIR) {
-        std::cout << "Can't remove directories" << std::endl;
-        return exit_method();
-        
+    int slot = find_in_dir(dir, filename, -1);
+    if (slot == -1) {
+        out() << "File not found" << std::endl;
+        return rollback(&ctx);
     }
-    int block_no = file->first_blk;
-    file->first_blk = 0;
-    file->size = 0;
-    memset(file->file_name, 0, 56);
+    if (dir->entries[slot].type == TYPE_DIR) {
+        out() << "Can't remove directories" << std::endl;
+        return rollback(&ctx);
 
-
-    while (block_no != FAT_EOF) {
-        int next_blk = fat[block_no];
-        fat[block_no] = FAT_FREE;
-        block_no = next_blk;
     }
-    exit_method(true);
-    return 0;
+    int block_no = dir->entries[slot].first_blk;
+    clear_entry(&ctx, dir, slot);
+    free_chain(block_no);
+    return commit(&ctx);
 }
 
 // append <filepath1> <filepath2> appends the contents of file <filepath1> to
 // the end of file <filepath2>. The file <filepath1> is unchanged.
+template <int BlockSize>
 int
-FS::append(std::string filepath1, std::string filepath2)
+BasicFS<BlockSize>::append(std::string filepath1, std::string filepath2)
 {
-    enter_method();
-
-    std::string source_filename, source_dir, dest_filename, dest_dir;
-    get_filename_parts(filepath1, &source_filename, &source_dir);
-    get_filename_parts(filepath2, &dest_filename, &dest_dir);
-    if (source_filename.empty() || dest_filename.empty()) {
-        std::cout << "File not found" << std::endl;
+    trace_scope trace(this, TRACE_APPEND, filepath1, filepath2);
+    tx_handle tx(&journal);
+    op_locks locks(&ns_lock, false);
+    if (check_writable() == -1) {
         return -1;
     }
+    op_context ctx;
 
-    if(change_cwd(source_dir) == -1) {
+    std::string source_filename, source_dirpath, dest_filename, dest_dirpath;
+    get_filename_parts(filepath1, &source_filename, &source_dirpath);
+    get_filename_parts(filepath2, &dest_filename, &dest_dirpath);
+    if (source_filename.empty() || dest_filename.empty()) {
+        out() << "File not found" << std::endl;
         return -1;
     }
 
-    dir_entry *source_file = find_dir_entry(source_filename);
-
-    if (change_cwd(dest_dir) == -1) {
-        exit_method();
+    dir_struct *source_dir = resolve_dir(source_dirpath);
+    dir_struct *dest_dir = resolve_dir(dest_dirpath);
+    if (source_dir == nullptr || dest_dir == nullptr) {
+        out() << "Path not found" << std::endl;
         return -1;
     }
+    locks.lock_dirs(source_dir, false, dest_dir, true);
 
-    dir_entry *dest_file = find_dir_entry(dest_filename);
+    dir_entry *source_file = find_dir_entry(source_dir, source_filename);
+    int dest_slot = find_in_dir(dest_dir, dest_filename, -1);
 
-    if (source_file == nullptr || dest_file == nullptr) {
-        std::cout << "File not found\n";
-        return exit_method();
+    if (source_file == nullptr || dest_slot == -1) {
+        out() << "File not found\n";
+        return rollback(&ctx);
     }
+    dir_entry *dest_file = &dest_dir->entries[dest_slot];
 
     if (!has_permission(*source_file, READ)) {
-        std::cout << "You do not have permission to read " << source_filename << std::endl;
-        return exit_method();
+        out() << "You do not have permission to read " << source_filename << std::endl;
+        return rollback(&ctx);
     }
     if (!has_permission(*dest_file, READ | WRITE)) {
-        std::cout << "You do not have permission to read or write " << dest_filename << std::endl;
-        return exit_method();
+        out() << "You do not have permission to read or write " << dest_filename << std::endl;
+        return rollback(&ctx);
     }
-    
-    int dest_file_last_blk_size = dest_file->size % BLOCK_SIZE;
+
+    dest_file = modify_entry(&ctx, dest_dir, dest_slot);
+    int dest_file_last_blk_size = dest_file->size % BlockSize;
     int new_size = source_file->size + dest_file->size;
     int buffer_size = source_file->size + dest_file_last_blk_size - 1; // File one + last block of file two without null terminator
     dest_file->size = new_size - 1;  // Remove dest_file null terminator
-    
+
     int dest_file_last_blk = dest_file->first_blk;
+    int dest_file_prev_blk = -1;
     while (fat[dest_file_last_blk] != FAT_EOF) {
+        dest_file_prev_blk = dest_file_last_blk;
         dest_file_last_blk = fat[dest_file_last_blk];
     }
 
-    uint8_t buf[buffer_size]; 
+    uint8_t buf[buffer_size];
     if (read_data(dest_file_last_blk, buf, dest_file_last_blk_size - 1) == -1) {
-        exit_method();
+        rollback(&ctx);
         return -1;
     }
     if (read_data(source_file->first_blk, &buf[dest_file_last_blk_size - 1], source_file->size) == -1) {
-        exit_method();
+        rollback(&ctx);
         return -1;
     };
 
+    // The last block is rewritten in place, unless a snapshot holds it.
+    // Then the file gets a copy and the snapshot keeps the old block.
+    if (block_pinned(dest_file_last_blk)) {
+        int copy_blk = find_empty_block(dest_file_last_blk);
+        if (copy_blk == -1) {
+            rollback(&ctx);
+            return -1;
+        }
+        if (dest_file_prev_blk == -1) {
+            dest_file->first_blk = copy_blk;
+        } else {
+            set_fat(dest_file_prev_blk, copy_blk);
+        }
+        release_block(dest_file_last_blk);
+        dest_file_last_blk = copy_blk;
+    }
+
     if (write_data(dest_file_last_blk, std::string((char*)buf)) == -1) {
-        exit_method();
+        rollback(&ctx);
         return -1;
     };
 
-    exit_method(true);
-    return 0;
+    return commit(&ctx);
 }
 
 // mkdir <dirpath> creates a new sub-directory with the name <dirpath>
 // in the current directory
+template <int BlockSize>
 int
-FS::mkdir(std::string dirpath)
+BasicFS<BlockSize>::mkdir(std::string dirpath)
 {
-    enter_method();
-    
+    trace_scope trace(this, TRACE_MKDIR, dirpath);
+    tx_handle tx(&journal);
+    op_locks locks(&ns_lock, false);
+    if (check_writable() == -1) {
+        return -1;
+    }
+    op_context ctx;
+
     std::string dirname;
     std::string path;
     get_filename_parts(dirpath, &dirname, &path);
     if (dirname.empty()) {
-        std::cout << "Directory already exists" << std::endl;
+        out() << "Directory already exists" << std::endl;
         return -1;
     }
-    if (change_cwd(path) == -1) {
+    dir_struct *dir = resolve_dir(path);
+    if (dir == nullptr) {
+        out() << "Path not found" << std::endl;
         return -1;
     }
-    if (!has_permission(cwd.info, WRITE | EXECUTE)) {
-        std::cout << "You do not have permission to create directories in this directory." << std::endl;
-        return exit_method();
+    locks.lock_dirs(dir, true);
+    if (!has_permission(dir->info, WRITE | EXECUTE)) {
+        out() << "You do not have permission to create directories in this directory." << std::endl;
+        return rollback(&ctx);
     }
-    dir_entry* entry = find_dir_entry(dirname);
+    dir_entry* entry = find_dir_entry(dir, dirname);
     if (entry != nullptr) {
-        std::cout << "A file or directory named " << dirname << " already exists in this directory." << std::endl;
-        return exit_method();
+        out() << "A file or directory named " << dirname << " already exists in this directory." << std::endl;
+        return rollback(&ctx);
+    }
+
+    int dir_index = find_empty_dir_index(dir);
+    if (dir_index == -1) {
+        std::cerr << "No free space in directory\n";
+        rollback(&ctx);
+        return -1;
     }
 
     dir_entry new_entry;
     strncpy(new_entry.file_name, dirname.c_str(), 56);
     new_entry.size = 0;
-    new_entry.first_blk = find_empty_block();
-    if (new_entry.first_blk == -1) {
-        exit_method();
+    int new_blk = find_empty_block();
+    if (new_blk == -1) {
+        rollback(&ctx);
         return -1;
     }
+    new_entry.first_blk = new_blk;
     new_entry.type = TYPE_DIR;
     new_entry.access_rights = READ | WRITE | EXECUTE;
-    int dir_index = find_empty_dir_index();
-    if (dir_index == -1) {
-        std::cerr << "No free space in directory\n";
-        exit_method();
-        return -1;
-    }
-    
-    dir_entry new_dir[DIR_SIZE];
-    init_dir(new_dir, cwd.blk, cwd.info.access_rights);
+
+    dir_entry new_dir[dir_size];
+    init_dir(new_dir, dir->blk, dir->info.access_rights);
     if (disk.write(new_entry.first_blk, (uint8_t*) new_dir) == -1) {
-        exit_method();
+        free_chain(new_entry.first_blk);
+        rollback(&ctx);
         return -1;
     };
 
-    cwd.entries[dir_index] = new_entry;
-    fat[new_entry.first_blk] = FAT_EOF;
+    set_entry(&ctx, dir, dir_index, new_entry);
 
-    exit_method(true);
-    return 0;   
+    return commit(&ctx);
 }
 
 // cd <dirpath> changes the current (working) directory to the directory named <dirpath>
+template <int BlockSize>
 int
-FS::cd(std::string dirpath)
+BasicFS<BlockSize>::cd(std::string dirpath)
 {
-    enter_method();
-    if (change_cwd(dirpath) == -1) {
+    trace_scope trace(this, TRACE_CD, dirpath);
+    if (dirpath.empty()) {
+        return 0;
+    }
+    op_locks locks(&ns_lock, false);
+    dir_struct *dir = resolve_dir(dirpath);
+    if (dir == nullptr) {
+        out() << "Path not found" << std::endl;
         return -1;
     }
-    if (!has_permission(cwd.info, READ)) {
-        std::cout << "Permisssion denied" << std::endl;
-        return exit_method();
+    if (!has_permission(dir->info, READ)) {
+        out() << "Permisssion denied" << std::endl;
+        return 0;
     }
+    update_cwd_path(dirpath, dir);
+    session()->cwd_blk = dir->blk;
     return 0;
 }
 
 // pwd prints the full path, i.e., from the root directory, to the current
 // directory, including the currect directory name
+template <int BlockSize>
 int
-FS::pwd()
+BasicFS<BlockSize>::pwd()
 {
-    std::cout << get_pwd_string() << std::endl;
+    trace_scope trace(this, TRACE_PWD);
+    out() << get_pwd_string() << std::endl;
     return 0;
 }
 
+template <int BlockSize>
 std::string
-FS::get_pwd_string()
+BasicFS<BlockSize>::get_pwd_string()
 {
-    if (cwd.blk == ROOT_BLOCK) {
+    fs_session *s = session();
+    if (s->cwd_path.empty()) {
         return "/";
     }
-    
-    struct dir_entry parent_dir[DIR_SIZE];
-    std::stack<std::string> dirs;
-    struct dir_entry current_dir;
-    int current_blk = cwd.blk;
-    int parent_blk = cwd.entries[PARENT_DIR_ENTRY_INDEX].first_blk;
-
-    while (current_blk != ROOT_BLOCK) {
-        disk.read(parent_blk, (uint8_t*)parent_dir);
-        for(int i = 0; i < DIR_SIZE; i++) {
-            if (parent_dir[i].first_blk == current_blk) {
-                dirs.push(parent_dir[i].file_name);
+    std::string res = "";
+    for (size_t i = 0; i < s->cwd_path.size(); i++) {
+        res.append("/" + s->cwd_path[i]);
+    }
+    return res;
+}
+
+// Builds the chain of directories from the root down to dir by following
+// ".." links and looking up each directory's name in its parent. Like
+// resolve_dir, it read-locks each directory it passes.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::get_dir_chain(dir_struct *dir, std::vector<std::string> *names, std::vector<int> *blks)
+{
+    names->clear();
+    blks->clear();
+    int current_blk = dir->blk;
+    dir->lock.read();
+    int parent_blk = dir->entries[PARENT_DIR_ENTRY_INDEX].first_blk;
+    dir->lock.unlock();
+
+    while (current_blk != root_blk) {
+        dir_struct *parent_dir = get_dir(parent_blk);
+        if (parent_dir == nullptr || names->size() >= fat_entries) {
+            return -1;
+        }
+        parent_dir->lock.read();
+        size_t i;
+        for (i = 1; i < parent_dir->entries.size(); i++) {
+            if (parent_dir->entries[i].first_blk == current_blk && parent_dir->entries[i].type == TYPE_DIR) {
+                names->insert(names->begin(), entry_name(parent_dir->entries[i]));
+                blks->insert(blks->begin(), current_blk);
                 break;
             }
         }
+        bool found = i < parent_dir->entries.size();
         current_blk = parent_blk;
-        parent_blk = parent_dir[PARENT_DIR_ENTRY_INDEX].first_blk;
+        parent_blk = parent_dir->entries[PARENT_DIR_ENTRY_INDEX].first_blk;
+        parent_dir->lock.unlock();
+        if (!found) {
+            return -1;
+        }
     }
+    return 0;
+}
 
+template <int BlockSize>
+std::string
+BasicFS<BlockSize>::get_dir_path(dir_struct *dir)
+{
+    std::vector<std::string> names;
+    std::vector<int> blks;
+    get_dir_chain(dir, &names, &blks);
+    if (names.empty()) {
+        return "/";
+    }
     std::string res = "";
-    while(!dirs.empty()) {
-        res.append("/" + dirs.top());
-        dirs.pop();
+    for (size_t i = 0; i < names.size(); i++) {
+        res.append("/" + names[i]);
     }
     return res;
 }
 
+// Applies the components of dirpath to the cached cwd path. target is the
+// directory dirpath resolved to; if the result disagrees with it, the path
+// is rebuilt from the directory tree instead.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::update_cwd_path(std::string dirpath, dir_struct *target)
+{
+    fs_session *s = session();
+    std::vector<std::string> path = s->cwd_path;
+    std::vector<int> blks = s->cwd_path_blks;
+    if (dirpath.rfind('/', 0) == 0) {
+        path.clear();
+        blks.clear();
+    }
+    size_t start = 0;
+    while (start <= dirpath.size()) {
+        size_t end = dirpath.find('/', start);
+        if (end == std::string::npos) {
+            end = dirpath.size();
+        }
+        std::string name = dirpath.substr(start, end - start);
+        start = end + 1;
+        if (name.empty()) {
+            continue;
+        }
+        if (name == "..") {
+            if (!path.empty()) {
+                path.pop_back();
+                blks.pop_back();
+            }
+            continue;
+        }
+        dir_struct *parent = get_dir(blks.empty() ? root_blk : blks.back());
+        if (parent == nullptr) {
+            break;
+        }
+        parent->lock.read();
+        int slot = find_in_dir(parent, name, TYPE_DIR);
+        if (slot != -1) {
+            path.push_back(entry_name(parent->entries[slot]));
+            blks.push_back(parent->entries[slot].first_blk);
+        }
+        parent->lock.unlock();
+        if (slot == -1) {
+            break;
+        }
+    }
+
+    if ((blks.empty() ? root_blk : blks.back()) != target->blk) {
+        if (get_dir_chain(target, &path, &blks) == -1) {
+            return -1;
+        }
+    }
+    s->cwd_path = path;
+    s->cwd_path_blks = blks;
+    return 0;
+}
+
 // chmod <accessrights> <filepath> changes the access rights for the
 // file <filepath> to <accessrights>.
+template <int BlockSize>
 int
-FS::chmod(std::string accessrights, std::string filepath)
+BasicFS<BlockSize>::chmod(std::string accessrights, std::string filepath)
 {
-    enter_method();
+    trace_scope trace(this, TRACE_CHMOD, accessrights, filepath);
+    // A directory with many children needs more room in the transaction
+    // than a command reserves, which it only knows once it has looked
+    int blocks = JOURNAL_CMD_BLOCKS;
+    int ret = chmod_entry(accessrights, filepath, &blocks);
+    while (ret == NEED_JOURNAL_BLOCKS) {
+        ret = chmod_entry(accessrights, filepath, &blocks);
+    }
+    return ret;
+}
+
+template <int BlockSize>
+int
+BasicFS<BlockSize>::chmod_entry(std::string accessrights, std::string filepath, int *blocks)
+{
+    tx_handle tx(&journal, *blocks);
+    // Changing a directory's rights rewrites the ".." of each child
+    op_locks locks(&ns_lock, true);
+    if (check_writable() == -1) {
+        return -1;
+    }
+    op_context ctx;
 
     std::string filename;
     std::string dirname;
@@ -875,11 +1779,11 @@ FS::chmod(std::string accessrights, std::string filepath)
         access_level = stoi(accessrights);
     }
     catch (std::invalid_argument) {
-        std::cout << "Invalid value for chmod" << std::endl;
+        out() << "Invalid value for chmod" << std::endl;
         return 0;
     }
     if (access_level < 0 || (READ | WRITE | EXECUTE) < access_level) {
-        std::cout << "Invalid value for chmod" << std::endl;
+        out() << "Invalid value for chmod" << std::endl;
         return 0;
     }
 
@@ -889,43 +1793,56 @@ FS::chmod(std::string accessrights, std::string filepath)
         dirname = dirname.substr(0, dirname.find_last_of("/") + 1);
     }
 
-    change_cwd(dirname);
-    if (filename.empty() && cwd.blk == ROOT_BLOCK) { // Special case "/"
+    dir_struct *dir = resolve_dir(dirname);
+    if (dir == nullptr) {
+        out() << "Path not found" << std::endl;
+        return -1;
+    }
+    if (filename.empty() && dir->blk == root_blk) { // Special case "/"
         filename = "..";
     }
-    dir_entry* entry = find_dir_entry(filename);
-    if (entry == nullptr) {
-        std::cout << "File or directory " << filename << " not found" << std::endl;
-        return exit_method();
+    int slot = find_in_dir(dir, filename, -1);
+    if (slot == -1) {
+        out() << "File or directory " << filename << " not found" << std::endl;
+        return rollback(&ctx);
+    }
+    // Change all references to changed dir, the ".." in the first block of
+    // each child
+    std::vector<dir_struct*> children;
+    dir_struct *changed_dir = nullptr;
+    if (dir->entries[slot].type == TYPE_DIR) {
+        changed_dir = get_dir(dir->entries[slot].first_blk);
+        if (changed_dir == nullptr) {
+            return -1;
+        }
+        for (size_t i = 1; i < changed_dir->entries.size(); i++) {
+            if (changed_dir->entries[i].type == TYPE_DIR && changed_dir->entries[i].first_blk != FAT_FREE) {
+                dir_struct *child_dir = get_dir(changed_dir->entries[i]);
+                if (child_dir != nullptr) {
+                    children.push_back(child_dir);
+                }
+            }
+        }
+    }
+    int needed = 1 + children.size();
+    if (journal.enabled && needed > journal.capacity) {
+        out() << filename << " has too many subdirectories to change at once, at most "
+              << journal.capacity - 1 << std::endl;
+        return -1;
     }
-    entry->access_rights = access_level;
-    if (cwd.blk == entry->first_blk) { // Changing own permission
-        cwd.info.access_rights = access_level;
+    if (journal.enabled && needed > *blocks) {
+        *blocks = needed;
+        return NEED_JOURNAL_BLOCKS;
     }
 
-    // Change all references to changed dir
-    if (entry->type == TYPE_DIR){
-        struct dir_entry changed_dir[DIR_SIZE];
-        if (entry->first_blk == cwd.blk) {
-            memcpy(changed_dir, cwd.entries, sizeof(cwd.entries));
-        } else {
-            disk.read(entry->first_blk, (uint8_t*)changed_dir);
-        }
-        for (int i = 1; i < DIR_SIZE; i++) {
-            if (changed_dir[i].type == TYPE_DIR) {
-                struct dir_entry child_dir[DIR_SIZE];
-                disk.read(changed_dir[i].first_blk, (uint8_t*)child_dir);
-                
-                child_dir[PARENT_DIR_ENTRY_INDEX].access_rights = access_level;
-                
-                disk.write(changed_dir[i].first_blk, (uint8_t*)child_dir);
-                
-                if (changed_dir[i].first_blk = cwd_backup.blk) {
-                    cwd_backup.entries[PARENT_DIR_ENTRY_INDEX].access_rights = access_level;
-                }
-            }
+    modify_entry(&ctx, dir, slot)->access_rights = access_level;
+    if (changed_dir != nullptr) {
+        changed_dir->info.access_rights = access_level;
+        for (size_t i = 0; i < children.size(); i++) {
+            modify_entry(&ctx, children[i], PARENT_DIR_ENTRY_INDEX)->access_rights = access_level;
         }
     }
-    exit_method(true);
-    return 0;
+    return commit(&ctx);
 }
+
+INSTANTIATE_BLOCK_SIZES(BasicFS)
@@ -1,6 +1,20 @@
 #include <iostream>
 #include <cstdint>
 #include <stack>
+#include <vector>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <pthread.h>
 #include "disk.h"
 
 #ifndef __FS_H__
@@ -8,6 +22,10 @@
 
 #define ROOT_BLOCK 0
 #define FAT_BLOCK 1
+#define SUPER_BLOCK 2
+#define JOURNAL_START 3
+#define JOURNAL_BLOCKS 64
+#define CRC_START (JOURNAL_START + JOURNAL_BLOCKS) // per-block checksums, after the journal
 #define FAT_FREE 0
 #define FAT_EOF -1
 #define PARENT_DIR_ENTRY_INDEX 0
@@ -18,8 +36,57 @@
 #define WRITE 0x02
 #define EXECUTE 0x01
 
-#define DIR_SIZE BLOCK_SIZE/sizeof(dir_entry)
-#define FAT_ENTRIES BLOCK_SIZE/2
+#define ALLOC_GROUPS 8
+#define DIR_BUCKET_EMPTY 0
+#define DIR_BUCKET_TOMBSTONE 0xFFFFFFFF
+#define PATH_INDEX_EMPTY 0
+#define PATH_INDEX_TOMBSTONE 0xFF
+#define COPY_PIPELINE_MIN 8 // shorter chains are copied by the calling thread
+#define COPY_RING_SLOTS 32
+#define COPY_READERS 2
+#define COPY_WRITERS 2
+#define HOST_CHUNK_BLOCKS 64 // blocks export writes to the host at a time
+#define GREP_CHUNK_BLOCKS 16 // blocks of a file grep reads and searches at a time
+#define NEED_EXCLUSIVE -2 // a command found it has to run with the namespace locked
+#define NEED_JOURNAL_BLOCKS -3 // a command found it changes more blocks than it reserved
+#define SUPER_MAGIC 0x314c4e524a334c46ull // "FL3JRNL1"
+#define JOURNAL_MAGIC 0x4e5258544c4e524aull // "JRNLTXRN"
+#define JOURNAL_TX_BLOCKS (JOURNAL_BLOCKS - 2) // block images per transaction
+#define JOURNAL_FLUSH_BLOCKS 32 // a running transaction this big is flushed at once
+#define JOURNAL_CMD_BLOCKS 4 // directory blocks a command may change unless it asks for more
+#define JOURNAL_INTERVAL_MS 50 // how long a transaction waits for more commands
+#define MAX_SNAPSHOTS 16
+#define TRACE_MAGIC 0x4543415254334c46ull // "FL3TRACE"
+#define TRACE_VERSION 1
+
+// Calls recorded in a trace. path and arg are the call's string arguments
+// in order; size is the data length of create and the flags of ls and fsck.
+#define TRACE_FORMAT 1
+#define TRACE_CREATE 2
+#define TRACE_CAT 3
+#define TRACE_READ 4
+#define TRACE_LS 5
+#define TRACE_CP 6
+#define TRACE_MV 7
+#define TRACE_RM 8
+#define TRACE_APPEND 9
+#define TRACE_MKDIR 10
+#define TRACE_CD 11
+#define TRACE_PWD 12
+#define TRACE_CHMOD 13
+#define TRACE_RM_RECURSIVE 14
+#define TRACE_CP_RECURSIVE 15
+#define TRACE_DU 16
+#define TRACE_FIND 17
+#define TRACE_FSCK 18
+#define TRACE_SNAPSHOT_CREATE 19
+#define TRACE_SNAPSHOT_DELETE 20
+#define TRACE_SNAPSHOT_MOUNT 21
+#define TRACE_SNAPSHOT_UMOUNT 22
+#define TRACE_SNAPSHOT_LIST 23
+#define TRACE_GREP 24
+#define TRACE_DF 25
+#define TRACE_OPS 26
 
 struct dir_entry {
     char file_name[56]; // name of the file / sub-directory
@@ -29,54 +96,559 @@ struct dir_entry {
     uint8_t access_rights; // read (0x04), write (0x02), execute (0x01)
 };
 
-struct cwd_struct {
-    dir_entry entries[DIR_SIZE];
+// Reader/writer lock around a pthread_rwlock_t. A copy is a new, unlocked
+// lock, so structs holding one can still be copied.
+class rw_lock {
+private:
+    pthread_rwlock_t rwlock;
+public:
+    rw_lock() { pthread_rwlock_init(&rwlock, nullptr); }
+    rw_lock(const rw_lock &) { pthread_rwlock_init(&rwlock, nullptr); }
+    rw_lock& operator=(const rw_lock &) { return *this; }
+    ~rw_lock() { pthread_rwlock_destroy(&rwlock); }
+    void read() { pthread_rwlock_rdlock(&rwlock); }
+    void write() { pthread_rwlock_wrlock(&rwlock); }
+    void unlock() { pthread_rwlock_unlock(&rwlock); }
+};
+
+// In-memory name index for a loaded directory. buckets is an open addressed
+// hash table holding slot + 1 for each named entry, tags holds a 16-bit hash
+// per slot so probes rarely have to touch the 56-byte names, free_slots has
+// bit i set when slot i can be reused, and sorted keeps the names in order
+// so listings never have to sort the directory.
+struct dir_index {
+    std::vector<uint32_t> buckets;
+    std::vector<uint16_t> tags;
+    std::vector<uint64_t> free_slots;
+    std::map<std::string, int> sorted;
+    int used;
+    int tombstones;
+};
+
+// A directory loaded into memory. A directory is a FAT chain of blocks with
+// dir_size entries each; entry 0 of the first block is always "..".
+struct dir_struct {
+    std::vector<dir_entry> entries;
+    std::vector<int> blocks;
     dir_entry info;
     int blk;
+    dir_index index;
+    // guards entries, blocks and index. info only changes while the
+    // namespace is locked exclusively, so it is read without this lock.
+    rw_lock lock;
+};
+
+// A slice of the block space with its own lock, free-block bitmap and
+// count, so threads allocating in different groups never wait on each
+// other. The lock also guards the FAT entries and snapshot counts of the
+// group's blocks.
+// The free runs at the start and the end of the group and the longest
+// one in it are kept with every change to the bitmap, so df finds the
+// largest free extent from the groups alone.
+template <int GroupBlocks>
+struct alloc_group {
+    std::mutex lock;
+    uint64_t free_bits[GroupBlocks / 64];
+    int free_count;
+    int head_free;
+    int tail_free;
+    int longest_free;
+
+    // Finds the runs again after the bitmap changed
+    void count_runs() {
+        int run = 0;
+        head_free = -1;
+        longest_free = 0;
+        for (int w = 0; w < GroupBlocks / 64; w++) {
+            uint64_t bits = free_bits[w];
+            int done = 0;
+            while (done < 64) {
+                uint64_t rest = bits >> done;
+                int ones = ~rest == 0 ? 64 : __builtin_ctzll(~rest);
+                run += ones;
+                done += ones;
+                if (done == 64) {
+                    break;
+                }
+                if (head_free == -1) {
+                    head_free = run;
+                }
+                longest_free = std::max(longest_free, run);
+                run = 0;
+                rest = bits >> done;
+                done += rest == 0 ? 64 - done : __builtin_ctzll(rest);
+            }
+        }
+        if (head_free == -1) {
+            head_free = run;
+        }
+        tail_free = run;
+        longest_free = std::max(longest_free, run);
+    }
+};
+
+// A frozen copy of the file system: its own FAT in block fat_blk and its
+// own copy of every directory, rooted at root_blk. File blocks are shared
+// with the live file system. An entry with fat_blk 0 is unused.
+struct snapshot_record {
+    char name[40];
+    uint32_t created;
+    uint16_t fat_blk;
+    uint16_t root_blk;
+};
+
+// Block SUPER_BLOCK of a journaled file system. Images formatted before
+// the journal existed have no magic there and run without one.
+struct superblock {
+    uint64_t magic;
+    uint32_t journal_start;
+    uint32_t journal_blocks;
+    snapshot_record snapshots[MAX_SNAPSHOTS];
+    // The checksum table, one uint32_t per block. 0 on images formatted
+    // before checksums existed, which run without them.
+    uint32_t crc_start;
+    uint32_t crc_blocks;
+    // The path index. 0 on images formatted before it existed;
+    // index_enabled is 0 while it is switched off and not kept up to date.
+    uint32_t index_start;
+    uint32_t index_blocks;
+    uint32_t index_enabled;
+    // Files and directories below the root, saved at unmount. The running
+    // file system keeps them in memory and clears counters_valid, so after
+    // a crash the next mount counts the tree once.
+    uint32_t counters_valid;
+    uint32_t file_count;
+    uint32_t dir_count;
+};
+
+// First block of the journal region: the home blocks of the count images
+// that follow it. A commit block after the images ends the transaction.
+struct journal_header {
+    uint64_t magic;
+    uint32_t seq;
+    uint32_t count;
+    uint16_t blocks[JOURNAL_TX_BLOCKS];
+};
+
+struct journal_commit {
+    uint64_t magic;
+    uint32_t seq;
+    uint32_t checksum; // over the header and every image
+};
+
+// Metadata write-ahead journal. Directory blocks changed by commit and the
+// FAT are collected in the running transaction, which the flusher thread
+// writes to the journal region together with the commands that joined it,
+// then to the blocks' home locations. Commands that change metadata hold
+// a tx_handle, and the flusher takes its snapshot only while none is held,
+// so a transaction never holds half a command.
+struct journal_state {
+    bool enabled;
+    uint32_t seq;
+    std::mutex lock;
+    std::condition_variable changed;
+    int active;      // tx_handles held
+    int capacity;    // directory blocks a transaction holds next to the FAT, checksums and index
+    int counted;     // directory blocks in pending
+    int reserved;    // directory blocks the tx_handles held may still add
+    bool flushing;   // the flusher waits for active to drop to 0
+    bool dirty;      // a command ran since the last snapshot
+    bool kick;       // flush without waiting out JOURNAL_INTERVAL_MS
+    bool stopping;
+    // a transaction did not reach the disk. Nothing is written after it,
+    // since later transactions build on its changes, and commands that
+    // change the file system are refused until it is mounted again.
+    bool failed;
+    unsigned long snapshots;
+    unsigned long completed; // snapshots that reached their home blocks
+    std::map<int, std::vector<uint8_t>> pending;    // block images of the running transaction
+    std::map<int, std::vector<uint8_t>> committing; // images being flushed
+    // Blocks freed by the running transaction. They are handed out again
+    // only once it is committed, so a crash never leaves a committed file
+    // pointing at blocks that were rewritten for another.
+    std::vector<int> deferred_frees;
+    std::thread flusher;
+};
+
+// One bucket of the path index: the entry of a sub-directory named name in
+// the directory starting at block parent, where it is and what it points
+// at. It holds all resolve_dir needs of the entry, so a lookup reads no
+// directory but the one it ends in.
+struct path_index_record {
+    char name[56]; // as in dir_entry, not terminated at 56 bytes
+    uint16_t parent;
+    uint16_t first_blk;
+    uint16_t blk;  // the directory block holding the entry
+    uint8_t pos;   // its place in blk plus 1, PATH_INDEX_EMPTY or PATH_INDEX_TOMBSTONE
+    uint8_t access_rights;
+};
+
+// Persistent hash table of every sub-directory entry but "..", keyed on
+// the parent directory and the name. It lets resolve_dir go from the root to
+// a directory without loading any directory on the way. commit keeps it in
+// step with the directories and writes the buckets it changed through the
+// journal, in the same transaction.
+struct path_index_state {
+    bool enabled;
+    std::mutex lock;
+    std::vector<path_index_record> records;
+    int used;
+    int tombstones;
+    std::set<int> dirty; // blocks of the index changed since the last write
+};
+
+// Marks a command that changes metadata and reserves room for the
+// directory blocks it may change. Waits while the flusher takes its
+// snapshot, or until the running transaction has that room.
+class tx_handle {
+private:
+    journal_state *journal;
+    int blocks;
+public:
+    tx_handle(journal_state *journal, int blocks = JOURNAL_CMD_BLOCKS);
+    ~tx_handle();
+};
+
+// A trace file is a trace_header and then one trace_record per call, each
+// followed by path_len bytes of path and arg_len bytes of arg
+struct trace_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t pad;
+};
+
+struct trace_record {
+    uint64_t start_us;    // since the trace was started
+    uint32_t duration_us;
+    uint32_t size;
+    uint16_t session;     // 0 for the default session
+    uint16_t path_len;
+    uint16_t arg_len;
+    uint8_t op;
+    uint8_t pad;
+};
+
+// The trace being recorded. Records are appended under lock; enabled is
+// read without it, so calls cost nothing extra while no trace is running.
+struct trace_state {
+    std::atomic<bool> enabled;
+    std::mutex lock;
+    std::ofstream file;
+    std::chrono::steady_clock::time_point start;
+    std::map<const void*, uint16_t> sessions;
+    uint64_t records;
+};
+
+// Working directory of one caller. A thread runs its commands in the
+// session it last passed to FS::use_session, or in the default session.
+struct fs_session {
+    int cwd_blk;
+    // path of the cwd from the root down, kept up to date by cd and mv so
+    // pwd never has to walk ".." links
+    std::vector<std::string> cwd_path;
+    std::vector<int> cwd_path_blks;
+};
+
+// Locks held by one command: the namespace lock, shared or exclusive, and
+// read or write locks on the directories it changes. Commands that hold the
+// namespace exclusively need no directory locks, so lock_dirs does nothing
+// for them. Everything is released when the command returns.
+class op_locks {
+private:
+    rw_lock *ns;
+    bool exclusive;
+    std::vector<dir_struct*> held;
+public:
+    op_locks(rw_lock *ns, bool exclusive);
+    ~op_locks();
+    // Locks a and b, in block order so two commands never wait on each
+    // other. b may be nullptr or the same directory as a.
+    void lock_dirs(dir_struct *a, bool write_a, dir_struct *b = nullptr, bool write_b = false);
+};
+
+// Records the directory entries a command changes, together with their old
+// values. commit writes only the blocks holding those entries and rollback
+// puts the old entries back.
+struct op_context {
+    std::vector<dir_struct*> dirs;
+    std::vector<int> slots;
+    std::vector<dir_entry> old_entries;
+};
+
+// One directory of a subtree collected by FS::scan_tree. Nodes are stored
+// parents first, so walking them backwards visits children before parents.
+struct tree_node {
+    std::string path;
+    dir_entry info;                 // the entry the parent holds for it
+    int parent;                     // index of the parent node, -1 for the top
+    bool readable;                  // false if the directory was not scanned
+    std::vector<int> blocks;        // blocks of the directory itself
+    std::vector<dir_entry> entries; // every slot of the directory
+    std::map<int, std::vector<int>> file_blocks; // FAT chain of each file, by slot
+    dir_struct *dir;                // the cached directory, for a shared scan
+};
+
+// A directory entry together with the metadata readdir returns for it
+struct dir_stat {
+    std::string name;
+    dir_entry entry;
+    int blocks; // length of the entry's FAT chain
+};
+
+// An open directory being read with FS::readdir. In sorted mode the stream
+// resumes after the last name it returned, otherwise after the last slot.
+struct dir_stream {
+    int blk;
+    bool sorted;
+    size_t next_slot;
+    std::string last_name;
+    bool at_end;
+};
+
+// Totals of one import -r run
+struct import_stats {
+    int files;
+    int dirs;
+    int errors;
+    size_t bytes;
 };
 
-class FS {
+// What df prints, like statfs(2). Free blocks are those that can be
+// allocated now, so blocks a snapshot holds or a running transaction
+// freed count as used.
+struct fs_stat {
+    int block_size;
+    int blocks;
+    int used_blocks;
+    int free_blocks;
+    int largest_free; // longest run of free blocks
+    int files;        // below the root
+    int dirs;
+};
+
+// Findings of one fsck run. Problems are printed as they are found unless
+// verbose is false.
+struct fsck_report {
+    bool quick;
+    bool repair;
+    bool verbose;
+    int problems;
+    int repaired;
+    std::set<int> unread; // blocks of the directories check_tree could not read
+};
+
+std::string entry_name(const dir_entry &entry);
+
+// The file system on a disk of BlockSize-byte blocks. Everything the block
+// size decides is a constant of the class; INSTANTIATE_BLOCK_SIZES lists the
+// sizes every build carries, and FS is the one the tools use.
+template <int BlockSize>
+class BasicFS {
+public:
+    static const size_t dir_size = BlockSize / sizeof(dir_entry); // entries per directory block
+    static const int fat_entries = BlockSize / 2;
+    static const int group_blocks = fat_entries / ALLOC_GROUPS;
+    static const int crc_blocks = fat_entries * 4 / BlockSize;
+    static const size_t dir_min_buckets = 2 * dir_size; // a power of two
+    static const int index_buckets = fat_entries; // every block could start one directory
+    static const int index_blocks = index_buckets * sizeof(path_index_record) / BlockSize;
+    static const int index_start = CRC_START + crc_blocks;
+    static_assert(group_blocks % 64 == 0, "an allocation group is a whole number of bitmap words");
+    static_assert(sizeof(path_index_record) == 64, "index buckets do not straddle blocks");
+    static_assert(sizeof(superblock) <= BlockSize && sizeof(journal_header) <= BlockSize,
+                  "the superblock and the journal header fit in a block");
+
+    // Records the call it is declared in, when it returns, if a trace is
+    // being recorded. Calls made by a recorded call are left out, so a
+    // replay does not run them twice.
+    class trace_scope {
+    private:
+        BasicFS *fs;
+        uint8_t op;
+        bool outer;
+        std::string path;
+        std::string arg;
+        std::chrono::steady_clock::time_point start;
+    public:
+        uint32_t size; // may be set once the call knows it
+        trace_scope(BasicFS *fs, uint8_t op, const std::string &path = "", const std::string &arg = "", uint32_t size = 0);
+        ~trace_scope();
+    };
+
 private:
-    Disk disk;
+    BasicDisk<BlockSize> disk;
     // size of a FAT entry is 2 bytes
-    int16_t fat[BLOCK_SIZE/2];
-    struct dir_entry root_dir[DIR_SIZE];
-    cwd_struct cwd;
-    cwd_struct cwd_backup;
-    // struct dir_entry cwd[DIR_SIZE];
-    // struct dir_entry cwd_info;
-    // int cwd_blk;
+    int16_t fat[fat_entries];
+    // directories loaded so far, keyed on their first block. Elements of an
+    // unordered_map never move, so dir_struct pointers stay valid.
+    std::unordered_map<int, dir_struct> dir_cache;
+    std::list<fs_session> sessions;
+    fs_session *default_session;
+
+    alloc_group<group_blocks> groups[ALLOC_GROUPS];
+    journal_state journal;
+
+    superblock super;
+    // number of snapshots holding each block. A block any snapshot holds
+    // is never handed out nor written in place.
+    std::vector<uint8_t> snap_refs;
+    // While a snapshot is mounted, lookups go through its FAT and root.
+    // fat stays the live FAT, which the journal and the allocator use.
+    int root_blk;
+    int mounted_snapshot; // index in super.snapshots, -1 for none
+    int16_t snap_fat[fat_entries];
+    const int16_t *view_fat;
+    trace_state trace;
+    // Whether reads of directories already in dir_cache check checksums
+    std::atomic<bool> verify_cached_dirs;
+    path_index_state path_index;
+    // Files and directories below the root, kept by commit
+    std::atomic<int> file_count;
+    std::atomic<int> dir_count;
+
+    // Lock order: a tx_handle, ns_lock, then directory locks by block
+    // number, then group locks, cache_lock, sessions_lock and journal.lock,
+    // which are never held while taking another lock. path_index.lock is
+    // only held to take journal.lock. Commands that only touch entries of
+    // the directories they lock share ns_lock; commands that move, remove or
+    // re-permission directories, or walk whole trees, take it exclusively.
+    rw_lock ns_lock;
+    std::mutex cache_lock;
+    std::mutex sessions_lock;
 
 public:
-    FS();
-    ~FS();
+    BasicFS(const std::string &diskname = DISKNAME);
+    ~BasicFS();
 
-    int find_empty_block();
+    void build_alloc_groups();
+    int claim_block(int g, int from);
+    void release_block(int blk);
+    void reuse_block(int blk);
+    bool block_pinned(int blk);
+    int find_empty_block(int near = -1);
+    int get_fat(int blk);
+    void set_fat(int blk, int next);
+    void free_chain(int first_blk);
+    void defer_free(int blk);
+    int journal_mount();
+    int journal_replay();
+    int write_superblock();
+    int init_journal();
+    int clear_journal();
+    void journal_start();
+    void journal_stop();
+    int journal_sync();
+    void journal_loop();
+    void journal_flush(std::unique_lock<std::mutex> &lock);
+    int write_transaction(const std::vector<int> &blks, const std::vector<const uint8_t*> &images);
+    int write_meta(int blk, const uint8_t *data);
+    int write_dir_blocks(const std::vector<int> &blks, const std::vector<const uint8_t*> &images);
+    int read_meta(int blk, uint8_t *data, bool verify = true);
+    int load_checksums();
+    int init_checksums();
+    void check_checksums(fsck_report *report);
+    int load_path_index();
+    int init_path_index();
+    int build_path_index(const std::deque<tree_node> &nodes);
+    int write_path_index();
+    int index_find(int parent, const char *name);
+    void index_insert(int parent, const dir_entry &entry, int blk, int pos);
+    void index_remove(int parent, const dir_entry &entry);
+    void index_remove_below(const std::vector<int> &dirs);
+    void index_rehash();
+    void index_dir(const std::vector<int> &blocks, const std::vector<dir_entry> &entries);
+    void entry_changes(op_context *ctx, std::vector<std::pair<int, dir_entry>> *removed,
+                       std::vector<std::pair<dir_struct*, int>> *inserted);
+    void update_path_index(const std::vector<std::pair<int, dir_entry>> &removed,
+                           const std::vector<std::pair<dir_struct*, int>> &inserted);
+    void check_path_index(const std::deque<tree_node> &nodes, fsck_report *report);
+    int load_counters();
+    int save_counters();
+    void update_counters(const std::vector<std::pair<int, dir_entry>> &removed,
+                         const std::vector<std::pair<dir_struct*, int>> &inserted);
+    void count_tree(const std::deque<tree_node> &nodes, int *files, int *dirs);
+    void check_counters(const std::deque<tree_node> &nodes, fsck_report *report);
+    dir_struct* resolve_indexed(std::string dirpath, bool *answered);
     int write_data(int starting_block, std::string data);
     int read_data(int start_blk, uint8_t* out_buf, size_t size);
     int init_dir(struct dir_entry *dir, int parent_blk, uint8_t access_rights);
+    fs_session* open_session();
+    void close_session(fs_session *s);
+    void use_session(fs_session *s);
+    fs_session* session();
+    void use_streams(std::istream *in, std::ostream *out);
+    std::istream& in();
+    std::ostream& out();
+    bool dir_in_use(int blk);
     std::string get_pwd_string();
-    dir_entry* find_dir_entry(std::string filename);
-    int find_empty_dir_index();
+    int get_dir_chain(dir_struct *dir, std::vector<std::string> *names, std::vector<int> *blks);
+    std::string get_dir_path(dir_struct *dir);
+    int update_cwd_path(std::string dirpath, dir_struct *target);
+    dir_entry* find_dir_entry(dir_struct *dir, std::string filename);
+    int find_empty_dir_index(dir_struct *dir);
+    int get_chain(int first_blk, std::vector<int> *blocks);
+    int read_dir_blocks(int blk, std::vector<int> *blocks, std::vector<dir_entry> *entries);
+    int load_dir(int blk, dir_struct *dir, const dir_entry *info = nullptr);
+    int save_dir(dir_struct *dir);
+    int grow_dir(dir_struct *dir);
+    void build_dir_index(dir_struct *dir);
+    int lookup_dir_index(const dir_struct *dir, const char *name);
+    void insert_dir_index(dir_struct *dir, int slot);
+    void remove_dir_index(dir_struct *dir, int slot);
+    int find_in_dir(const dir_struct *dir, const std::string &name, int type);
+    dir_struct* get_dir(int blk, const dir_entry *info = nullptr);
+    dir_struct* get_dir(const dir_entry &entry);
 
     void get_filename_parts(std::string filepath, std::string *filename, std::string *dirpath);
     int find_dir_from_path(std::string dirpath);
-    int change_cwd(std::string dirpath);
-    int exit_method(dir_entry cur_cwd[BLOCK_SIZE/sizeof(dir_entry)], int cwd_blk, dir_entry cur_cwd_info, int save);
+    dir_struct* resolve_dir(std::string dirpath);
     bool dir_entry_is_empty(dir_entry entry);
     bool has_permission(dir_entry entry, uint8_t required_access_rights);
-    int enter_method();
-    int exit_method(bool save);
+    dir_entry* modify_entry(op_context *ctx, dir_struct *dir, int slot);
+    void set_entry(op_context *ctx, dir_struct *dir, int slot, const dir_entry &entry);
+    void clear_entry(op_context *ctx, dir_struct *dir, int slot);
+    int commit(op_context *ctx);
+    int rollback(op_context *ctx);
+
+    int scan_tree(const dir_entry &top, std::string path, std::deque<tree_node> *nodes, bool check_access = true, bool shared = false);
+    int count_free_blocks();
+    int allocate_chain(int length, std::vector<int> *blocks, int *cursor);
+    int reserved_blocks();
+    void fsck_problem(fsck_report *report, const std::string &message, bool repaired);
+    void check_fat(fsck_report *report);
+    void check_tree(fsck_report *report);
+    void check_alloc(fsck_report *report);
+    int copy_blocks(const std::vector<int> &src, const std::vector<int> &dst);
+    int write_chain(const std::vector<int> &chain, size_t first, size_t count, const uint8_t *buf);
+    int read_chain(const std::vector<int> &chain, size_t first, size_t count, uint8_t *buf);
+    int import_file(int fd, size_t size, std::string filepath);
+    int import_tree(std::string hostpath, std::string filepath, import_stats *stats);
+    int export_chain(const std::vector<int> &chain, size_t size, int fd);
+    int export_tree(dir_struct *top, std::string hostpath);
+    int split_path(std::string path, std::string *name, std::string *dirpath);
 
     // formats the disk, i.e., creates an empty file system
     int format();
     // create <filepath> creates a new file on the disk, the data content is
     // written on the following rows (ended with an empty row)
     int create(std::string filepath);
+    int create_file(std::string filepath, const std::string *data);
     // cat <filepath> reads the content of a file and prints it on the screen
     int cat(std::string filepath);
+    // read_file <filepath> returns the content of a file without printing it
+    int read_file(std::string filepath, std::string *data);
     // ls lists the content in the currect directory (files and sub-directories)
     int ls();
+    // ls [-l] <dirpath> lists the content of <dirpath>, with -l also the
+    // number of blocks each entry uses
+    int ls(std::string dirpath, bool long_format);
+
+    // opendir/readdir/closedir enumerate a directory in batches. readdir
+    // fills batch with at most max entries and returns how many it added,
+    // 0 at the end of the directory and -1 on error.
+    int opendir(std::string dirpath, dir_stream *stream, bool sorted);
+    int readdir(dir_stream *stream, std::vector<dir_stat> *batch, size_t max);
+    void closedir(dir_stream *stream);
 
     // cp <sourcepath> <destpath> makes an exact copy of the file
     // <sourcepath> to a new file <destpath>
@@ -84,6 +656,7 @@ public:
     // mv <sourcepath> <destpath> renames the file <sourcepath> to the name <destpath>,
     // or moves the file <sourcepath> to the directory <destpath> (if dest is a directory)
     int mv(std::string sourcepath, std::string destpath);
+    int mv_entry(std::string sourcepath, std::string destpath, bool exclusive);
     // rm <filepath> removes / deletes the file <filepath>
     int rm(std::string filepath);
     // append <filepath1> <filepath2> appends the contents of file <filepath1> to
@@ -102,6 +675,77 @@ public:
     // chmod <accessrights> <filepath> changes the access rights for the
     // file <filepath> to <accessrights>.
     int chmod(std::string accessrights, std::string filepath);
+    int chmod_entry(std::string accessrights, std::string filepath, int *blocks);
+
+    // rm -r <path> removes the file or the whole directory tree <path>
+    int rm_recursive(std::string path);
+    // cp -r <sourcepath> <destpath> copies the file or the whole directory
+    // tree <sourcepath> to <destpath>
+    int cp_recursive(std::string sourcepath, std::string destpath);
+    // du <dirpath> prints the size of every directory tree below <dirpath>
+    int du(std::string dirpath);
+    // find <dirpath> <pattern> prints the path of every entry below <dirpath>
+    // whose name matches the shell wildcard <pattern>
+    int find(std::string dirpath, std::string pattern);
+    // grep <pattern> <dirpath> prints path:offset for every place below
+    // <dirpath> where a file holds <pattern>
+    int grep(std::string pattern, std::string dirpath);
+    int grep_chain(const std::vector<int> &chain, size_t size, const std::string &pattern,
+                   std::vector<size_t> *offsets);
+    // import [-r] <hostpath> <filepath> copies a host file, or with -r a
+    // host directory tree, into the file system
+    int import_host(std::string hostpath, std::string filepath, bool recursive);
+    // export [-r] <filepath> <hostpath> copies a file, or with -r a
+    // directory tree, to the host
+    int export_host(std::string filepath, std::string hostpath, bool recursive);
+    // fsck [-q] [-r] checks that the FAT, the allocator and the directory
+    // tree agree. -q checks only the FAT and the allocator, -r repairs.
+    int fsck(bool quick, bool repair);
+    // checksum [cached on|off] shows whether blocks are checksummed, or
+    // turns checking off for directories already in memory
+    int checksum(std::string cached);
+    // pathindex [on|off] shows whether the path index is kept, builds it
+    // from the tree and keeps it from now on, or drops it
+    int pathindex(std::string mode);
+    int check_writable();
+    // statfs fills st with the totals df prints; df prints the block and
+    // file counts of the file system, without scanning it
+    int statfs(fs_stat *st);
+    int df();
+
+    // snapshot create <name> freezes the file system as it is now
+    int snapshot_create(std::string name);
+    // snapshot list prints every snapshot with the blocks only it holds
+    int snapshot_list();
+    // snapshot delete <name> removes a snapshot and frees the blocks only
+    // it held
+    int snapshot_delete(std::string name);
+    // snapshot mount <name> shows the snapshot instead of the live file
+    // system, read-only, until snapshot umount
+    int snapshot_mount(std::string name);
+    int snapshot_umount();
+    int find_snapshot(const std::string &name);
+    // trace start <hostpath> records every call to a trace file until
+    // trace stop
+    int trace_start(std::string hostpath);
+    int trace_stop();
+    bool tracing() { return trace.enabled.load(std::memory_order_relaxed); }
+    void trace_call(uint8_t op, const std::string &path, const std::string &arg, uint32_t size,
+                  std::chrono::steady_clock::time_point start);
+    int read_snapshot_fat(int index, int16_t *snap_fat);
+    int load_snapshots();
+    void reset_view();
 };
 
+template <int BlockSize> const size_t BasicFS<BlockSize>::dir_size;
+template <int BlockSize> const int BasicFS<BlockSize>::fat_entries;
+template <int BlockSize> const int BasicFS<BlockSize>::group_blocks;
+template <int BlockSize> const int BasicFS<BlockSize>::crc_blocks;
+template <int BlockSize> const size_t BasicFS<BlockSize>::dir_min_buckets;
+template <int BlockSize> const int BasicFS<BlockSize>::index_buckets;
+template <int BlockSize> const int BasicFS<BlockSize>::index_blocks;
+template <int BlockSize> const int BasicFS<BlockSize>::index_start;
+
+typedef BasicFS<BLOCK_SIZE> FS;
+
 #endif // __FS_H__
@@ -0,0 +1,249 @@
+#include <iostream>
+#include <atomic>
+#include "fs.h"
+
+// Group the calling thread allocates new chains in, -1 until it first
+// allocates. Threads are handed groups round robin, so parallel writers
+// start out in different groups and do not wait on each other's locks.
+static thread_local int home_group = -1;
+static std::atomic<unsigned> next_home_group(0);
+
+static int
+my_group()
+{
+    if (home_group == -1) {
+        home_group = next_home_group++ % ALLOC_GROUPS;
+    }
+    return home_group;
+}
+
+template <int BlockSize>
+static int
+group_of(int blk)
+{
+    return blk / BasicFS<BlockSize>::group_blocks;
+}
+
+// Puts blk back in the group's bitmap unless it already is there. Called
+// with the group's lock held.
+template <int GroupBlocks>
+static void
+mark_free(alloc_group<GroupBlocks> *group, int blk)
+{
+    int slot = blk % GroupBlocks;
+    uint64_t bit = 1ull << (slot % 64);
+    if (!(group->free_bits[slot / 64] & bit)) {
+        group->free_bits[slot / 64] |= bit;
+        group->free_count++;
+        group->count_runs();
+    }
+}
+
+// Rebuilds every group's free bitmap and count from the FAT
+template <int BlockSize>
+void
+BasicFS<BlockSize>::build_alloc_groups()
+{
+    for (int g = 0; g < ALLOC_GROUPS; g++) {
+        std::lock_guard<std::mutex> guard(groups[g].lock);
+        groups[g].free_count = 0;
+        for (int w = 0; w < group_blocks / 64; w++) {
+            groups[g].free_bits[w] = 0;
+        }
+        for (int i = 0; i < group_blocks; i++) {
+            int blk = g * group_blocks + i;
+            if (fat[blk] == FAT_FREE && snap_refs[blk] == 0) {
+                groups[g].free_bits[i / 64] |= 1ull << (i % 64);
+                groups[g].free_count++;
+            }
+        }
+        groups[g].count_runs();
+    }
+}
+
+// Claims the first free block of group g at or after block from and makes
+// it the end of a new chain. Returns -1 if there is none.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::claim_block(int g, int from)
+{
+    alloc_group<group_blocks> *group = &groups[g];
+    std::lock_guard<std::mutex> guard(group->lock);
+    if (group->free_count == 0) {
+        return -1;
+    }
+    int i = from > g * group_blocks ? from - g * group_blocks : 0;
+    for (int w = i / 64; w < group_blocks / 64; w++) {
+        uint64_t bits = group->free_bits[w];
+        if (w == i / 64) {
+            bits &= ~0ull << (i % 64);
+        }
+        if (bits != 0) {
+            int slot = w * 64 + __builtin_ctzll(bits);
+            group->free_bits[w] &= ~(1ull << (slot % 64));
+            group->free_count--;
+            group->count_runs();
+            int blk = g * group_blocks + slot;
+            fat[blk] = FAT_EOF;
+            return blk;
+        }
+    }
+    return -1;
+}
+
+// Frees blk in the FAT. With a journal the block is handed out again once
+// the transaction freeing it is committed, and never while a snapshot
+// holds it.
+template <int BlockSize>
+void
+BasicFS<BlockSize>::release_block(int blk)
+{
+    {
+        alloc_group<group_blocks> *group = &groups[group_of<BlockSize>(blk)];
+        std::lock_guard<std::mutex> guard(group->lock);
+        fat[blk] = FAT_FREE;
+        if (!journal.enabled && snap_refs[blk] == 0) {
+            mark_free(group, blk);
+        }
+    }
+    if (journal.enabled) {
+        defer_free(blk);
+    }
+}
+
+// Called by the flusher for a block freed by a committed transaction, or
+// let go of by a deleted snapshot
+template <int BlockSize>
+void
+BasicFS<BlockSize>::reuse_block(int blk)
+{
+    alloc_group<group_blocks> *group = &groups[group_of<BlockSize>(blk)];
+    std::lock_guard<std::mutex> guard(group->lock);
+    if (fat[blk] == FAT_FREE && snap_refs[blk] == 0) {
+        mark_free(group, blk);
+    }
+}
+
+// True if a snapshot holds blk, so it must not be written in place
+template <int BlockSize>
+bool
+BasicFS<BlockSize>::block_pinned(int blk)
+{
+    std::lock_guard<std::mutex> guard(groups[group_of<BlockSize>(blk)].lock);
+    return snap_refs[blk] > 0;
+}
+
+// Finds a free block and claims it as the end of a new chain. The search
+// starts next to near, so a growing chain stays in one group, or in the
+// calling thread's group for a new chain, and moves on to the next group
+// when that one is full.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::find_empty_block(int near)
+{
+    int start = near >= 0 ? group_of<BlockSize>(near) : my_group();
+    for (int k = 0; k < ALLOC_GROUPS; k++) {
+        int g = (start + k) % ALLOC_GROUPS;
+        int blk = claim_block(g, k == 0 && near >= 0 ? near : 0);
+        if (blk == -1 && k == 0 && near >= 0) {
+            blk = claim_block(g, 0);
+        }
+        if (blk != -1) {
+            return blk;
+        }
+    }
+    std::cerr << "FS::find_empty_block: No free blocks" << std::endl;
+    return -1;
+}
+
+// Next block of blk's chain in the FAT being viewed, which is a
+// snapshot's while one is mounted
+template <int BlockSize>
+int
+BasicFS<BlockSize>::get_fat(int blk)
+{
+    std::lock_guard<std::mutex> guard(groups[group_of<BlockSize>(blk)].lock);
+    return view_fat[blk];
+}
+
+template <int BlockSize>
+void
+BasicFS<BlockSize>::set_fat(int blk, int next)
+{
+    std::lock_guard<std::mutex> guard(groups[group_of<BlockSize>(blk)].lock);
+    fat[blk] = next;
+}
+
+// Returns every block of the chain starting at first_blk to its group
+template <int BlockSize>
+void
+BasicFS<BlockSize>::free_chain(int first_blk)
+{
+    int block_no = first_blk;
+    for (int n = 0; block_no != FAT_EOF && n < fat_entries; n++) {
+        if (block_no < 0 || block_no >= fat_entries) {
+            std::cerr << "FS::free_chain: Broken block chain starting at block " << first_blk << std::endl;
+            return;
+        }
+        int next_blk = get_fat(block_no);
+        if (next_blk == FAT_FREE) {
+            std::cerr << "FS::free_chain: Broken block chain starting at block " << first_blk << std::endl;
+            return;
+        }
+        release_block(block_no);
+        block_no = next_blk;
+    }
+}
+
+template <int BlockSize>
+int
+BasicFS<BlockSize>::count_free_blocks()
+{
+    int free_blocks = 0;
+    for (int g = 0; g < ALLOC_GROUPS; g++) {
+        std::lock_guard<std::mutex> guard(groups[g].lock);
+        free_blocks += groups[g].free_count;
+    }
+    return free_blocks;
+}
+
+// Takes length free blocks and links them into a chain. cursor is the
+// block where the search for free blocks continues, -1 for the calling
+// thread's group, so allocating many chains in a row is a single pass over
+// the groups.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::allocate_chain(int length, std::vector<int> *blocks, int *cursor)
+{
+    blocks->clear();
+    if (*cursor < 0 || *cursor >= fat_entries) {
+        *cursor = *cursor < 0 ? my_group() * group_blocks : 0;
+    }
+    // Visit the groups from the cursor's on, and the cursor's group once
+    // more from its start, since blocks below the cursor may be free
+    int start = group_of<BlockSize>(*cursor);
+    for (int k = 0; k <= ALLOC_GROUPS && (int)blocks->size() < length; k++) {
+        int g = (start + k) % ALLOC_GROUPS;
+        int from = k == 0 ? *cursor : g * group_blocks;
+        int blk;
+        while ((int)blocks->size() < length && (blk = claim_block(g, from)) != -1) {
+            blocks->push_back(blk);
+            from = blk + 1;
+            *cursor = blk + 1;
+        }
+    }
+    if ((int)blocks->size() < length) {
+        for (size_t i = 0; i < blocks->size(); i++) {
+            release_block((*blocks)[i]);
+        }
+        blocks->clear();
+        std::cerr << "FS::allocate_chain: No free blocks" << std::endl;
+        return -1;
+    }
+    for (size_t i = 0; i + 1 < blocks->size(); i++) {
+        set_fat((*blocks)[i], (*blocks)[i + 1]);
+    }
+    return 0;
+}
+
+INSTANTIATE_BLOCK_SIZES(BasicFS)
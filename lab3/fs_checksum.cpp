@@ -0,0 +1,115 @@
+#include <iostream>
+#include <cstring>
+#include <unordered_set>
+#include "fs.h"
+#include "crc32c.h"
+
+// Turns checksums on with the table on disk. The superblock, the journal
+// and the table itself are left out: the journal has a checksum of its
+// own and the others are written in place.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::load_checksums()
+{
+    std::vector<uint32_t> table(fat_entries);
+    for (int i = 0; i < crc_blocks; i++) {
+        if (disk.read(CRC_START + i, (uint8_t*)table.data() + i * BlockSize) == -1) {
+            return -1;
+        }
+    }
+    disk.enable_checksums(table.data(), SUPER_BLOCK, CRC_START + crc_blocks - SUPER_BLOCK);
+    // The FAT was read before the table, so it is checked here
+    uint32_t stored = disk.stored_checksum(FAT_BLOCK);
+    if (stored != 0 && BasicDisk<BlockSize>::block_checksum((uint8_t*)fat) != stored) {
+        std::cout << "FS::FS()... The FAT does not match its checksum\n";
+    }
+    return 0;
+}
+
+// Starts an empty table for a newly formatted disk. The caller has
+// reserved its blocks in the FAT.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::init_checksums()
+{
+    std::vector<uint32_t> table(fat_entries, 0);
+    for (int i = 0; i < crc_blocks; i++) {
+        if (disk.write(CRC_START + i, (uint8_t*)table.data() + i * BlockSize) == -1) {
+            return -1;
+        }
+    }
+    super.crc_start = CRC_START;
+    super.crc_blocks = crc_blocks;
+    if (write_superblock() == -1) {
+        return -1;
+    }
+    disk.enable_checksums(table.data(), SUPER_BLOCK, CRC_START + crc_blocks - SUPER_BLOCK);
+    return 0;
+}
+
+// Reads every block in use and compares it with its checksum. A repair
+// takes the block as it is now, so it can be read again. Directory blocks
+// the journal has not written home yet are checked when it does.
+template <int BlockSize>
+void
+BasicFS<BlockSize>::check_checksums(fsck_report *report)
+{
+    if (!disk.checksums_enabled()) {
+        return;
+    }
+    std::unordered_set<int> unwritten;
+    {
+        std::lock_guard<std::mutex> guard(journal.lock);
+        std::map<int, std::vector<uint8_t>> *maps[2] = {&journal.pending, &journal.committing};
+        for (int m = 0; m < 2; m++) {
+            for (auto it = maps[m]->begin(); it != maps[m]->end(); ++it) {
+                unwritten.insert(it->first);
+            }
+        }
+    }
+    uint8_t buf[BlockSize];
+    for (int b = 0; b < fat_entries; b++) {
+        if ((b >= SUPER_BLOCK && b < CRC_START + crc_blocks) || (fat[b] == FAT_FREE && snap_refs[b] == 0) ||
+            unwritten.count(b) > 0) {
+            continue;
+        }
+        uint32_t stored = disk.stored_checksum(b);
+        if (stored == 0 || disk.read(b, buf, false) == -1) {
+            continue;
+        }
+        uint32_t actual = BasicDisk<BlockSize>::block_checksum(buf);
+        if (actual != stored) {
+            // check_tree left the tree below an unread directory alone, so
+            // nothing repaired in this run relied on the block's content.
+            // The next run checks the tree below it.
+            bool unread = report->unread.count(b) > 0;
+            if (report->repair) {
+                disk.set_checksum(b, actual);
+            }
+            fsck_problem(report, "Block " + std::to_string(b) + " does not match its checksum" +
+                         (unread && report->repair ? ", run fsck -r again to check the directory" : ""),
+                         report->repair);
+        }
+    }
+}
+
+// checksum [cached on|off] shows whether blocks are checksummed, or turns
+// checking off for directories already in memory
+template <int BlockSize>
+int
+BasicFS<BlockSize>::checksum(std::string cached)
+{
+    if (cached == "on" || cached == "off") {
+        verify_cached_dirs = cached == "on";
+        return 0;
+    }
+    if (!disk.checksums_enabled()) {
+        out() << "Blocks are not checksummed, format the disk to turn checksums on" << std::endl;
+        return 0;
+    }
+    out() << "Blocks are checksummed with CRC32C (" << (crc32c_hardware() ? "SSE4.2" : "software")
+          << "), cached directories are " << (verify_cached_dirs ? "" : "not ") << "checked" << std::endl;
+    return 0;
+}
+
+INSTANTIATE_BLOCK_SIZES(BasicFS)
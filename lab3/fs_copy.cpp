@@ -0,0 +1,101 @@
+#include <iostream>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include "fs.h"
+#include "workpool.h"
+
+// Copies the blocks of chain src into chain dst, which must be as long.
+// Short chains are copied in place. Longer ones go through a ring of
+// COPY_RING_SLOTS block buffers: reader threads fill the slots in chain
+// order and writer threads drain them, so a read of one block overlaps
+// the writes of earlier ones.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::copy_blocks(const std::vector<int> &src, const std::vector<int> &dst)
+{
+    size_t n = src.size();
+    if (n < COPY_PIPELINE_MIN) {
+        uint8_t buf[BlockSize];
+        for (size_t i = 0; i < n; i++) {
+            if (disk.read(src[i], buf) == -1 || disk.write(dst[i], buf) == -1) {
+                std::cerr << "FS::copy_blocks: Error copying block " << src[i] << " to " << dst[i] << std::endl;
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    // Slot s holds block slot_block[s] once slot_full[s] is set, and
+    // waits for it otherwise. A writer frees the slot for the block
+    // COPY_RING_SLOTS further down the chain.
+    std::vector<uint8_t> ring(COPY_RING_SLOTS * BlockSize);
+    std::vector<size_t> slot_block(COPY_RING_SLOTS);
+    std::vector<bool> slot_full(COPY_RING_SLOTS, false);
+    for (size_t s = 0; s < COPY_RING_SLOTS; s++) {
+        slot_block[s] = s;
+    }
+    size_t next_read = 0;
+    size_t next_write = 0;
+    bool failed = false;
+    std::mutex mutex;
+    std::condition_variable changed;
+
+    auto reader = [&]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!failed && next_read < n) {
+            size_t i = next_read++;
+            size_t s = i % COPY_RING_SLOTS;
+            changed.wait(lock, [&]() { return failed || (slot_block[s] == i && !slot_full[s]); });
+            if (failed) {
+                break;
+            }
+            lock.unlock();
+            int ret = disk.read(src[i], &ring[s * BlockSize]);
+            lock.lock();
+            if (ret == -1) {
+                std::cerr << "FS::copy_blocks: Error reading block " << src[i] << " from disk" << std::endl;
+                failed = true;
+            } else {
+                slot_full[s] = true;
+            }
+            changed.notify_all();
+        }
+    };
+    auto writer = [&]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!failed && next_write < n) {
+            size_t i = next_write++;
+            size_t s = i % COPY_RING_SLOTS;
+            changed.wait(lock, [&]() { return failed || (slot_block[s] == i && slot_full[s]); });
+            if (failed) {
+                break;
+            }
+            lock.unlock();
+            int ret = disk.write(dst[i], &ring[s * BlockSize]);
+            lock.lock();
+            if (ret == -1) {
+                std::cerr << "FS::copy_blocks: Error writing block " << dst[i] << " to disk" << std::endl;
+                failed = true;
+            } else {
+                slot_full[s] = false;
+                slot_block[s] += COPY_RING_SLOTS;
+            }
+            changed.notify_all();
+        }
+    };
+
+    // Readers and writers wait on each other, so every one of them needs
+    // a thread of its own
+    WorkPool pool(COPY_READERS + COPY_WRITERS);
+    for (int r = 0; r < COPY_READERS; r++) {
+        pool.submit(reader);
+    }
+    for (int w = 0; w < COPY_WRITERS; w++) {
+        pool.submit(writer);
+    }
+    pool.wait();
+    return failed ? -1 : 0;
+}
+
+INSTANTIATE_BLOCK_SIZES(BasicFS)
@@ -0,0 +1,345 @@
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+#include <set>
+#include <unordered_set>
+#include "fs.h"
+
+// First block after the FAT, the superblock, the journal, the checksums
+// and the path index
+template <int BlockSize>
+int
+BasicFS<BlockSize>::reserved_blocks()
+{
+    if (super.index_blocks != 0) {
+        return super.index_start + super.index_blocks;
+    }
+    if (disk.checksums_enabled()) {
+        return CRC_START + crc_blocks;
+    }
+    return journal.enabled ? JOURNAL_START + JOURNAL_BLOCKS : FAT_BLOCK + 1;
+}
+
+template <int BlockSize>
+void
+BasicFS<BlockSize>::fsck_problem(fsck_report *report, const std::string &message, bool repaired)
+{
+    report->problems++;
+    if (repaired) {
+        report->repaired++;
+    }
+    if (report->verbose) {
+        out() << message << (repaired ? " (repaired)" : "") << std::endl;
+    }
+}
+
+// Checks every FAT entry on its own: reserved blocks are in use and links
+// point at used, unreserved blocks. A bad link ends its chain on repair.
+// Two links to one block are left to check_tree, which knows the files.
+template <int BlockSize>
+void
+BasicFS<BlockSize>::check_fat(fsck_report *report)
+{
+    int first_free = reserved_blocks();
+    if (fat[ROOT_BLOCK] == FAT_FREE) {
+        if (report->repair) {
+            set_fat(ROOT_BLOCK, FAT_EOF);
+        }
+        fsck_problem(report, "Root directory block is marked free", report->repair);
+    }
+    for (int b = FAT_BLOCK; b < first_free; b++) {
+        if (fat[b] != FAT_EOF) {
+            if (report->repair) {
+                set_fat(b, FAT_EOF);
+            }
+            fsck_problem(report, "Reserved block " + std::to_string(b) + " is not marked used", report->repair);
+        }
+    }
+
+    std::vector<int> pred(fat_entries, -1);
+    for (int b = 0; b < fat_entries; b++) {
+        int next = fat[b];
+        if (next == FAT_FREE || next == FAT_EOF) {
+            continue;
+        }
+        std::ostringstream msg;
+        if (next < first_free || next >= fat_entries) {
+            msg << "Block " << b << " links to invalid block " << next;
+        } else if (fat[next] == FAT_FREE) {
+            msg << "Block " << b << " links to free block " << next;
+        } else {
+            if (pred[next] != -1 && report->quick) {
+                msg << "Blocks " << pred[next] << " and " << b << " both link to block " << next;
+                fsck_problem(report, msg.str(), false);
+            }
+            pred[next] = b;
+            continue;
+        }
+        if (report->repair) {
+            set_fat(b, FAT_EOF);
+        }
+        fsck_problem(report, msg.str(), report->repair);
+    }
+}
+
+// Walks the whole tree and gives every block one owner: a file, a
+// directory or the reserved area. A file sharing blocks with an earlier
+// owner gets its own copy of them on repair, and used blocks nobody owns
+// are freed. If a directory cannot be read, what lies below it looks
+// unowned, so entries are not removed and no blocks are freed.
+template <int BlockSize>
+void
+BasicFS<BlockSize>::check_tree(fsck_report *report)
+{
+    op_context ctx;
+    std::deque<tree_node> nodes;
+    bool complete = scan_tree(get_dir(ROOT_BLOCK)->info, "/", &nodes, false) == 0;
+
+    // Paths decide which of two owners of a block comes first, so the
+    // report does not depend on the order the scan threads finished in
+    std::vector<std::pair<std::string, int>> order;
+    std::set<std::pair<int, int>> linked; // (parent node, first block) of every scanned directory
+    for (size_t i = 0; i < nodes.size(); i++) {
+        order.push_back(std::make_pair(nodes[i].path, i));
+        linked.insert(std::make_pair(nodes[i].parent, (int)nodes[i].info.first_blk));
+    }
+    std::sort(order.begin(), order.end());
+
+    std::vector<int> owner(fat_entries, -1);
+    std::vector<std::string> owners(1, "the reserved area");
+    for (int b = FAT_BLOCK; b < reserved_blocks(); b++) {
+        owner[b] = 0;
+    }
+    int cursor = -1;
+
+    for (size_t n = 0; n < order.size(); n++) {
+        int i = order[n].second;
+        tree_node *node = &nodes[i];
+        std::string prefix = node->path == "/" ? "" : node->path;
+        int id = owners.size();
+        owners.push_back(node->path);
+        for (size_t b = 0; b < node->blocks.size(); b++) {
+            int blk = node->blocks[b];
+            if (owner[blk] != -1) {
+                fsck_problem(report, node->path + ": directory block " + std::to_string(blk) +
+                             " is also used by " + owners[owner[blk]], false);
+            } else {
+                owner[blk] = id;
+            }
+        }
+        if (node->entries.empty()) {
+            report->unread.insert(node->blocks.begin(), node->blocks.end());
+            fsck_problem(report, node->path + ": directory could not be read, nothing below it is checked", false);
+            continue;
+        }
+        dir_struct *dir = report->repair ? get_dir(node->info.first_blk) : nullptr;
+        bool remove = dir != nullptr && complete;
+
+        int parent_blk = node->parent == -1 ? ROOT_BLOCK : nodes[node->parent].info.first_blk;
+        const dir_entry &dotdot = node->entries[PARENT_DIR_ENTRY_INDEX];
+        if (dotdot.first_blk != parent_blk || dotdot.type != TYPE_DIR) {
+            if (dir != nullptr) {
+                dir_entry *entry = modify_entry(&ctx, dir, PARENT_DIR_ENTRY_INDEX);
+                entry->first_blk = parent_blk;
+                entry->type = TYPE_DIR;
+            }
+            fsck_problem(report, node->path + ": .. points to block " + std::to_string(dotdot.first_blk) +
+                         " instead of " + std::to_string(parent_blk), dir != nullptr);
+        }
+
+        for (size_t s = 1; s < node->entries.size(); s++) {
+            const dir_entry &entry = node->entries[s];
+            if (entry.first_blk == FAT_FREE) {
+                continue;
+            }
+            std::string path = prefix + "/" + entry_name(entry);
+            bool dangling = entry.first_blk >= fat_entries || fat[entry.first_blk] == FAT_FREE;
+            if (entry.type == TYPE_DIR && !dangling) {
+                if (linked.erase(std::make_pair(i, (int)entry.first_blk)) == 0) {
+                    if (remove) {
+                        clear_entry(&ctx, dir, s);
+                    }
+                    fsck_problem(report, path + ": directory block " + std::to_string(entry.first_blk) +
+                                 " is linked twice" + (remove ? ", entry removed" : ""), remove);
+                }
+                continue;
+            }
+            if (dangling) {
+                if (remove) {
+                    clear_entry(&ctx, dir, s);
+                }
+                fsck_problem(report, path + ": first block " + std::to_string(entry.first_blk) +
+                             " is not in use" + (remove ? ", entry removed" : ""), remove);
+                continue;
+            }
+
+            int file_id = owners.size();
+            owners.push_back(path);
+            std::vector<int> chain = node->file_blocks[s];
+            int other = -1;
+            size_t k;
+            for (k = 0; k < chain.size(); k++) {
+                int blk = chain[k];
+                if (owner[blk] == file_id) {
+                    if (report->repair) {
+                        set_fat(chain[k - 1], FAT_EOF);
+                    }
+                    fsck_problem(report, path + ": block chain loops back to block " + std::to_string(blk), report->repair);
+                    break;
+                }
+                if (owner[blk] != -1) {
+                    other = other == -1 ? owner[blk] : other;
+                } else {
+                    owner[blk] = file_id;
+                }
+            }
+            chain.resize(k);
+
+            if (other != -1) {
+                std::vector<int> copy;
+                bool copied = false;
+                if (dir != nullptr && allocate_chain(chain.size(), &copy, &cursor) == 0) {
+                    if (copy_blocks(chain, copy) == 0) {
+                        for (size_t c = 0; c < chain.size(); c++) {
+                            if (owner[chain[c]] == file_id) {
+                                owner[chain[c]] = -1; // freed below with the leaked blocks
+                            }
+                        }
+                        for (size_t c = 0; c < copy.size(); c++) {
+                            owner[copy[c]] = file_id;
+                        }
+                        modify_entry(&ctx, dir, s)->first_blk = copy[0];
+                        chain = copy;
+                        copied = true;
+                    } else {
+                        for (size_t c = 0; c < copy.size(); c++) {
+                            release_block(copy[c]);
+                        }
+                    }
+                }
+                fsck_problem(report, path + ": shares blocks with " + owners[other] +
+                             (copied ? ", copied" : ""), copied);
+            }
+
+            size_t blocks = entry.size == 0 ? 0 : (entry.size - 1) / BlockSize + 1;
+            if (blocks != chain.size() && !chain.empty()) {
+                // The terminator in the last block tells the real size
+                uint8_t buf[BlockSize];
+                bool fixed = false;
+                if (dir != nullptr && disk.read(chain.back(), buf) == 0) {
+                    size_t last = strnlen((char*)buf, BlockSize);
+                    size_t size = (chain.size() - 1) * BlockSize + std::min(last + 1, (size_t)BlockSize);
+                    modify_entry(&ctx, dir, s)->size = size;
+                    fixed = true;
+                }
+                fsck_problem(report, path + ": size " + std::to_string(entry.size) + " does not match its " +
+                             std::to_string(chain.size()) + " blocks", fixed);
+            }
+        }
+    }
+
+    int leaked = 0;
+    for (int b = 0; b < fat_entries; b++) {
+        if (fat[b] != FAT_FREE && owner[b] == -1) {
+            leaked++;
+            if (report->repair && complete) {
+                release_block(b);
+            }
+        }
+    }
+    if (leaked > 0) {
+        fsck_problem(report, std::to_string(leaked) + " blocks are marked used but belong to no file" +
+                     (complete ? "" : " or sit below a directory that could not be read"), report->repair && complete);
+    }
+    if (report->repair) {
+        commit(&ctx);
+    }
+}
+
+// Checks that each allocation group's free map and count match the FAT.
+// Blocks freed by a transaction that is not committed yet are in use until
+// it is, and blocks a snapshot holds stay in use, so they are left out of
+// the map.
+template <int BlockSize>
+void
+BasicFS<BlockSize>::check_alloc(fsck_report *report)
+{
+    std::unordered_set<int> deferred;
+    {
+        std::lock_guard<std::mutex> guard(journal.lock);
+        deferred.insert(journal.deferred_frees.begin(), journal.deferred_frees.end());
+    }
+    for (int g = 0; g < ALLOC_GROUPS; g++) {
+        alloc_group<group_blocks> *group = &groups[g];
+        std::lock_guard<std::mutex> guard(group->lock);
+        uint64_t expected[group_blocks / 64] = {0};
+        int expected_count = 0;
+        int wrong = 0;
+        for (int i = 0; i < group_blocks; i++) {
+            int blk = g * group_blocks + i;
+            if (fat[blk] == FAT_FREE && snap_refs[blk] == 0 && deferred.count(blk) == 0) {
+                expected[i / 64] |= 1ull << (i % 64);
+                expected_count++;
+            }
+            if (((group->free_bits[i / 64] ^ expected[i / 64]) >> (i % 64)) & 1) {
+                wrong++;
+            }
+        }
+        if (wrong == 0 && group->free_count == expected_count) {
+            continue;
+        }
+        std::ostringstream msg;
+        msg << "Allocation group " << g << ": free map differs from the FAT on " << wrong
+            << " blocks, free count " << group->free_count << " should be " << expected_count;
+        if (report->repair) {
+            memcpy(group->free_bits, expected, sizeof(expected));
+            group->free_count = expected_count;
+            group->count_runs();
+        }
+        fsck_problem(report, msg.str(), report->repair);
+    }
+}
+
+// fsck [-q] [-r] checks that the FAT, the allocator and the directory tree
+// agree and that blocks match their checksums. -q checks only the FAT and
+// the allocator, -r repairs.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::fsck(bool quick, bool repair)
+{
+    trace_scope trace(this, TRACE_FSCK, "", "", quick | repair << 1);
+    // A repair may rewrite any number of directory blocks
+    tx_handle tx(&journal, repair ? journal.capacity : JOURNAL_CMD_BLOCKS);
+    op_locks locks(&ns_lock, true);
+    if (mounted_snapshot != -1) {
+        out() << "fsck checks the live file system, run snapshot umount first" << std::endl;
+        return -1;
+    }
+    if (fat[ROOT_BLOCK] == FAT_FREE && fat[FAT_BLOCK] == FAT_FREE) {
+        out() << "The disk is not formatted" << std::endl;
+        return -1;
+    }
+    fsck_report report = {quick, repair, true, 0, 0};
+    check_fat(&report);
+    if (!quick) {
+        check_tree(&report);
+        // What is kept about the tree is checked against it as check_tree
+        // left it
+        std::deque<tree_node> nodes;
+        if (scan_tree(get_dir(ROOT_BLOCK)->info, "/", &nodes, false) == 0) {
+            check_path_index(nodes, &report);
+            check_counters(nodes, &report);
+        }
+        check_checksums(&report);
+    }
+    check_alloc(&report);
+    if (report.problems == 0) {
+        out() << "No problems found" << std::endl;
+    } else {
+        out() << report.problems << " problems found, " << report.repaired << " repaired" << std::endl;
+    }
+    return 0;
+}
+
+INSTANTIATE_BLOCK_SIZES(BasicFS)
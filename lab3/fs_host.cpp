@@ -0,0 +1,454 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "fs.h"
+
+// Reads up to size bytes, stopping early only at the end of the file
+static ssize_t
+read_full(int fd, uint8_t *buf, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, buf + done, size - done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+static int
+write_full(int fd, const uint8_t *buf, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = write(fd, buf + done, size - done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static std::string
+host_basename(std::string path)
+{
+    while (path.size() > 1 && path[path.size() - 1] == '/') {
+        path.erase(path.size() - 1);
+    }
+    return path.substr(path.find_last_of('/') + 1);
+}
+
+// Writes count blocks of buf to chain[first], chain[first + 1], ... Blocks
+// that follow each other on the disk go out in one write.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::write_chain(const std::vector<int> &chain, size_t first, size_t count, const uint8_t *buf)
+{
+    size_t i = 0;
+    while (i < count) {
+        size_t run = 1;
+        while (i + run < count && chain[first + i + run] == chain[first + i] + (int)run) {
+            run++;
+        }
+        if (disk.write_blocks(chain[first + i], run, buf + i * BlockSize) == -1) {
+            std::cerr << "FS::write_chain: Error writing block " << chain[first + i] << " to disk" << std::endl;
+            return -1;
+        }
+        i += run;
+    }
+    return 0;
+}
+
+template <int BlockSize>
+int
+BasicFS<BlockSize>::read_chain(const std::vector<int> &chain, size_t first, size_t count, uint8_t *buf)
+{
+    size_t i = 0;
+    while (i < count) {
+        size_t run = 1;
+        while (i + run < count && chain[first + i + run] == chain[first + i] + (int)run) {
+            run++;
+        }
+        if (disk.read_blocks(chain[first + i], run, buf + i * BlockSize) == -1) {
+            std::cerr << "FS::read_chain: Error reading block " << chain[first + i] << " from disk" << std::endl;
+            return -1;
+        }
+        i += run;
+    }
+    return 0;
+}
+
+// Creates filepath with the size bytes read from the host file fd. The
+// file is read before the command joins a transaction, so a slow host
+// file holds up neither group commit nor other commands, then written to
+// its chain in runs of adjacent blocks.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::import_file(int fd, size_t size, std::string filepath)
+{
+    trace_scope trace(this, TRACE_CREATE, filepath, "", size);
+    // Like create, the last block holds the terminator, so a file that
+    // fills its blocks exactly gets one more
+    size_t blocks = size / BlockSize + 1;
+    if (blocks > (size_t)fat_entries) {
+        out() << "Not enough free blocks for " << filepath << std::endl;
+        return -1;
+    }
+    std::vector<uint8_t> buf(blocks * BlockSize, 0);
+    if (read_full(fd, buf.data(), size) != (ssize_t)size) {
+        out() << "Error reading the host file for " << filepath << std::endl;
+        return -1;
+    }
+
+    tx_handle tx(&journal);
+    op_locks locks(&ns_lock, false);
+    if (check_writable() == -1) {
+        return -1;
+    }
+    op_context ctx;
+
+    std::string filename;
+    std::string dirpath;
+    get_filename_parts(filepath, &filename, &dirpath);
+    if (filename.empty()) {
+        out() << "Cannot create file with same name as a directory." << std::endl;
+        return -1;
+    }
+    if (filename.size() >= sizeof(((dir_entry*)nullptr)->file_name)) {
+        out() << "File name " << filename << " is too long" << std::endl;
+        return -1;
+    }
+    dir_struct *dir = resolve_dir(dirpath);
+    if (dir == nullptr) {
+        out() << "Path not found" << std::endl;
+        return -1;
+    }
+    locks.lock_dirs(dir, true);
+    if (!has_permission(dir->info, WRITE | EXECUTE)) {
+        out() << "You do not have permission to create files in this directory." << std::endl;
+        return rollback(&ctx);
+    }
+    if (find_dir_entry(dir, filename) != nullptr) {
+        out() << "A file or directory named " << filename << " already exists in this directory." << std::endl;
+        return rollback(&ctx);
+    }
+    int dir_index = find_empty_dir_index(dir);
+    if (dir_index == -1) {
+        std::cerr << "FS::import_file: No free space in directory\n";
+        return rollback(&ctx);
+    }
+
+    std::vector<int> chain;
+    int cursor = -1;
+    if (allocate_chain(blocks, &chain, &cursor) == -1) {
+        out() << "Not enough free blocks for " << filename << std::endl;
+        return rollback(&ctx);
+    }
+    if (write_chain(chain, 0, blocks, buf.data()) == -1) {
+        for (size_t i = 0; i < chain.size(); i++) {
+            release_block(chain[i]);
+        }
+        rollback(&ctx);
+        return -1;
+    }
+
+    dir_entry file;
+    memset(&file, 0, sizeof(file));
+    strncpy(file.file_name, filename.c_str(), sizeof(file.file_name) - 1);
+    file.size = size + 1; // Include null terminator.
+    file.first_blk = chain[0];
+    file.type = TYPE_FILE;
+    file.access_rights = READ | WRITE;
+    set_entry(&ctx, dir, dir_index, file);
+    return commit(&ctx);
+}
+
+// Writes the content of the file whose blocks are chain to the host file
+// fd. size is the stored size, which counts the terminator.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::export_chain(const std::vector<int> &chain, size_t size, int fd)
+{
+    size_t remaining = size > 0 ? size - 1 : 0;
+    std::vector<uint8_t> buf(HOST_CHUNK_BLOCKS * BlockSize);
+    for (size_t b = 0; b < chain.size() && remaining > 0; b += HOST_CHUNK_BLOCKS) {
+        size_t count = std::min((size_t)HOST_CHUNK_BLOCKS, chain.size() - b);
+        if (read_chain(chain, b, count, buf.data()) == -1) {
+            return -1;
+        }
+        size_t length = std::min(remaining, count * BlockSize);
+        if (write_full(fd, buf.data(), length) == -1) {
+            out() << "Error writing the host file: " << strerror(errno) << std::endl;
+            return -1;
+        }
+        remaining -= length;
+    }
+    return 0;
+}
+
+// Opens hostpath for export, replacing any file there
+static int
+create_host_file(const std::string &hostpath)
+{
+    return open(hostpath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+// import [-r] <hostpath> <filepath> copies a file, or with -r a directory
+// tree, from the host into the file system. An existing directory as
+// filepath gets the copy under its host name.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::import_host(std::string hostpath, std::string filepath, bool recursive)
+{
+    struct stat st;
+    if (stat(hostpath.c_str(), &st) == -1) {
+        out() << "Cannot open " << hostpath << ": " << strerror(errno) << std::endl;
+        return -1;
+    }
+    if (S_ISDIR(st.st_mode) && !recursive) {
+        out() << hostpath << " is a directory, use import -r" << std::endl;
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+        out() << hostpath << " is not a regular file" << std::endl;
+        return -1;
+    }
+    std::string filename, dirpath;
+    {
+        op_locks locks(&ns_lock, false);
+        get_filename_parts(filepath, &filename, &dirpath);
+    }
+    if (filename.empty()) {
+        filepath = dirpath + (dirpath.empty() || dirpath[dirpath.size() - 1] == '/' ? "" : "/") + host_basename(hostpath);
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        import_stats stats = {0, 0, 0, 0};
+        int ret = import_tree(hostpath, filepath, &stats);
+        out() << "Imported " << stats.files << " files in " << stats.dirs << " directories, "
+              << stats.bytes << " bytes";
+        if (stats.errors > 0) {
+            out() << ", " << stats.errors << " errors";
+        }
+        out() << std::endl;
+        return ret;
+    }
+    int fd = open(hostpath.c_str(), O_RDONLY);
+    if (fd == -1) {
+        out() << "Cannot open " << hostpath << ": " << strerror(errno) << std::endl;
+        return -1;
+    }
+    int ret = import_file(fd, st.st_size, filepath);
+    close(fd);
+    return ret;
+}
+
+// Creates filepath as a directory and imports the host directory hostpath
+// into it, one file at a time. Entries that cannot be imported are
+// reported and skipped.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::import_tree(std::string hostpath, std::string filepath, import_stats *stats)
+{
+    std::string name, dirpath;
+    {
+        op_locks locks(&ns_lock, false);
+        get_filename_parts(filepath, &name, &dirpath);
+    }
+    if (name.empty()) {
+        out() << "Directory " << filepath << " already exists" << std::endl;
+        stats->errors++;
+        return -1;
+    }
+    if (mkdir(filepath) != 0) {
+        stats->errors++;
+        return -1;
+    }
+    stats->dirs++;
+
+    DIR *host_dir = ::opendir(hostpath.c_str());
+    if (host_dir == nullptr) {
+        out() << "Cannot open " << hostpath << ": " << strerror(errno) << std::endl;
+        stats->errors++;
+        return -1;
+    }
+    std::vector<std::string> names;
+    struct dirent *de;
+    while ((de = ::readdir(host_dir)) != nullptr) {
+        if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+            names.push_back(de->d_name);
+        }
+    }
+    ::closedir(host_dir);
+    std::sort(names.begin(), names.end());
+
+    for (size_t i = 0; i < names.size(); i++) {
+        std::string host_child = hostpath + "/" + names[i];
+        std::string child = filepath + "/" + names[i];
+        struct stat st;
+        if (names[i].size() >= sizeof(((dir_entry*)nullptr)->file_name)) {
+            out() << "Skipping " << host_child << ", the name is too long" << std::endl;
+            stats->errors++;
+        } else if (lstat(host_child.c_str(), &st) == -1) {
+            out() << "Cannot open " << host_child << ": " << strerror(errno) << std::endl;
+            stats->errors++;
+        } else if (S_ISDIR(st.st_mode)) {
+            import_tree(host_child, child, stats);
+        } else if (!S_ISREG(st.st_mode)) {
+            out() << "Skipping " << host_child << ", not a regular file" << std::endl;
+        } else {
+            int fd = open(host_child.c_str(), O_RDONLY);
+            if (fd == -1) {
+                out() << "Cannot open " << host_child << ": " << strerror(errno) << std::endl;
+                stats->errors++;
+                continue;
+            }
+            if (import_file(fd, st.st_size, child) == 0) {
+                stats->files++;
+                stats->bytes += st.st_size;
+            } else {
+                stats->errors++;
+            }
+            close(fd);
+        }
+    }
+    return stats->errors > 0 ? -1 : 0;
+}
+
+// export [-r] <filepath> <hostpath> copies a file, or with -r a directory
+// tree, from the file system to the host
+template <int BlockSize>
+int
+BasicFS<BlockSize>::export_host(std::string filepath, std::string hostpath, bool recursive)
+{
+    std::string filename;
+    std::string dirpath;
+    op_locks locks(&ns_lock, recursive);
+    get_filename_parts(filepath, &filename, &dirpath);
+    if (filename.empty()) {
+        if (!recursive) {
+            out() << filepath << " is a directory, use export -r" << std::endl;
+            return -1;
+        }
+        dir_struct *top = resolve_dir(dirpath);
+        if (top == nullptr) {
+            out() << "Path not found" << std::endl;
+            return -1;
+        }
+        return export_tree(top, hostpath);
+    }
+    // A replay reads the file; export -r is not recorded
+    trace_scope trace(this, TRACE_READ, filepath);
+    dir_struct *dir = resolve_dir(dirpath);
+    if (dir == nullptr) {
+        out() << "Path not found" << std::endl;
+        return -1;
+    }
+    locks.lock_dirs(dir, false);
+    dir_entry *file = find_dir_entry(dir, filename);
+    if (file == nullptr || file->type == TYPE_DIR) {
+        out() << "File \"" << filename << "\" not found" << std::endl;
+        return -1;
+    }
+    if (!has_permission(*file, READ)) {
+        out() << "You do not have permission to read " << filename << std::endl;
+        return -1;
+    }
+    std::vector<int> chain;
+    if (get_chain(file->first_blk, &chain) == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (stat(hostpath.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        hostpath += "/" + filename;
+    }
+    int fd = create_host_file(hostpath);
+    if (fd == -1) {
+        out() << "Cannot create " << hostpath << ": " << strerror(errno) << std::endl;
+        return -1;
+    }
+    int ret = export_chain(chain, file->size, fd);
+    if (close(fd) == -1 && ret == 0) {
+        out() << "Error writing " << hostpath << ": " << strerror(errno) << std::endl;
+        ret = -1;
+    }
+    return ret;
+}
+
+// Writes the tree below top to the host directory hostpath, which may
+// exist already. Called with the namespace locked exclusively, so the
+// tree does not change while it is read.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::export_tree(dir_struct *top, std::string hostpath)
+{
+    std::deque<tree_node> nodes;
+    if (scan_tree(top->info, get_dir_path(top), &nodes) == -1) {
+        return -1;
+    }
+    std::vector<std::string> host_dirs(nodes.size());
+    int files = 0, errors = 0;
+    size_t bytes = 0;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        tree_node *node = &nodes[i];
+        host_dirs[i] = node->parent == -1 ? hostpath : host_dirs[node->parent] + "/" + entry_name(node->info);
+        if (::mkdir(host_dirs[i].c_str(), 0755) == -1 && errno != EEXIST) {
+            out() << "Cannot create " << host_dirs[i] << ": " << strerror(errno) << std::endl;
+            errors++;
+            continue;
+        }
+        if (!node->readable) {
+            out() << "You do not have permission to read " << node->path << std::endl;
+            errors++;
+            continue;
+        }
+        for (auto it = node->file_blocks.begin(); it != node->file_blocks.end(); ++it) {
+            const dir_entry &entry = node->entries[it->first];
+            std::string host_file = host_dirs[i] + "/" + entry_name(entry);
+            if (!has_permission(entry, READ)) {
+                out() << "You do not have permission to read " << entry_name(entry) << std::endl;
+                errors++;
+                continue;
+            }
+            int fd = create_host_file(host_file);
+            if (fd == -1) {
+                out() << "Cannot create " << host_file << ": " << strerror(errno) << std::endl;
+                errors++;
+                continue;
+            }
+            int ret = export_chain(it->second, entry.size, fd);
+            if (close(fd) == 0 && ret == 0) {
+                files++;
+                bytes += entry.size > 0 ? entry.size - 1 : 0;
+            } else {
+                errors++;
+            }
+        }
+    }
+    out() << "Exported " << files << " files in " << nodes.size() << " directories, " << bytes << " bytes";
+    if (errors > 0) {
+        out() << ", " << errors << " errors";
+    }
+    out() << std::endl;
+    return errors > 0 ? -1 : 0;
+}
+
+INSTANTIATE_BLOCK_SIZES(BasicFS)
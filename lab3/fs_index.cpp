@@ -0,0 +1,463 @@
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <tuple>
+#include <unordered_set>
+#include "fs.h"
+
+// FNV-1a over the parent's block and at most the 56 bytes of the name. It
+// only picks the bucket to start from; records are matched on the name.
+static uint64_t
+path_hash(int parent, const char *name)
+{
+    uint64_t h = 14695981039346656037ull;
+    h = (h ^ (parent & 0xff)) * 1099511628211ull;
+    h = (h ^ ((parent >> 8) & 0xff)) * 1099511628211ull;
+    for (int i = 0; i < 56 && name[i] != '\0'; i++) {
+        h = (h ^ (uint8_t)name[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+static bool
+bucket_used(const path_index_record &rec)
+{
+    return rec.pos != PATH_INDEX_EMPTY && rec.pos != PATH_INDEX_TOMBSTONE;
+}
+
+typedef std::tuple<int, std::string, int, int, int, int> record_key_t;
+
+static record_key_t
+record_key(const path_index_record &rec)
+{
+    return std::make_tuple(rec.parent, std::string(rec.name, strnlen(rec.name, 56)), rec.first_blk, rec.blk,
+                           rec.pos, rec.access_rights);
+}
+
+// Reads the index at mount, after the journal is replayed, if the
+// superblock has it switched on
+template <int BlockSize>
+int
+BasicFS<BlockSize>::load_path_index()
+{
+    path_index.enabled = false;
+    if (!journal.enabled || super.index_enabled == 0 || super.index_start != index_start ||
+        super.index_blocks != index_blocks) {
+        return 0;
+    }
+    path_index.records.assign(index_buckets, path_index_record());
+    for (int i = 0; i < index_blocks; i++) {
+        if (disk.read(index_start + i, (uint8_t*)path_index.records.data() + i * BlockSize) == -1) {
+            std::cout << "FS::FS()... The path index could not be read, run pathindex on\n";
+            return -1;
+        }
+    }
+    path_index.used = 0;
+    path_index.tombstones = 0;
+    for (int b = 0; b < index_buckets; b++) {
+        if (path_index.records[b].pos == PATH_INDEX_TOMBSTONE) {
+            path_index.tombstones++;
+        } else if (path_index.records[b].pos != PATH_INDEX_EMPTY) {
+            path_index.used++;
+        }
+    }
+    path_index.enabled = true;
+    return 0;
+}
+
+// Starts an empty index for a newly formatted disk. The caller has
+// reserved its blocks in the FAT and writes the superblock.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::init_path_index()
+{
+    std::lock_guard<std::mutex> guard(path_index.lock);
+    path_index.records.assign(index_buckets, path_index_record());
+    path_index.used = 0;
+    path_index.tombstones = 0;
+    for (int i = 0; i < index_blocks; i++) {
+        path_index.dirty.insert(i);
+    }
+    path_index.enabled = true;
+    super.index_start = index_start;
+    super.index_blocks = index_blocks;
+    super.index_enabled = 1;
+    return write_path_index();
+}
+
+// Indexes every entry of a tree scanned from the root
+template <int BlockSize>
+int
+BasicFS<BlockSize>::build_path_index(const std::deque<tree_node> &nodes)
+{
+    {
+        std::lock_guard<std::mutex> guard(path_index.lock);
+        path_index.records.assign(index_buckets, path_index_record());
+        path_index.used = 0;
+        path_index.tombstones = 0;
+        for (int i = 0; i < index_blocks; i++) {
+            path_index.dirty.insert(i);
+        }
+        path_index.enabled = true;
+    }
+    for (size_t i = 0; i < nodes.size(); i++) {
+        index_dir(nodes[i].blocks, nodes[i].entries);
+    }
+    std::lock_guard<std::mutex> guard(path_index.lock);
+    return write_path_index();
+}
+
+// Writes the blocks of the index changed since the last call through the
+// running transaction. Called with path_index.lock held.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::write_path_index()
+{
+    const uint8_t *records = (const uint8_t*)path_index.records.data();
+    for (auto it = path_index.dirty.begin(); it != path_index.dirty.end(); ++it) {
+        if (write_meta(index_start + *it, records + *it * BlockSize) == -1) {
+            std::cerr << "FS::write_path_index: Error writing block " << index_start + *it << " to disk" << std::endl;
+            return -1;
+        }
+    }
+    path_index.dirty.clear();
+    return 0;
+}
+
+// Returns the bucket of the sub-directory name in the directory starting
+// at parent, or -1. Called with path_index.lock held.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::index_find(int parent, const char *name)
+{
+    uint64_t h = path_hash(parent, name);
+    for (int probe = 0; probe < index_buckets; probe++) {
+        int b = (h + probe) & (index_buckets - 1);
+        const path_index_record &rec = path_index.records[b];
+        if (rec.pos == PATH_INDEX_EMPTY) {
+            break;
+        }
+        if (rec.pos != PATH_INDEX_TOMBSTONE && rec.parent == parent && strncmp(rec.name, name, 56) == 0) {
+            return b;
+        }
+    }
+    return -1;
+}
+
+// Adds entry, which sits at pos of directory block blk, to the index if it
+// is a directory. Called with path_index.lock held.
+template <int BlockSize>
+void
+BasicFS<BlockSize>::index_insert(int parent, const dir_entry &entry, int blk, int pos)
+{
+    if (entry.type != TYPE_DIR) {
+        return;
+    }
+    uint64_t h = path_hash(parent, entry.file_name);
+    for (int probe = 0; probe < index_buckets; probe++) {
+        int b = (h + probe) & (index_buckets - 1);
+        path_index_record *rec = &path_index.records[b];
+        if (bucket_used(*rec)) {
+            continue;
+        }
+        if (rec->pos == PATH_INDEX_TOMBSTONE) {
+            path_index.tombstones--;
+        }
+        memcpy(rec->name, entry.file_name, 56);
+        rec->parent = parent;
+        rec->first_blk = entry.first_blk;
+        rec->blk = blk;
+        rec->pos = pos + 1;
+        rec->access_rights = entry.access_rights;
+        path_index.used++;
+        path_index.dirty.insert(b * sizeof(path_index_record) / BlockSize);
+        return;
+    }
+    std::cerr << "FS::index_insert: The path index is full" << std::endl;
+}
+
+// Drops entry of the directory starting at parent from the index. Called
+// with path_index.lock held.
+template <int BlockSize>
+void
+BasicFS<BlockSize>::index_remove(int parent, const dir_entry &entry)
+{
+    uint64_t h = path_hash(parent, entry.file_name);
+    for (int probe = 0; probe < index_buckets; probe++) {
+        int b = (h + probe) & (index_buckets - 1);
+        path_index_record *rec = &path_index.records[b];
+        if (rec->pos == PATH_INDEX_EMPTY) {
+            return;
+        }
+        if (bucket_used(*rec) && rec->parent == parent && rec->first_blk == entry.first_blk &&
+            strncmp(rec->name, entry.file_name, 56) == 0) {
+            rec->pos = PATH_INDEX_TOMBSTONE;
+            path_index.used--;
+            path_index.tombstones++;
+            path_index.dirty.insert(b * sizeof(path_index_record) / BlockSize);
+            return;
+        }
+    }
+}
+
+// Drops everything below the directories starting at dirs, which have
+// left the tree. Called with path_index.lock held.
+template <int BlockSize>
+void
+BasicFS<BlockSize>::index_remove_below(const std::vector<int> &dirs)
+{
+    std::unordered_set<int> gone(dirs.begin(), dirs.end());
+    // A child may sit in a bucket before its parent, so sweep until a
+    // pass finds no more directories
+    bool more = true;
+    while (more) {
+        more = false;
+        for (int b = 0; b < index_buckets; b++) {
+            path_index_record *rec = &path_index.records[b];
+            if (!bucket_used(*rec) || gone.count(rec->parent) == 0) {
+                continue;
+            }
+            if (gone.insert(rec->first_blk).second) {
+                more = true;
+            }
+            rec->pos = PATH_INDEX_TOMBSTONE;
+            path_index.used--;
+            path_index.tombstones++;
+            path_index.dirty.insert(b * sizeof(path_index_record) / BlockSize);
+        }
+    }
+}
+
+// Reinserts every record, clearing the tombstones. Called with
+// path_index.lock held.
+template <int BlockSize>
+void
+BasicFS<BlockSize>::index_rehash()
+{
+    std::vector<path_index_record> live;
+    for (int b = 0; b < index_buckets; b++) {
+        if (bucket_used(path_index.records[b])) {
+            live.push_back(path_index.records[b]);
+        }
+    }
+    path_index.records.assign(index_buckets, path_index_record());
+    for (size_t i = 0; i < live.size(); i++) {
+        for (int probe = 0; probe < index_buckets; probe++) {
+            path_index_record *rec = &path_index.records[(path_hash(live[i].parent, live[i].name) + probe) &
+                                                         (index_buckets - 1)];
+            if (rec->pos == PATH_INDEX_EMPTY) {
+                *rec = live[i];
+                break;
+            }
+        }
+    }
+    path_index.tombstones = 0;
+    for (int i = 0; i < index_blocks; i++) {
+        path_index.dirty.insert(i);
+    }
+}
+
+// Indexes every entry but ".." of a directory the caller wrote itself.
+// The index is written by the next commit.
+template <int BlockSize>
+void
+BasicFS<BlockSize>::index_dir(const std::vector<int> &blocks, const std::vector<dir_entry> &entries)
+{
+    std::lock_guard<std::mutex> guard(path_index.lock);
+    if (!path_index.enabled || blocks.empty()) {
+        return;
+    }
+    for (size_t s = 1; s < entries.size(); s++) {
+        if (entries[s].first_blk != FAT_FREE) {
+            index_insert(blocks[0], entries[s], blocks[s / dir_size], s % dir_size);
+        }
+    }
+}
+
+// Brings the index in line with the entries commit found changed and
+// writes it. An entry that was moved is removed and inserted again; a
+// directory that left the tree takes the entries below it along.
+template <int BlockSize>
+void
+BasicFS<BlockSize>::update_path_index(const std::vector<std::pair<int, dir_entry>> &removed,
+                                      const std::vector<std::pair<dir_struct*, int>> &inserted)
+{
+    std::lock_guard<std::mutex> guard(path_index.lock);
+    if (!path_index.enabled) {
+        return;
+    }
+    std::unordered_set<int> inserted_dirs;
+    for (size_t i = 0; i < inserted.size(); i++) {
+        const dir_entry &entry = inserted[i].first->entries[inserted[i].second];
+        if (entry.type == TYPE_DIR) {
+            inserted_dirs.insert(entry.first_blk);
+        }
+    }
+    std::vector<int> gone;
+    for (size_t i = 0; i < removed.size(); i++) {
+        index_remove(removed[i].first, removed[i].second);
+        if (removed[i].second.type == TYPE_DIR && inserted_dirs.count(removed[i].second.first_blk) == 0) {
+            gone.push_back(removed[i].second.first_blk);
+        }
+    }
+    if (!gone.empty()) {
+        index_remove_below(gone);
+    }
+    for (size_t i = 0; i < inserted.size(); i++) {
+        dir_struct *dir = inserted[i].first;
+        int slot = inserted[i].second;
+        index_insert(dir->blk, dir->entries[slot], dir->blocks[slot / dir_size], slot % dir_size);
+    }
+    if (path_index.tombstones > index_buckets / 4) {
+        index_rehash();
+    }
+    write_path_index();
+}
+
+// Compares the index with the tree scanned from the root. A repair builds
+// it again from the scan.
+template <int BlockSize>
+void
+BasicFS<BlockSize>::check_path_index(const std::deque<tree_node> &nodes, fsck_report *report)
+{
+    if (!path_index.enabled) {
+        return;
+    }
+    std::vector<record_key_t> expected, actual;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const tree_node &node = nodes[i];
+        if (node.blocks.empty()) {
+            continue;
+        }
+        for (size_t s = 1; s < node.entries.size(); s++) {
+            const dir_entry &entry = node.entries[s];
+            if (entry.first_blk != FAT_FREE && entry.type == TYPE_DIR) {
+                expected.push_back(std::make_tuple(node.blocks[0], entry_name(entry), entry.first_blk,
+                                                   node.blocks[s / dir_size], s % dir_size + 1, entry.access_rights));
+            }
+        }
+    }
+    {
+        std::lock_guard<std::mutex> guard(path_index.lock);
+        for (int b = 0; b < index_buckets; b++) {
+            if (bucket_used(path_index.records[b])) {
+                actual.push_back(record_key(path_index.records[b]));
+            }
+        }
+    }
+    std::sort(expected.begin(), expected.end());
+    std::sort(actual.begin(), actual.end());
+    std::vector<record_key_t> differ;
+    std::set_symmetric_difference(expected.begin(), expected.end(), actual.begin(), actual.end(),
+                                  std::back_inserter(differ));
+    if (differ.empty()) {
+        return;
+    }
+    if (report->repair) {
+        build_path_index(nodes);
+    }
+    fsck_problem(report, "The path index differs from the tree in " + std::to_string(differ.size()) + " entries",
+                 report->repair);
+}
+
+// Looks dirpath up in the index, reading no directory but the one it
+// names. answered is left false where the index cannot tell, for paths
+// through "..", and resolve_dir walks the path instead.
+template <int BlockSize>
+dir_struct*
+BasicFS<BlockSize>::resolve_indexed(std::string dirpath, bool *answered)
+{
+    int blk = dirpath.rfind('/', 0) == 0 ? root_blk : session()->cwd_blk;
+    std::vector<std::string> names;
+    size_t start = 0;
+    while (start <= dirpath.size()) {
+        size_t end = dirpath.find('/', start);
+        if (end == std::string::npos) {
+            end = dirpath.size();
+        }
+        std::string name = dirpath.substr(start, end - start);
+        if (name == "..") {
+            return nullptr;
+        }
+        if (!name.empty()) {
+            names.push_back(name);
+        }
+        start = end + 1;
+    }
+    if (names.empty()) {
+        return nullptr;
+    }
+
+    path_index_record rec;
+    {
+        std::lock_guard<std::mutex> guard(path_index.lock);
+        for (size_t i = 0; i < names.size(); i++) {
+            int b = index_find(blk, names[i].c_str());
+            if (b == -1) {
+                *answered = true;
+                return nullptr;
+            }
+            rec = path_index.records[b];
+            blk = rec.first_blk;
+        }
+    }
+    // The record holds everything of the entry a directory keeps as info
+    dir_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    memcpy(entry.file_name, rec.name, 56);
+    entry.first_blk = blk;
+    entry.type = TYPE_DIR;
+    entry.access_rights = rec.access_rights;
+    *answered = true;
+    return get_dir(blk, &entry);
+}
+
+// pathindex [on|off] shows whether the path index is kept, builds it from
+// the tree and keeps it from now on, or drops it
+template <int BlockSize>
+int
+BasicFS<BlockSize>::pathindex(std::string mode)
+{
+    {
+        tx_handle tx(&journal);
+        op_locks locks(&ns_lock, true);
+        if (mode.empty()) {
+            if (path_index.enabled) {
+                out() << "The path index is on, " << path_index.used << " entries in " << index_blocks
+                      << " blocks" << std::endl;
+            } else {
+                out() << "The path index is off" << std::endl;
+            }
+            return 0;
+        }
+        if (check_writable() == -1) {
+            return -1;
+        }
+        if (super.index_start != index_start || super.index_blocks != index_blocks) {
+            out() << "The disk has no room for a path index, format it to make one" << std::endl;
+            return -1;
+        }
+        if (mode == "off") {
+            path_index.enabled = false;
+            super.index_enabled = 0;
+            return write_superblock();
+        }
+        std::deque<tree_node> nodes;
+        if (scan_tree(get_dir(ROOT_BLOCK)->info, "/", &nodes, false) == -1) {
+            out() << "The file system has errors, run fsck" << std::endl;
+            return -1;
+        }
+        if (build_path_index(nodes) == -1) {
+            return -1;
+        }
+    }
+    // The superblock may point at the index once it is on disk
+    if (journal_sync() == -1) {
+        return -1;
+    }
+    op_locks locks(&ns_lock, true);
+    super.index_enabled = 1;
+    return write_superblock();
+}
+
+INSTANTIATE_BLOCK_SIZES(BasicFS)
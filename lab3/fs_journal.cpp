@@ -0,0 +1,460 @@
+#include <iostream>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include "fs.h"
+
+// FNV-1a, enough to tell a complete transaction from a torn one
+static uint32_t
+journal_checksum(uint32_t h, const uint8_t *data, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ data[i]) * 16777619u;
+    }
+    return h;
+}
+
+tx_handle::tx_handle(journal_state *journal, int blocks) : journal(journal), blocks(blocks)
+{
+    std::unique_lock<std::mutex> lock(journal->lock);
+    while (!journal->failed && (journal->flushing || journal->pending.size() >= JOURNAL_FLUSH_BLOCKS ||
+           (journal->enabled && journal->counted + journal->reserved + blocks > journal->capacity))) {
+        if (!journal->flushing) {
+            journal->kick = true;
+            journal->changed.notify_all();
+        }
+        journal->changed.wait(lock);
+    }
+    journal->active++;
+    journal->reserved += blocks;
+}
+
+tx_handle::~tx_handle()
+{
+    std::lock_guard<std::mutex> guard(journal->lock);
+    journal->active--;
+    journal->reserved -= blocks;
+    journal->dirty = true;
+    journal->changed.notify_all();
+}
+
+// Reads the superblock and replays the journal if the image has one. Runs
+// in the constructor, before the allocation groups are built from the FAT.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::journal_mount()
+{
+    journal.enabled = false;
+    journal.seq = 1;
+    journal.active = 0;
+    journal.capacity = JOURNAL_TX_BLOCKS - 1 - crc_blocks - index_blocks;
+    journal.counted = 0;
+    journal.reserved = 0;
+    journal.flushing = false;
+    journal.dirty = false;
+    journal.kick = false;
+    journal.stopping = false;
+    journal.failed = false;
+    journal.snapshots = 0;
+    journal.completed = 0;
+    memset(&super, 0, sizeof(super));
+
+    uint8_t buf[BlockSize];
+    if (disk.read(SUPER_BLOCK, buf) == -1) {
+        return -1;
+    }
+    superblock sb;
+    memcpy(&sb, buf, sizeof(sb));
+    if (sb.magic != SUPER_MAGIC || fat[SUPER_BLOCK] != FAT_EOF ||
+        sb.journal_start != JOURNAL_START || sb.journal_blocks != JOURNAL_BLOCKS) {
+        return 0;
+    }
+    super = sb;
+    journal.enabled = true;
+    if (journal_replay() == -1) {
+        return -1;
+    }
+    if (super.crc_start == CRC_START && super.crc_blocks == crc_blocks && load_checksums() == -1) {
+        return -1;
+    }
+    journal_start();
+    return 0;
+}
+
+// Writes the transaction left in the journal to its home blocks if its
+// commit block made it to disk, then empties the journal
+template <int BlockSize>
+int
+BasicFS<BlockSize>::journal_replay()
+{
+    uint8_t buf[BlockSize];
+    if (disk.read(JOURNAL_START, buf) == -1) {
+        return -1;
+    }
+    journal_header header;
+    memcpy(&header, buf, sizeof(header));
+    if (header.magic != JOURNAL_MAGIC) {
+        return 0;
+    }
+    journal.seq = header.seq + 1;
+    if (header.count == 0 || header.count > JOURNAL_TX_BLOCKS) {
+        return 0;
+    }
+
+    std::vector<uint8_t> images(header.count * BlockSize);
+    uint32_t checksum = journal_checksum(2166136261u, buf, BlockSize);
+    for (uint32_t i = 0; i < header.count; i++) {
+        if (disk.read(JOURNAL_START + 1 + i, &images[i * BlockSize]) == -1) {
+            return -1;
+        }
+        checksum = journal_checksum(checksum, &images[i * BlockSize], BlockSize);
+    }
+    if (disk.read(JOURNAL_START + 1 + header.count, buf) == -1) {
+        return -1;
+    }
+    journal_commit commit;
+    memcpy(&commit, buf, sizeof(commit));
+    if (commit.magic == JOURNAL_MAGIC && commit.seq == header.seq && commit.checksum == checksum) {
+        for (uint32_t i = 0; i < header.count; i++) {
+            if (disk.write(header.blocks[i], &images[i * BlockSize]) == -1) {
+                return -1;
+            }
+            if (header.blocks[i] == FAT_BLOCK) {
+                memcpy(fat, &images[i * BlockSize], BlockSize);
+            }
+        }
+        std::cout << "FS::FS()... Replayed journal transaction " << header.seq
+                  << " (" << header.count << " blocks)\n";
+    }
+
+    if (disk.sync() == -1) {
+        return -1;
+    }
+    return clear_journal();
+}
+
+// Leaves an empty journal behind. The header keeps the sequence number, so
+// a stale commit block never matches a later transaction.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::clear_journal()
+{
+    uint8_t buf[BlockSize];
+    journal_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = JOURNAL_MAGIC;
+    header.seq = journal.seq;
+    memset(buf, 0, BlockSize);
+    memcpy(buf, &header, sizeof(header));
+    if (disk.write(JOURNAL_START, buf) == -1 || disk.sync() == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+// Turns an image formatted without a journal into one with a journal. The
+// caller has reserved the superblock and the journal region in the FAT.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::init_journal()
+{
+    memset(&super, 0, sizeof(super));
+    super.magic = SUPER_MAGIC;
+    super.journal_start = JOURNAL_START;
+    super.journal_blocks = JOURNAL_BLOCKS;
+    if (write_superblock() == -1 || clear_journal() == -1) {
+        return -1;
+    }
+    journal.enabled = true;
+    journal_start();
+    return 0;
+}
+
+// The superblock is not journaled. It is written once everything it
+// points at is on disk, and synced before the caller goes on.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::write_superblock()
+{
+    uint8_t buf[BlockSize];
+    memset(buf, 0, BlockSize);
+    memcpy(buf, &super, sizeof(super));
+    if (disk.sync() == -1 || disk.write(SUPER_BLOCK, buf) == -1 || disk.sync() == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+template <int BlockSize>
+void
+BasicFS<BlockSize>::journal_start()
+{
+    journal.flusher = std::thread([this]() { journal_loop(); });
+}
+
+// Flushes what is left and stops the flusher. Every block is home then, so
+// the next mount finds nothing to replay. After a failed transaction the
+// journal is left as it is, for the next mount to replay what it can.
+template <int BlockSize>
+void
+BasicFS<BlockSize>::journal_stop()
+{
+    if (!journal.flusher.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(journal.lock);
+        journal.stopping = true;
+        journal.changed.notify_all();
+    }
+    journal.flusher.join();
+    if (!journal.failed) {
+        clear_journal();
+    }
+}
+
+// Returns once every command that finished before the call is on disk, -1
+// if the transaction holding them failed
+template <int BlockSize>
+int
+BasicFS<BlockSize>::journal_sync()
+{
+    if (!journal.enabled) {
+        if (disk.write(FAT_BLOCK, (uint8_t*)fat) == -1) {
+            return -1;
+        }
+        return disk.sync();
+    }
+    std::unique_lock<std::mutex> lock(journal.lock);
+    unsigned long target = journal.snapshots + 1;
+    journal.dirty = true;
+    journal.kick = true;
+    journal.changed.notify_all();
+    journal.changed.wait(lock, [&]() { return journal.completed >= target || journal.failed; });
+    return journal.completed >= target ? 0 : -1;
+}
+
+// The flusher. A transaction opens with the first command after a flush
+// and stays open for JOURNAL_INTERVAL_MS, so every command in that window
+// shares its two disk syncs.
+template <int BlockSize>
+void
+BasicFS<BlockSize>::journal_loop()
+{
+    std::unique_lock<std::mutex> lock(journal.lock);
+    while (true) {
+        journal.changed.wait(lock, [&]() { return journal.dirty || journal.stopping; });
+        journal.changed.wait_for(lock, std::chrono::milliseconds(JOURNAL_INTERVAL_MS),
+                                 [&]() { return journal.kick || journal.stopping; });
+        if (journal.dirty) {
+            journal_flush(lock);
+        }
+        if (journal.stopping && !journal.dirty) {
+            break;
+        }
+    }
+}
+
+// Takes a snapshot of the FAT and the running transaction once no command
+// is inside one, then writes it while the next transaction fills up.
+// Called with journal.lock held.
+template <int BlockSize>
+void
+BasicFS<BlockSize>::journal_flush(std::unique_lock<std::mutex> &lock)
+{
+    if (journal.failed) {
+        journal.dirty = false;
+        journal.kick = false;
+        return;
+    }
+    journal.flushing = true;
+    journal.changed.wait(lock, [&]() { return journal.active == 0; });
+    std::vector<uint8_t> fat_image(BlockSize);
+    memcpy(fat_image.data(), fat, BlockSize);
+    // The checksum table as it stands with every command of the
+    // transaction, of which only the metadata is left to be written
+    bool checksums = disk.checksums_enabled();
+    std::vector<uint32_t> crc_table(checksums ? fat_entries : 0);
+    if (checksums) {
+        disk.get_checksums(crc_table.data());
+    }
+    journal.committing.swap(journal.pending);
+    journal.counted = 0;
+    std::vector<int> freed;
+    freed.swap(journal.deferred_frees);
+    unsigned long snapshot = ++journal.snapshots;
+    journal.flushing = false;
+    journal.dirty = false;
+    journal.kick = false;
+    journal.changed.notify_all();
+    lock.unlock();
+
+    std::vector<int> blks(1, FAT_BLOCK);
+    std::vector<const uint8_t*> images(1, fat_image.data());
+    for (auto it = journal.committing.begin(); it != journal.committing.end(); ++it) {
+        blks.push_back(it->first);
+        images.push_back(it->second.data());
+    }
+    if (checksums) {
+        for (size_t i = 0; i < blks.size(); i++) {
+            crc_table[blks[i]] = BasicDisk<BlockSize>::block_checksum(images[i]);
+        }
+        for (int i = 0; i < crc_blocks; i++) {
+            blks.insert(blks.begin() + 1 + i, CRC_START + i);
+            images.insert(images.begin() + 1 + i, (const uint8_t*)crc_table.data() + i * BlockSize);
+        }
+    }
+    // tx_handle and write_dir_blocks keep the directory blocks within
+    // journal.capacity, so everything goes in one transaction
+    if (write_transaction(blks, images) == -1) {
+        std::cerr << "FS::journal_flush: Error writing the journal, no more changes are written" << std::endl;
+        // The metadata on disk may still point at the freed blocks, so
+        // they are not handed out again. committing is kept for reads.
+        lock.lock();
+        journal.failed = true;
+        journal.deferred_frees.insert(journal.deferred_frees.end(), freed.begin(), freed.end());
+        journal.changed.notify_all();
+        return;
+    }
+    for (size_t i = 0; i < freed.size(); i++) {
+        reuse_block(freed[i]);
+    }
+
+    lock.lock();
+    journal.committing.clear();
+    journal.completed = snapshot;
+    journal.changed.notify_all();
+}
+
+// Writes one transaction to the journal and, once it is on disk, to the
+// home blocks. The home blocks are synced too before the journal is
+// reused for the next transaction.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::write_transaction(const std::vector<int> &blks, const std::vector<const uint8_t*> &images)
+{
+    if (blks.size() > JOURNAL_TX_BLOCKS) {
+        std::cerr << "FS::write_transaction: " << blks.size() << " blocks do not fit in one transaction" << std::endl;
+        return -1;
+    }
+    uint8_t buf[BlockSize];
+    journal_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = JOURNAL_MAGIC;
+    header.seq = journal.seq++;
+    header.count = blks.size();
+    for (size_t i = 0; i < blks.size(); i++) {
+        header.blocks[i] = blks[i];
+    }
+    memset(buf, 0, BlockSize);
+    memcpy(buf, &header, sizeof(header));
+    uint32_t checksum = journal_checksum(2166136261u, buf, BlockSize);
+    if (disk.write(JOURNAL_START, buf) == -1) {
+        return -1;
+    }
+    for (size_t i = 0; i < blks.size(); i++) {
+        checksum = journal_checksum(checksum, images[i], BlockSize);
+        if (disk.write(JOURNAL_START + 1 + i, (uint8_t*)images[i]) == -1) {
+            return -1;
+        }
+    }
+    journal_commit commit;
+    commit.magic = JOURNAL_MAGIC;
+    commit.seq = header.seq;
+    commit.checksum = checksum;
+    memset(buf, 0, BlockSize);
+    memcpy(buf, &commit, sizeof(commit));
+    // Data blocks were written before their commands ended, so this sync
+    // also puts them on disk ahead of the metadata pointing at them
+    if (disk.write(JOURNAL_START + 1 + blks.size(), buf) == -1 || disk.sync() == -1) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < blks.size(); i++) {
+        if (disk.write(blks[i], (uint8_t*)images[i]) == -1) {
+            return -1;
+        }
+    }
+    return disk.sync();
+}
+
+// Writes a directory block, through the running transaction when there is
+// a journal
+template <int BlockSize>
+int
+BasicFS<BlockSize>::write_meta(int blk, const uint8_t *data)
+{
+    if (!journal.enabled) {
+        return disk.write(blk, (uint8_t*)data);
+    }
+    std::lock_guard<std::mutex> guard(journal.lock);
+    bool index_block = path_index.enabled && blk >= index_start && blk < index_start + index_blocks;
+    if (journal.pending.count(blk) == 0 && !index_block) {
+        journal.counted++;
+    }
+    journal.pending[blk].assign(data, data + BlockSize);
+    return 0;
+}
+
+// Puts the directory blocks a command changed into the running
+// transaction together, or none of them if they do not fit in it, so a
+// transaction never holds half a command
+template <int BlockSize>
+int
+BasicFS<BlockSize>::write_dir_blocks(const std::vector<int> &blks, const std::vector<const uint8_t*> &images)
+{
+    if (!journal.enabled) {
+        for (size_t i = 0; i < blks.size(); i++) {
+            if (disk.write(blks[i], (uint8_t*)images[i]) == -1) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    std::lock_guard<std::mutex> guard(journal.lock);
+    int added = 0;
+    for (size_t i = 0; i < blks.size(); i++) {
+        if (journal.pending.count(blks[i]) == 0) {
+            added++;
+        }
+    }
+    if (journal.counted + added > journal.capacity) {
+        std::cerr << "FS::write_dir_blocks: " << added << " blocks do not fit in the running transaction" << std::endl;
+        return -1;
+    }
+    for (size_t i = 0; i < blks.size(); i++) {
+        journal.pending[blks[i]].assign(images[i], images[i] + BlockSize);
+    }
+    journal.counted += added;
+    return 0;
+}
+
+// Reads a directory block, which may not have reached its home block yet.
+// Only a block read from disk is checked against its checksum.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::read_meta(int blk, uint8_t *data, bool verify)
+{
+    if (journal.enabled) {
+        std::lock_guard<std::mutex> guard(journal.lock);
+        std::map<int, std::vector<uint8_t>> *maps[2] = {&journal.pending, &journal.committing};
+        for (int m = 0; m < 2; m++) {
+            auto it = maps[m]->find(blk);
+            if (it != maps[m]->end()) {
+                memcpy(data, it->second.data(), BlockSize);
+                return 0;
+            }
+        }
+    }
+    return disk.read(blk, data, verify);
+}
+
+template <int BlockSize>
+void
+BasicFS<BlockSize>::defer_free(int blk)
+{
+    std::lock_guard<std::mutex> guard(journal.lock);
+    journal.deferred_frees.push_back(blk);
+}
+
+INSTANTIATE_BLOCK_SIZES(BasicFS)
@@ -0,0 +1,341 @@
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <ctime>
+#include <unordered_map>
+#include "fs.h"
+
+// Prints why and returns -1 while a snapshot is mounted or after the
+// journal failed
+template <int BlockSize>
+int
+BasicFS<BlockSize>::check_writable()
+{
+    bool failed;
+    {
+        std::lock_guard<std::mutex> guard(journal.lock);
+        failed = journal.failed;
+    }
+    if (failed) {
+        out() << "The journal could not be written, the file system is read-only until it is mounted again" << std::endl;
+        return -1;
+    }
+    if (mounted_snapshot == -1) {
+        return 0;
+    }
+    out() << "Snapshot " << super.snapshots[mounted_snapshot].name << " is mounted read-only" << std::endl;
+    return -1;
+}
+
+template <int BlockSize>
+int
+BasicFS<BlockSize>::find_snapshot(const std::string &name)
+{
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        const snapshot_record &rec = super.snapshots[i];
+        if (rec.fat_blk != 0 && name == std::string(rec.name, strnlen(rec.name, sizeof(rec.name)))) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+template <int BlockSize>
+int
+BasicFS<BlockSize>::read_snapshot_fat(int index, int16_t *snap)
+{
+    if (disk.read(super.snapshots[index].fat_blk, (uint8_t*)snap) == -1) {
+        std::cerr << "FS::read_snapshot_fat: Error reading the FAT of snapshot " << super.snapshots[index].name << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+// Counts the snapshots holding each block. Runs in the constructor, before
+// the allocation groups are built.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::load_snapshots()
+{
+    snap_refs.assign(fat_entries, 0);
+    int16_t snap[fat_entries];
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        if (super.snapshots[i].fat_blk == 0) {
+            continue;
+        }
+        if (read_snapshot_fat(i, snap) == -1) {
+            return -1;
+        }
+        for (int b = 0; b < fat_entries; b++) {
+            if (snap[b] != FAT_FREE) {
+                snap_refs[b]++;
+            }
+        }
+    }
+    return 0;
+}
+
+// snapshot create <name> freezes the file system as it is now. Every
+// directory is copied into blocks the snapshot owns, with the FAT as it
+// is; file blocks are shared, so the cost is the size of the directories.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::snapshot_create(std::string name)
+{
+    trace_scope trace(this, TRACE_SNAPSHOT_CREATE, name);
+    tx_handle tx(&journal);
+    op_locks locks(&ns_lock, true);
+    if (check_writable() == -1) {
+        return -1;
+    }
+    if (!journal.enabled) {
+        out() << "Snapshots need a superblock, format the disk first" << std::endl;
+        return -1;
+    }
+    if (name.empty() || name.size() >= sizeof(super.snapshots[0].name)) {
+        out() << "Invalid snapshot name" << std::endl;
+        return -1;
+    }
+    if (find_snapshot(name) != -1) {
+        out() << "Snapshot " << name << " already exists" << std::endl;
+        return -1;
+    }
+    int index;
+    for (index = 0; index < MAX_SNAPSHOTS && super.snapshots[index].fat_blk != 0; index++) {
+        ;
+    }
+    if (index == MAX_SNAPSHOTS) {
+        out() << "No room for more than " << MAX_SNAPSHOTS << " snapshots" << std::endl;
+        return -1;
+    }
+
+    int16_t snap[fat_entries];
+    memcpy(snap, fat, BlockSize);
+    std::deque<tree_node> nodes;
+    if (scan_tree(get_dir(ROOT_BLOCK)->info, "/", &nodes, false) == -1) {
+        out() << "The file system has errors, run fsck" << std::endl;
+        return -1;
+    }
+
+    // One new block for each directory block, and one for the FAT
+    size_t dir_blocks = 0;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        dir_blocks += nodes[i].blocks.size();
+    }
+    std::vector<int> fresh;
+    int cursor = -1;
+    if (allocate_chain(dir_blocks + 1, &fresh, &cursor) == -1) {
+        out() << "Not enough free blocks for the snapshot" << std::endl;
+        return -1;
+    }
+    std::unordered_map<int, int> moved; // first block of each directory, old to new
+    size_t next = 0;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        tree_node *node = &nodes[i];
+        moved[node->blocks[0]] = fresh[next];
+        for (size_t b = 0; b < node->blocks.size(); b++) {
+            snap[node->blocks[b]] = FAT_FREE;
+            snap[fresh[next + b]] = b + 1 < node->blocks.size() ? fresh[next + b + 1] : FAT_EOF;
+        }
+        next += node->blocks.size();
+    }
+    int fat_blk = fresh[next];
+    snap[fat_blk] = FAT_EOF;
+
+    // The copies point at each other instead of at the live directories
+    next = 0;
+    int failed = 0;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        tree_node *node = &nodes[i];
+        for (size_t s = 0; s < node->entries.size(); s++) {
+            dir_entry *entry = &node->entries[s];
+            bool linked = s == PARENT_DIR_ENTRY_INDEX || (entry->type == TYPE_DIR && entry->first_blk != FAT_FREE);
+            if (linked && moved.count(entry->first_blk) != 0) {
+                entry->first_blk = moved[entry->first_blk];
+            }
+        }
+        for (size_t b = 0; b < node->blocks.size(); b++) {
+            failed |= disk.write(fresh[next + b], (uint8_t*)&node->entries[b * dir_size]);
+        }
+        next += node->blocks.size();
+    }
+    failed |= disk.write(fat_blk, (uint8_t*)snap);
+
+    snapshot_record *rec = &super.snapshots[index];
+    memset(rec, 0, sizeof(*rec));
+    strncpy(rec->name, name.c_str(), sizeof(rec->name) - 1);
+    rec->created = time(nullptr);
+    rec->fat_blk = fat_blk;
+    rec->root_blk = moved[ROOT_BLOCK];
+    if (failed != 0 || write_superblock() == -1) {
+        memset(rec, 0, sizeof(*rec));
+        for (size_t i = 0; i < fresh.size(); i++) {
+            release_block(fresh[i]);
+        }
+        std::cerr << "FS::snapshot_create: Error writing snapshot " << name << " to disk" << std::endl;
+        return -1;
+    }
+
+    // The new blocks belong to the snapshot now, not to the live FAT
+    for (int b = 0; b < fat_entries; b++) {
+        if (snap[b] != FAT_FREE) {
+            std::lock_guard<std::mutex> guard(groups[b / group_blocks].lock);
+            snap_refs[b]++;
+        }
+    }
+    for (size_t i = 0; i < fresh.size(); i++) {
+        release_block(fresh[i]);
+    }
+    out() << "Created snapshot " << name << " (" << fresh.size() << " blocks)" << std::endl;
+    return 0;
+}
+
+// snapshot list prints every snapshot with the blocks only it holds, which
+// snapshot delete would free
+template <int BlockSize>
+int
+BasicFS<BlockSize>::snapshot_list()
+{
+    trace_scope trace(this, TRACE_SNAPSHOT_LIST);
+    op_locks locks(&ns_lock, true);
+    out() << std::left << std::setw(24) << "name" << "\tcreated            \tblocks\tunique" << std::endl;
+    int16_t snap[fat_entries];
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        const snapshot_record &rec = super.snapshots[i];
+        if (rec.fat_blk == 0) {
+            continue;
+        }
+        if (read_snapshot_fat(i, snap) == -1) {
+            return -1;
+        }
+        int blocks = 0, unique = 0;
+        for (int b = reserved_blocks(); b < fat_entries; b++) {
+            if (snap[b] == FAT_FREE) {
+                continue;
+            }
+            blocks++;
+            std::lock_guard<std::mutex> guard(groups[b / group_blocks].lock);
+            if (fat[b] == FAT_FREE && snap_refs[b] == 1) {
+                unique++;
+            }
+        }
+        char created[32];
+        time_t t = rec.created;
+        strftime(created, sizeof(created), "%Y-%m-%d %H:%M:%S", localtime(&t));
+        out() << std::setw(24) << std::string(rec.name, strnlen(rec.name, sizeof(rec.name)))
+              << "\t" << created << "\t" << blocks << "\t" << unique
+              << (i == mounted_snapshot ? "\t(mounted)" : "") << std::endl;
+    }
+    return 0;
+}
+
+// snapshot delete <name> removes a snapshot. Blocks no one else holds go
+// back to the allocator once the running transaction is committed.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::snapshot_delete(std::string name)
+{
+    trace_scope trace(this, TRACE_SNAPSHOT_DELETE, name);
+    tx_handle tx(&journal);
+    op_locks locks(&ns_lock, true);
+    if (check_writable() == -1) {
+        return -1;
+    }
+    int index = find_snapshot(name);
+    if (index == -1) {
+        out() << "Snapshot " << name << " not found" << std::endl;
+        return -1;
+    }
+    int16_t snap[fat_entries];
+    if (read_snapshot_fat(index, snap) == -1) {
+        return -1;
+    }
+    snapshot_record rec = super.snapshots[index];
+    memset(&super.snapshots[index], 0, sizeof(rec));
+    if (write_superblock() == -1) {
+        super.snapshots[index] = rec;
+        return -1;
+    }
+
+    int freed = 0;
+    for (int b = 0; b < fat_entries; b++) {
+        if (snap[b] == FAT_FREE) {
+            continue;
+        }
+        bool unused;
+        {
+            std::lock_guard<std::mutex> guard(groups[b / group_blocks].lock);
+            snap_refs[b]--;
+            unused = snap_refs[b] == 0 && fat[b] == FAT_FREE;
+        }
+        if (unused) {
+            defer_free(b);
+            freed++;
+        }
+    }
+    out() << "Deleted snapshot " << name << ", " << freed << " blocks freed" << std::endl;
+    return 0;
+}
+
+// Clears the directory cache and sends every session to the root, after
+// the tree being viewed changed
+template <int BlockSize>
+void
+BasicFS<BlockSize>::reset_view()
+{
+    {
+        std::lock_guard<std::mutex> guard(cache_lock);
+        dir_cache.clear();
+    }
+    std::lock_guard<std::mutex> guard(sessions_lock);
+    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+        it->cwd_blk = root_blk;
+        it->cwd_path.clear();
+        it->cwd_path_blks.clear();
+    }
+}
+
+// snapshot mount <name> shows the snapshot instead of the live file system
+// until snapshot umount. Commands that change anything are refused.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::snapshot_mount(std::string name)
+{
+    trace_scope trace(this, TRACE_SNAPSHOT_MOUNT, name);
+    op_locks locks(&ns_lock, true);
+    if (check_writable() == -1) {
+        return -1;
+    }
+    int index = find_snapshot(name);
+    if (index == -1) {
+        out() << "Snapshot " << name << " not found" << std::endl;
+        return -1;
+    }
+    if (read_snapshot_fat(index, snap_fat) == -1) {
+        return -1;
+    }
+    view_fat = snap_fat;
+    mounted_snapshot = index;
+    root_blk = super.snapshots[index].root_blk;
+    reset_view();
+    return 0;
+}
+
+template <int BlockSize>
+int
+BasicFS<BlockSize>::snapshot_umount()
+{
+    trace_scope trace(this, TRACE_SNAPSHOT_UMOUNT);
+    op_locks locks(&ns_lock, true);
+    if (mounted_snapshot == -1) {
+        out() << "No snapshot is mounted" << std::endl;
+        return -1;
+    }
+    view_fat = fat;
+    mounted_snapshot = -1;
+    root_blk = ROOT_BLOCK;
+    reset_view();
+    return 0;
+}
+
+INSTANTIATE_BLOCK_SIZES(BasicFS)
@@ -0,0 +1,161 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+#include "fs.h"
+
+// Takes the file and directory counts from the superblock after a clean
+// unmount, or counts the tree. The copy on disk is marked stale while the
+// file system runs, so a crash makes the next mount count again.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::load_counters()
+{
+    file_count = 0;
+    dir_count = 0;
+    if (journal.enabled && super.counters_valid != 0) {
+        file_count = super.file_count;
+        dir_count = super.dir_count;
+        super.counters_valid = 0;
+        return write_superblock();
+    }
+    if (fat[ROOT_BLOCK] == FAT_FREE) {
+        return 0; // not formatted
+    }
+    std::deque<tree_node> nodes;
+    if (scan_tree(get_dir(ROOT_BLOCK)->info, "/", &nodes, false) == -1) {
+        std::cout << "FS::FS()... The directory tree has errors, run fsck\n";
+    }
+    int files, dirs;
+    count_tree(nodes, &files, &dirs);
+    file_count = files;
+    dir_count = dirs;
+    return 0;
+}
+
+// Stores the counts in the superblock at unmount, once everything else
+// is on disk
+template <int BlockSize>
+int
+BasicFS<BlockSize>::save_counters()
+{
+    if (!journal.enabled) {
+        return 0;
+    }
+    super.counters_valid = 1;
+    super.file_count = file_count;
+    super.dir_count = dir_count;
+    return write_superblock();
+}
+
+// Counts the entries commit found removed and inserted. A moved entry is
+// both and does not change the counts.
+template <int BlockSize>
+void
+BasicFS<BlockSize>::update_counters(const std::vector<std::pair<int, dir_entry>> &removed,
+                                    const std::vector<std::pair<dir_struct*, int>> &inserted)
+{
+    for (size_t i = 0; i < removed.size(); i++) {
+        if (removed[i].second.type == TYPE_DIR) {
+            dir_count--;
+        } else {
+            file_count--;
+        }
+    }
+    for (size_t i = 0; i < inserted.size(); i++) {
+        if (inserted[i].first->entries[inserted[i].second].type == TYPE_DIR) {
+            dir_count++;
+        } else {
+            file_count++;
+        }
+    }
+}
+
+// Counts the files and directories the scanned nodes hold, which is
+// everything below the top of the scan
+template <int BlockSize>
+void
+BasicFS<BlockSize>::count_tree(const std::deque<tree_node> &nodes, int *files, int *dirs)
+{
+    *files = 0;
+    *dirs = 0;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        for (size_t s = 1; s < nodes[i].entries.size(); s++) {
+            const dir_entry &entry = nodes[i].entries[s];
+            if (entry.first_blk == FAT_FREE) {
+                continue;
+            }
+            if (entry.type == TYPE_DIR) {
+                (*dirs)++;
+            } else {
+                (*files)++;
+            }
+        }
+    }
+}
+
+// Compares the counts with the tree scanned from the root
+template <int BlockSize>
+void
+BasicFS<BlockSize>::check_counters(const std::deque<tree_node> &nodes, fsck_report *report)
+{
+    int files, dirs;
+    count_tree(nodes, &files, &dirs);
+    if (files == file_count && dirs == dir_count) {
+        return;
+    }
+    std::ostringstream msg;
+    msg << "File and directory counts " << file_count << " and " << dir_count << " should be "
+        << files << " and " << dirs;
+    if (report->repair) {
+        file_count = files;
+        dir_count = dirs;
+    }
+    fsck_problem(report, msg.str(), report->repair);
+}
+
+// Fills st from the allocation groups and the counters, so it costs the
+// same whatever the size of the file system
+template <int BlockSize>
+int
+BasicFS<BlockSize>::statfs(fs_stat *st)
+{
+    st->block_size = BlockSize;
+    st->blocks = fat_entries;
+    st->free_blocks = 0;
+    st->largest_free = 0;
+    int run = 0; // free blocks at the end of the groups so far
+    for (int g = 0; g < ALLOC_GROUPS; g++) {
+        std::lock_guard<std::mutex> guard(groups[g].lock);
+        st->free_blocks += groups[g].free_count;
+        if (groups[g].head_free == group_blocks) {
+            run += group_blocks;
+            continue;
+        }
+        st->largest_free = std::max({st->largest_free, run + groups[g].head_free, groups[g].longest_free});
+        run = groups[g].tail_free;
+    }
+    st->largest_free = std::max(st->largest_free, run);
+    st->used_blocks = st->blocks - st->free_blocks;
+    st->files = file_count;
+    st->dirs = dir_count;
+    return 0;
+}
+
+// df prints the block and file counts of the file system
+template <int BlockSize>
+int
+BasicFS<BlockSize>::df()
+{
+    trace_scope trace(this, TRACE_DF);
+    fs_stat st;
+    if (statfs(&st) == -1) {
+        return -1;
+    }
+    out() << std::left << std::setw(12) << "block size" << "\tblocks\tused\tfree\tlargest free\tfiles\tdirectories" << std::endl;
+    out() << std::setw(12) << st.block_size << "\t" << st.blocks << "\t" << st.used_blocks << "\t" << st.free_blocks
+          << "\t" << std::setw(12) << st.largest_free << "\t" << st.files << "\t" << st.dirs << std::endl;
+    return 0;
+}
+
+INSTANTIATE_BLOCK_SIZES(BasicFS)
@@ -0,0 +1,109 @@
+#include <iostream>
+#include <cstring>
+#include "fs.h"
+
+// How many recorded calls the calling thread is inside of
+static thread_local int trace_depth = 0;
+
+template <int BlockSize>
+BasicFS<BlockSize>::trace_scope::trace_scope(BasicFS *fs, uint8_t op, const std::string &path, const std::string &arg, uint32_t size)
+    : fs(fs), op(op), outer(trace_depth++ == 0 && fs->tracing()), size(size)
+{
+    if (outer) {
+        this->path = path;
+        this->arg = arg;
+        start = std::chrono::steady_clock::now();
+    }
+}
+
+template <int BlockSize>
+BasicFS<BlockSize>::trace_scope::~trace_scope()
+{
+    trace_depth--;
+    if (outer) {
+        fs->trace_call(op, path, arg, size, start);
+    }
+}
+
+// trace start <hostpath> records every call to the host file hostpath
+template <int BlockSize>
+int
+BasicFS<BlockSize>::trace_start(std::string hostpath)
+{
+    std::lock_guard<std::mutex> guard(trace.lock);
+    if (trace.enabled) {
+        out() << "A trace is already being recorded" << std::endl;
+        return -1;
+    }
+    trace.file.open(hostpath, std::ios::binary | std::ios::out | std::ios::trunc);
+    trace_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    trace.file.write((const char*)&header, sizeof(header));
+    if (!trace.file) {
+        out() << "Cannot create " << hostpath << std::endl;
+        trace.file.close();
+        trace.file.clear();
+        return -1;
+    }
+    trace.sessions.clear();
+    trace.records = 0;
+    trace.start = std::chrono::steady_clock::now();
+    trace.enabled = true;
+    return 0;
+}
+
+template <int BlockSize>
+int
+BasicFS<BlockSize>::trace_stop()
+{
+    std::lock_guard<std::mutex> guard(trace.lock);
+    if (!trace.enabled) {
+        out() << "No trace is being recorded" << std::endl;
+        return -1;
+    }
+    trace.enabled = false;
+    trace.file.close();
+    bool failed = !trace.file;
+    trace.file.clear();
+    if (failed) {
+        out() << "Error writing the trace" << std::endl;
+        return -1;
+    }
+    out() << "Recorded " << trace.records << " calls" << std::endl;
+    return 0;
+}
+
+// Appends one call to the trace. Sessions are numbered in the order they
+// first show up, the default session being 0.
+template <int BlockSize>
+void
+BasicFS<BlockSize>::trace_call(uint8_t op, const std::string &path, const std::string &arg, uint32_t size,
+               std::chrono::steady_clock::time_point start)
+{
+    auto end = std::chrono::steady_clock::now();
+    const fs_session *s = session();
+    std::lock_guard<std::mutex> guard(trace.lock);
+    if (!trace.enabled || start < trace.start) {
+        return;
+    }
+    trace_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.start_us = std::chrono::duration_cast<std::chrono::microseconds>(start - trace.start).count();
+    rec.duration_us = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    rec.size = size;
+    if (s != default_session) {
+        auto it = trace.sessions.insert(std::make_pair(s, trace.sessions.size() + 1)).first;
+        rec.session = it->second;
+    }
+    rec.path_len = std::min(path.size(), (size_t)UINT16_MAX);
+    rec.arg_len = std::min(arg.size(), (size_t)UINT16_MAX);
+    rec.op = op;
+    trace.file.write((const char*)&rec, sizeof(rec));
+    trace.file.write(path.data(), rec.path_len);
+    trace.file.write(arg.data(), rec.arg_len);
+    trace.records++;
+}
+
+INSTANTIATE_BLOCK_SIZES(BasicFS)
@@ -0,0 +1,579 @@
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <unordered_set>
+#include <fnmatch.h>
+#include "fs.h"
+#include "workpool.h"
+#include "memsearch.h"
+
+// Splits path into the last component and the directory holding it
+template <int BlockSize>
+int
+BasicFS<BlockSize>::split_path(std::string path, std::string *name, std::string *dirpath) {
+    while (path.size() > 1 && path[path.size() - 1] == '/') {
+        path.erase(path.size() - 1);
+    }
+    *name = path.substr(path.find_last_of("/") + 1);
+    *dirpath = path.substr(0, path.find_last_of("/") + 1);
+    if (name->empty() || *name == "..") {
+        return -1;
+    }
+    return 0;
+}
+
+// Reads the directory tree below top with a pool of workers, one task per
+// directory. Only reads the disk and the FAT, the directory cache is not
+// touched, so the caller must not change the tree while this runs. With
+// check_access false, directories are read whatever their access rights.
+// With shared true the caller holds ns_lock shared instead, and each
+// directory is copied from the cache under its read lock.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::scan_tree(const dir_entry &top, std::string path, std::deque<tree_node> *nodes, bool check_access, bool shared) {
+    WorkPool pool;
+    std::mutex nodes_mutex;
+    std::unordered_set<int> visited;
+    std::atomic<int> errors(0);
+
+    nodes->clear();
+    nodes->push_back(tree_node());
+    tree_node *root = &nodes->back();
+    root->path = path;
+    root->info = top;
+    root->parent = -1;
+    root->dir = nullptr;
+    visited.insert(top.first_blk);
+
+    std::function<void(tree_node*, int)> visit = [&](tree_node *node, int index) {
+        node->readable = !check_access || has_permission(node->info, READ);
+        if (!node->readable) {
+            return;
+        }
+        if (shared) {
+            node->dir = get_dir(node->info.first_blk, &node->info);
+            if (node->dir == nullptr) {
+                errors++;
+                return;
+            }
+            node->dir->lock.read();
+            node->blocks = node->dir->blocks;
+            node->entries = node->dir->entries;
+        } else if (read_dir_blocks(node->info.first_blk, &node->blocks, &node->entries) == -1) {
+            // What was read may be garbage, so the directory looks empty
+            node->entries.clear();
+            errors++;
+            return;
+        }
+        for (size_t i = 1; i < node->entries.size(); i++) {
+            const dir_entry &entry = node->entries[i];
+            if (entry.first_blk == FAT_FREE) {
+                continue;
+            }
+            if (entry.type == TYPE_FILE) {
+                if (get_chain(entry.first_blk, &node->file_blocks[i]) == -1) {
+                    errors++;
+                }
+                continue;
+            }
+            if (entry.first_blk >= fat_entries || get_fat(entry.first_blk) == FAT_FREE) {
+                std::cerr << "FS::scan_tree: Directory entry " << entry_name(entry) << " points to free block " << entry.first_blk << std::endl;
+                errors++;
+                continue;
+            }
+            std::string child_path = (node->path == "/" ? "" : node->path) + "/" + entry_name(entry);
+            tree_node *child;
+            int child_index;
+            {
+                std::unique_lock<std::mutex> lock(nodes_mutex);
+                if (!visited.insert(entry.first_blk).second) {
+                    std::cerr << "FS::scan_tree: Directory block " << entry.first_blk << " is linked twice" << std::endl;
+                    errors++;
+                    continue;
+                }
+                nodes->push_back(tree_node());
+                child = &nodes->back();
+                child_index = nodes->size() - 1;
+                child->path = child_path;
+                child->info = entry;
+                child->parent = index;
+                child->dir = nullptr;
+            }
+            pool.submit([&visit, child, child_index]() { visit(child, child_index); });
+        }
+        if (shared) {
+            node->dir->lock.unlock();
+        }
+    };
+    pool.submit([&visit, root]() { visit(root, 0); });
+    pool.wait();
+    return errors == 0 ? 0 : -1;
+}
+
+// rm -r <path> removes the file or the whole directory tree <path>
+template <int BlockSize>
+int
+BasicFS<BlockSize>::rm_recursive(std::string path)
+{
+    trace_scope trace(this, TRACE_RM_RECURSIVE, path);
+    op_context ctx;
+
+    std::string name, dirpath;
+    {
+        op_locks locks(&ns_lock, false);
+        get_filename_parts(path, &name, &dirpath);
+    }
+    if (!name.empty()) {
+        return rm(path);
+    }
+    tx_handle tx(&journal);
+    op_locks locks(&ns_lock, true);
+    if (check_writable() == -1) {
+        return -1;
+    }
+    if (split_path(dirpath, &name, &dirpath) == -1) {
+        out() << "Cannot remove " << path << std::endl;
+        return -1;
+    }
+    dir_struct *parent = resolve_dir(dirpath);
+    if (parent == nullptr) {
+        out() << "Path not found" << std::endl;
+        return -1;
+    }
+    if (!has_permission(parent->info, WRITE | EXECUTE)) {
+        out() << "You do not have permission to remove files in this directory." << std::endl;
+        return rollback(&ctx);
+    }
+    int slot = find_in_dir(parent, name, TYPE_DIR);
+    if (slot == -1) {
+        out() << "File not found" << std::endl;
+        return rollback(&ctx);
+    }
+    dir_entry top = parent->entries[slot];
+    if (dir_in_use(top.first_blk)) {
+        out() << "Cannot remove the current directory or one of its parents" << std::endl;
+        return rollback(&ctx);
+    }
+
+    std::string parent_path = get_dir_path(parent);
+    std::deque<tree_node> nodes;
+    if (scan_tree(top, (parent_path == "/" ? "" : parent_path) + "/" + name, &nodes) == -1) {
+        return -1;
+    }
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (!nodes[i].readable || !has_permission(nodes[i].info, WRITE | EXECUTE)) {
+            out() << "You do not have permission to remove " << nodes[i].path << std::endl;
+            return rollback(&ctx);
+        }
+    }
+
+    // One pass over the collected chains frees the whole tree
+    for (size_t i = 0; i < nodes.size(); i++) {
+        for (size_t b = 0; b < nodes[i].blocks.size(); b++) {
+            release_block(nodes[i].blocks[b]);
+        }
+        for (auto it = nodes[i].file_blocks.begin(); it != nodes[i].file_blocks.end(); ++it) {
+            for (size_t b = 0; b < it->second.size(); b++) {
+                release_block(it->second[b]);
+            }
+        }
+    }
+    {
+        std::lock_guard<std::mutex> guard(cache_lock);
+        for (size_t i = 0; i < nodes.size(); i++) {
+            dir_cache.erase(nodes[i].info.first_blk);
+        }
+    }
+    // commit counts the top directory, the entries below it go here
+    int files, dirs;
+    count_tree(nodes, &files, &dirs);
+    file_count -= files;
+    dir_count -= dirs;
+    clear_entry(&ctx, parent, slot);
+    return commit(&ctx);
+}
+
+// cp -r <sourcepath> <destpath> copies the file or the whole directory tree
+// <sourcepath> to <destpath>
+template <int BlockSize>
+int
+BasicFS<BlockSize>::cp_recursive(std::string sourcepath, std::string destpath)
+{
+    trace_scope trace(this, TRACE_CP_RECURSIVE, sourcepath, destpath);
+    op_context ctx;
+
+    std::string source_name, source_dirpath, dest_name, dest_dirpath;
+    {
+        op_locks locks(&ns_lock, false);
+        get_filename_parts(sourcepath, &source_name, &source_dirpath);
+    }
+    if (!source_name.empty()) {
+        return cp(sourcepath, destpath);
+    }
+    tx_handle tx(&journal);
+    op_locks locks(&ns_lock, true);
+    if (check_writable() == -1) {
+        return -1;
+    }
+    if (split_path(source_dirpath, &source_name, &source_dirpath) == -1) {
+        out() << "Cannot copy " << sourcepath << std::endl;
+        return -1;
+    }
+    get_filename_parts(destpath, &dest_name, &dest_dirpath);
+    if (dest_name.empty()) {
+        dest_name = source_name;
+    }
+
+    dir_struct *source_parent = resolve_dir(source_dirpath);
+    dir_struct *dest_dir = resolve_dir(dest_dirpath);
+    if (source_parent == nullptr || dest_dir == nullptr) {
+        out() << "Path not found" << std::endl;
+        return -1;
+    }
+    int source_slot = find_in_dir(source_parent, source_name, TYPE_DIR);
+    if (source_slot == -1) {
+        out() << "Source file not found" << std::endl;
+        return -1;
+    }
+    dir_entry top = source_parent->entries[source_slot];
+    if (!has_permission(dest_dir->info, WRITE | EXECUTE)) {
+        out() << "You do not have permission to create files in this directory." << std::endl;
+        return rollback(&ctx);
+    }
+    if (find_dir_entry(dest_dir, dest_name) != nullptr) {
+        out() << "File with name " << dest_name << " already exists" << std::endl;
+        return rollback(&ctx);
+    }
+    std::vector<std::string> dest_names;
+    std::vector<int> dest_blks;
+    get_dir_chain(dest_dir, &dest_names, &dest_blks);
+    if (std::find(dest_blks.begin(), dest_blks.end(), (int)top.first_blk) != dest_blks.end()) {
+        out() << "Cannot copy a directory into itself" << std::endl;
+        return rollback(&ctx);
+    }
+
+    std::string parent_path = get_dir_path(source_parent);
+    std::deque<tree_node> nodes;
+    if (scan_tree(top, (parent_path == "/" ? "" : parent_path) + "/" + source_name, &nodes) == -1) {
+        return -1;
+    }
+    int needed = 0;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (!nodes[i].readable) {
+            out() << "You do not have permission to read " << nodes[i].path << std::endl;
+            return rollback(&ctx);
+        }
+        needed += nodes[i].blocks.size();
+        for (auto it = nodes[i].file_blocks.begin(); it != nodes[i].file_blocks.end(); ++it) {
+            if (!has_permission(nodes[i].entries[it->first], READ)) {
+                out() << "You do not have permission to read " << entry_name(nodes[i].entries[it->first]) << std::endl;
+                return rollback(&ctx);
+            }
+            needed += it->second.size();
+        }
+    }
+
+    int dir_index = find_empty_dir_index(dest_dir);
+    if (dir_index == -1) {
+        std::cerr << "No space in directory" << std::endl;
+        return -1;
+    }
+    if (count_free_blocks() < needed) {
+        out() << "Not enough free blocks to copy " << sourcepath << std::endl;
+        return -1;
+    }
+
+    // Allocate every chain of the copy in one pass over the groups
+    int cursor = -1;
+    std::vector<std::vector<int>> new_dir_blocks(nodes.size());
+    std::vector<std::map<int, std::vector<int>>> new_file_blocks(nodes.size());
+    std::unordered_map<int, int> node_of_blk;
+    // Gives back every chain allocated for the copy so far
+    auto release_copy = [&]() {
+        for (size_t i = 0; i < nodes.size(); i++) {
+            for (size_t b = 0; b < new_dir_blocks[i].size(); b++) {
+                release_block(new_dir_blocks[i][b]);
+            }
+            for (auto it = new_file_blocks[i].begin(); it != new_file_blocks[i].end(); ++it) {
+                for (size_t b = 0; b < it->second.size(); b++) {
+                    release_block(it->second[b]);
+                }
+            }
+        }
+    };
+    for (size_t i = 0; i < nodes.size(); i++) {
+        node_of_blk[nodes[i].info.first_blk] = i;
+        bool allocated = allocate_chain(nodes[i].blocks.size(), &new_dir_blocks[i], &cursor) == 0;
+        for (auto it = nodes[i].file_blocks.begin(); allocated && it != nodes[i].file_blocks.end(); ++it) {
+            allocated = allocate_chain(it->second.size(), &new_file_blocks[i][it->first], &cursor) == 0;
+        }
+        if (!allocated) {
+            out() << "Not enough free blocks to copy " << sourcepath << std::endl;
+            release_copy();
+            return -1;
+        }
+    }
+
+    // Build each new directory in memory and write it once, copying file
+    // data on the pool at the same time
+    WorkPool pool;
+    std::atomic<int> errors(0);
+    std::vector<std::vector<dir_entry>> copies(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+        std::vector<dir_entry> &entries = copies[i];
+        entries = nodes[i].entries;
+        entries[PARENT_DIR_ENTRY_INDEX].first_blk = i == 0 ? dest_dir->blk : new_dir_blocks[nodes[i].parent][0];
+        entries[PARENT_DIR_ENTRY_INDEX].access_rights = i == 0 ? dest_dir->info.access_rights : nodes[nodes[i].parent].info.access_rights;
+        for (size_t s = 1; s < entries.size(); s++) {
+            if (entries[s].first_blk == FAT_FREE) {
+                continue;
+            }
+            if (entries[s].type == TYPE_FILE) {
+                entries[s].first_blk = new_file_blocks[i][s][0];
+            } else {
+                entries[s].first_blk = new_dir_blocks[node_of_blk[entries[s].first_blk]][0];
+            }
+        }
+        std::vector<int> *blocks = &new_dir_blocks[i];
+        const std::vector<dir_entry> *copy = &copies[i];
+        pool.submit([this, copy, blocks, &errors]() {
+            for (size_t b = 0; b < blocks->size(); b++) {
+                if (disk.write((*blocks)[b], (uint8_t*)&(*copy)[b * dir_size]) == -1) {
+                    errors++;
+                }
+            }
+        });
+        for (auto it = nodes[i].file_blocks.begin(); it != nodes[i].file_blocks.end(); ++it) {
+            std::vector<int> *from = &it->second;
+            std::vector<int> *to = &new_file_blocks[i][it->first];
+            pool.submit([this, from, to, &errors]() {
+                uint8_t buf[BlockSize];
+                for (size_t b = 0; b < from->size(); b++) {
+                    if (disk.read((*from)[b], buf) == -1 || disk.write((*to)[b], buf) == -1) {
+                        errors++;
+                        return;
+                    }
+                }
+            });
+        }
+    }
+    pool.wait();
+    if (errors != 0) {
+        std::cerr << "FS::cp_recursive: Error copying " << sourcepath << std::endl;
+        release_copy();
+        return -1;
+    }
+    // The new directories never pass through commit, so they are indexed
+    // and counted here
+    for (size_t i = 0; i < nodes.size(); i++) {
+        index_dir(new_dir_blocks[i], copies[i]);
+    }
+    int files, dirs;
+    count_tree(nodes, &files, &dirs);
+    file_count += files;
+    dir_count += dirs;
+
+    dir_entry copy = top;
+    memset(copy.file_name, 0, 56);
+    strncpy(copy.file_name, dest_name.c_str(), 56);
+    copy.first_blk = new_dir_blocks[0][0];
+    set_entry(&ctx, dest_dir, dir_index, copy);
+    return commit(&ctx);
+}
+
+// du <dirpath> prints the size of every directory tree below <dirpath>
+template <int BlockSize>
+int
+BasicFS<BlockSize>::du(std::string dirpath)
+{
+    trace_scope trace(this, TRACE_DU, dirpath);
+    op_locks locks(&ns_lock, false);
+    dir_struct *dir = resolve_dir(dirpath);
+    if (dir == nullptr) {
+        out() << "Path not found" << std::endl;
+        return -1;
+    }
+    std::deque<tree_node> nodes;
+    if (scan_tree(dir->info, get_dir_path(dir), &nodes, true, true) == -1) {
+        return -1;
+    }
+
+    // Children come after their parents, so a backwards pass sums subtrees
+    std::vector<long> bytes(nodes.size(), 0);
+    std::vector<long> blocks(nodes.size(), 0);
+    for (size_t i = nodes.size(); i-- > 0;) {
+        blocks[i] += nodes[i].blocks.size();
+        for (auto it = nodes[i].file_blocks.begin(); it != nodes[i].file_blocks.end(); ++it) {
+            bytes[i] += nodes[i].entries[it->first].size;
+            blocks[i] += it->second.size();
+        }
+        if (nodes[i].parent != -1) {
+            bytes[nodes[i].parent] += bytes[i];
+            blocks[nodes[i].parent] += blocks[i];
+        }
+    }
+
+    std::vector<std::pair<std::string, int>> order;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        order.push_back(std::make_pair(nodes[i].path, i));
+    }
+    std::sort(order.begin(), order.end());
+    out() << std::left << std::setw(12) << "size" << "\t" << "blocks" << "\tpath\n";
+    for (size_t i = 0; i < order.size(); i++) {
+        int n = order[i].second;
+        out() << std::setw(12) << bytes[n] << "\t" << blocks[n] << "\t" << nodes[n].path;
+        out() << (nodes[n].readable ? "" : " (not readable)") << std::endl;
+    }
+    return 0;
+}
+
+// find <dirpath> <pattern> prints the path of every entry below <dirpath>
+// whose name matches the shell wildcard <pattern>
+template <int BlockSize>
+int
+BasicFS<BlockSize>::find(std::string dirpath, std::string pattern)
+{
+    trace_scope trace(this, TRACE_FIND, dirpath, pattern);
+    op_locks locks(&ns_lock, false);
+    dir_struct *dir = resolve_dir(dirpath);
+    if (dir == nullptr) {
+        out() << "Path not found" << std::endl;
+        return -1;
+    }
+    std::deque<tree_node> nodes;
+    if (scan_tree(dir->info, get_dir_path(dir), &nodes, true, true) == -1) {
+        return -1;
+    }
+
+    std::vector<std::string> matches;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        std::string prefix = nodes[i].path == "/" ? "" : nodes[i].path;
+        for (size_t s = 1; s < nodes[i].entries.size(); s++) {
+            const dir_entry &entry = nodes[i].entries[s];
+            if (entry.first_blk == FAT_FREE) {
+                continue;
+            }
+            std::string name = entry_name(entry);
+            if (fnmatch(pattern.c_str(), name.c_str(), 0) == 0) {
+                matches.push_back(prefix + "/" + name + (entry.type == TYPE_DIR ? "/" : ""));
+            }
+        }
+    }
+    std::sort(matches.begin(), matches.end());
+    for (size_t i = 0; i < matches.size(); i++) {
+        out() << matches[i] << std::endl;
+    }
+    return 0;
+}
+
+// grep <pattern> <dirpath> prints path:offset for every place below
+// <dirpath> where a file holds <pattern>. Files are searched in parallel
+// on a pool, in order of their paths.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::grep(std::string pattern, std::string dirpath)
+{
+    trace_scope trace(this, TRACE_GREP, pattern, dirpath);
+    op_locks locks(&ns_lock, false);
+    dir_struct *dir = resolve_dir(dirpath);
+    if (dir == nullptr) {
+        out() << "Path not found" << std::endl;
+        return -1;
+    }
+    std::deque<tree_node> nodes;
+    if (scan_tree(dir->info, get_dir_path(dir), &nodes, true, true) == -1) {
+        return -1;
+    }
+
+    struct grep_file {
+        std::string path;
+        dir_struct *dir;
+        int slot;
+        int first_blk;
+        bool readable;
+        bool failed;
+        std::vector<size_t> offsets;
+    };
+    std::vector<grep_file> files;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        std::string prefix = nodes[i].path == "/" ? "" : nodes[i].path;
+        for (auto it = nodes[i].file_blocks.begin(); it != nodes[i].file_blocks.end(); ++it) {
+            const dir_entry &entry = nodes[i].entries[it->first];
+            grep_file file;
+            file.path = prefix + "/" + entry_name(entry);
+            file.dir = nodes[i].dir;
+            file.slot = it->first;
+            file.first_blk = entry.first_blk;
+            file.readable = has_permission(entry, READ);
+            file.failed = false;
+            files.push_back(file);
+        }
+    }
+    std::sort(files.begin(), files.end(), [](const grep_file &a, const grep_file &b) { return a.path < b.path; });
+
+    WorkPool pool;
+    for (size_t f = 0; f < files.size(); f++) {
+        if (files[f].readable) {
+            grep_file *file = &files[f];
+            pool.submit([this, file, &pattern]() {
+                // Like cat, reads the file under its directory's read lock,
+                // skipping it if it was removed since the scan
+                file->dir->lock.read();
+                const dir_entry &entry = file->dir->entries[file->slot];
+                if (entry.first_blk == file->first_blk && entry.type == TYPE_FILE) {
+                    std::vector<int> chain;
+                    size_t size = entry.size > 0 ? entry.size - 1 : 0;
+                    file->failed = get_chain(entry.first_blk, &chain) == -1 ||
+                                   grep_chain(chain, size, pattern, &file->offsets) == -1;
+                }
+                file->dir->lock.unlock();
+            });
+        }
+    }
+    pool.wait();
+
+    int errors = 0;
+    for (size_t f = 0; f < files.size(); f++) {
+        if (!files[f].readable) {
+            out() << "You do not have permission to read " << files[f].path << std::endl;
+        } else if (files[f].failed) {
+            out() << "Error reading " << files[f].path << std::endl;
+            errors++;
+        }
+        for (size_t m = 0; m < files[f].offsets.size(); m++) {
+            out() << files[f].path << ":" << files[f].offsets[m] << std::endl;
+        }
+    }
+    return errors == 0 ? 0 : -1;
+}
+
+// Collects the offsets of pattern in the first size bytes of the file on
+// chain, GREP_CHUNK_BLOCKS at a time. The last pattern.size() - 1 bytes of
+// a chunk stay in front of the next one, so a match may span chunks.
+template <int BlockSize>
+int
+BasicFS<BlockSize>::grep_chain(const std::vector<int> &chain, size_t size, const std::string &pattern,
+                               std::vector<size_t> *offsets)
+{
+    size_t keep = pattern.size() - 1;
+    std::vector<uint8_t> buf(keep + GREP_CHUNK_BLOCKS * BlockSize);
+    size_t carried = 0; // bytes of the previous chunk at the front of buf
+    size_t done = 0;    // bytes of the file read so far
+    for (size_t b = 0; b < chain.size() && done < size; b += GREP_CHUNK_BLOCKS) {
+        size_t count = std::min((size_t)GREP_CHUNK_BLOCKS, chain.size() - b);
+        if (read_chain(chain, b, count, buf.data() + carried) == -1) {
+            return -1;
+        }
+        size_t length = std::min(size - done, count * BlockSize);
+        memsearch(buf.data(), carried + length, pattern, done - carried, offsets);
+        done += length;
+        size_t next = std::min(keep, carried + length);
+        memmove(buf.data(), buf.data() + carried + length - next, next);
+        carried = next;
+    }
+    return 0;
+}
+
+INSTANTIATE_BLOCK_SIZES(BasicFS)
@@ -1,11 +1,73 @@
+#include <iostream>
+#include <string>
+#include <fstream>
 #include "shell.h"
+#include "bench.h"
+#include "replay.h"
+#include "server.h"
+#include "client.h"
 #include "fs.h"
 #include "disk.h"
 
+// filesystem                    runs the interactive shell
+// filesystem --serve [socket]   serves the file system to local clients
+// filesystem --connect [socket] sends shell commands to a server
+// filesystem --batch [script]   runs a script, or stdin, without a prompt
+// filesystem --bench [options]  runs bench on a fresh BENCH_DISKNAME
+// filesystem --replay <trace> [-p]
+//                               replays a trace on a fresh REPLAY_DISKNAME,
+//                               with -p at the pace it was recorded at
 int
 main(int argc, char **argv)
 {
+    std::string mode = argc > 1 ? argv[1] : "";
+    std::string socket_path = argc > 2 ? argv[2] : SOCKET_NAME;
+    if (mode == "--connect") {
+        Client client(socket_path);
+        return client.run();
+    }
+    if (mode == "--bench") {
+        Shell shell(BENCH_DISKNAME);
+        std::string line = "bench";
+        for (int i = 2; i < argc; i++) {
+            line += std::string(" ") + argv[i];
+        }
+        bool running = true;
+        if (shell.run_command("format", &running) != 0) {
+            return 1;
+        }
+        return shell.run_command(line, &running) == 0 ? 0 : 1;
+    }
+    if (mode == "--replay") {
+        bool paced = argc > 3 && std::string(argv[3]) == "-p";
+        if (argc < 3 || (argc > 3 && !paced) || argc > 4) {
+            std::cerr << "Usage: filesystem --replay <trace> [-p]" << std::endl;
+            return 1;
+        }
+        FS fs(REPLAY_DISKNAME);
+        if (fs.format() != 0) {
+            return 1;
+        }
+        Replay replay(&fs);
+        return replay.run(argv[2], paced) == 0 ? 0 : 1;
+    }
+    std::ifstream script;
+    bool from_stdin = argc < 3 || std::string(argv[2]) == "-";
+    if (mode == "--batch" && !from_stdin) {
+        script.open(argv[2], std::ios::binary);
+        if (!script) {
+            std::cerr << "Cannot open " << argv[2] << std::endl;
+            return 1;
+        }
+    }
     Shell shell;
+    if (mode == "--serve") {
+        Server server(&shell, socket_path);
+        return server.run();
+    }
+    if (mode == "--batch") {
+        return shell.run_batch(from_stdin ? &std::cin : &script) == 0 ? 0 : 1;
+    }
     shell.run();
     return 0;
 }
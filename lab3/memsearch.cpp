@@ -0,0 +1,116 @@
+#include <cstring>
+#include "memsearch.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define MEMSEARCH_X86 1
+#endif
+
+// The vector paths test the first and the last byte of the pattern at
+// every candidate position of a vector at once and compare the rest only
+// where both match, which is rare unless the data repeats the pattern.
+typedef void (*memsearch_fn)(const uint8_t*, size_t, const uint8_t*, size_t, size_t, std::vector<size_t>*);
+
+// Whether the pattern starting with its first and last byte at p matches
+static inline bool
+middle_matches(const uint8_t *p, const uint8_t *pattern, size_t length)
+{
+    return length <= 2 || memcmp(p + 1, pattern + 1, length - 2) == 0;
+}
+
+// Checks the positions from i on one at a time
+static void
+search_scalar(const uint8_t *data, size_t size, const uint8_t *pattern, size_t length, size_t base,
+              std::vector<size_t> *offsets, size_t i)
+{
+    while (i + length <= size) {
+        const uint8_t *p = (const uint8_t*)memchr(data + i, pattern[0], size - length + 1 - i);
+        if (p == nullptr) {
+            return;
+        }
+        i = p - data;
+        if (p[length - 1] == pattern[length - 1] && middle_matches(p, pattern, length)) {
+            offsets->push_back(base + i);
+        }
+        i++;
+    }
+}
+
+#ifndef MEMSEARCH_X86
+static void
+memsearch_scalar(const uint8_t *data, size_t size, const uint8_t *pattern, size_t length, size_t base,
+                 std::vector<size_t> *offsets)
+{
+    search_scalar(data, size, pattern, length, base, offsets, 0);
+}
+#else
+static void
+memsearch_sse2(const uint8_t *data, size_t size, const uint8_t *pattern, size_t length, size_t base,
+               std::vector<size_t> *offsets)
+{
+    const __m128i first = _mm_set1_epi8(pattern[0]);
+    const __m128i last = _mm_set1_epi8(pattern[length - 1]);
+    size_t i = 0;
+    for (; i + 16 + length - 1 <= size; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(data + i + length - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        for (; mask != 0; mask &= mask - 1) {
+            size_t at = i + __builtin_ctz(mask);
+            if (middle_matches(data + at, pattern, length)) {
+                offsets->push_back(base + at);
+            }
+        }
+    }
+    search_scalar(data, size, pattern, length, base, offsets, i);
+}
+
+__attribute__((target("avx2")))
+static void
+memsearch_avx2(const uint8_t *data, size_t size, const uint8_t *pattern, size_t length, size_t base,
+               std::vector<size_t> *offsets)
+{
+    const __m256i first = _mm256_set1_epi8(pattern[0]);
+    const __m256i last = _mm256_set1_epi8(pattern[length - 1]);
+    size_t i = 0;
+    for (; i + 32 + length - 1 <= size; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(data + i + length - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        for (; mask != 0; mask &= mask - 1) {
+            size_t at = i + __builtin_ctz(mask);
+            if (middle_matches(data + at, pattern, length)) {
+                offsets->push_back(base + at);
+            }
+        }
+    }
+    search_scalar(data, size, pattern, length, base, offsets, i);
+}
+#endif
+
+// Picks the widest path the CPU runs, once, before main
+static memsearch_fn
+memsearch_init()
+{
+#ifdef MEMSEARCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return memsearch_avx2;
+    }
+    return memsearch_sse2;
+#else
+    return memsearch_scalar;
+#endif
+}
+
+static const memsearch_fn memsearch_impl = memsearch_init();
+
+void
+memsearch(const uint8_t *data, size_t size, const std::string &pattern, size_t base,
+          std::vector<size_t> *offsets)
+{
+    if (pattern.empty() || pattern.size() > size) {
+        return;
+    }
+    memsearch_impl(data, size, (const uint8_t*)pattern.data(), pattern.size(), base, offsets);
+}
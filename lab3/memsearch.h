@@ -0,0 +1,16 @@
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#ifndef __MEMSEARCH_H__
+#define __MEMSEARCH_H__
+
+// Appends base + i to offsets for every i where pattern starts in the
+// size bytes at data, in order and overlapping matches included. Compares
+// 32 or 16 candidate positions at once with AVX2 or SSE2 when the CPU has
+// them.
+void memsearch(const uint8_t *data, size_t size, const std::string &pattern, size_t base,
+               std::vector<size_t> *offsets);
+
+#endif // __MEMSEARCH_H__
@@ -0,0 +1,182 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <cstdlib>
+#include "fs.h"
+#include "disk.h"
+
+// Times internal FS paths one at a time on a RAM disk, for any block size
+// the build carries (fs_microbench [blocksize]). Each case runs in
+// MICRO_ROUNDS rounds of a fixed number of calls, picked so that a round
+// takes at least MICRO_ROUND_NS; the median round is the number to
+// compare between builds, min and max show how noisy it was.
+#define MICRO_ROUNDS 11
+#define MICRO_ROUND_NS 2000000
+
+static double
+round_ns(std::function<void()> op, long iters)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < iters; i++) {
+        op();
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+static void
+measure(const std::string &name, const std::string &param, std::function<void()> op)
+{
+    long iters = 1;
+    while (round_ns(op, iters) < MICRO_ROUND_NS && iters < (1L << 30)) {
+        iters *= 2;
+    }
+    std::vector<double> per_op(MICRO_ROUNDS);
+    for (int r = 0; r < MICRO_ROUNDS; r++) {
+        per_op[r] = round_ns(op, iters) / iters;
+    }
+    std::sort(per_op.begin(), per_op.end());
+    std::cout << std::left << std::setw(18) << name << std::setw(12) << param << std::right
+              << std::fixed << std::setprecision(1) << std::setw(12) << per_op[MICRO_ROUNDS / 2]
+              << std::setw(12) << per_op[0] << std::setw(12) << per_op[MICRO_ROUNDS - 1] << std::endl;
+}
+
+// Gives blocks back to the allocator at once, without waiting for the
+// journal like release_block does
+template <class F>
+static void
+free_now(F *fs, const std::vector<int> &blocks)
+{
+    for (size_t i = 0; i < blocks.size(); i++) {
+        fs->set_fat(blocks[i], FAT_FREE);
+        fs->reuse_block(blocks[i]);
+    }
+}
+
+template <class F>
+static void
+bench_alloc(F *fs)
+{
+    int total = fs->count_free_blocks();
+    std::vector<int> held;
+    int fills[] = {0, 50, 90, 99};
+    for (int f = 0; f < 4; f++) {
+        while ((int)held.size() < total * fills[f] / 100) {
+            held.push_back(fs->find_empty_block());
+        }
+        measure("find_empty_block", std::to_string(fills[f]) + "% full", [&]() {
+            int blk = fs->find_empty_block();
+            fs->set_fat(blk, FAT_FREE);
+            fs->reuse_block(blk);
+        });
+    }
+    free_now(fs, held);
+}
+
+template <class F, int BlockSize>
+static void
+bench_data(F *fs)
+{
+    size_t sizes[] = {100, BlockSize, 16 * BlockSize, 256 * BlockSize};
+    for (int s = 0; s < 4; s++) {
+        std::string data(sizes[s] - 1, 'x');
+        std::vector<uint8_t> buf(sizes[s]);
+        std::vector<int> chain;
+        std::string param = std::to_string(sizes[s]) + " B";
+        // Each write gives its blocks back, or the disk would fill up
+        measure("write_data", param, [&]() {
+            int first = fs->find_empty_block();
+            fs->write_data(first, data);
+            fs->get_chain(first, &chain);
+            free_now(fs, chain);
+        });
+        int first = fs->find_empty_block();
+        fs->write_data(first, data);
+        measure("read_data", param, [&]() {
+            fs->read_data(first, buf.data(), buf.size());
+        });
+        fs->get_chain(first, &chain);
+        measure("get_chain", std::to_string(chain.size()) + " blocks", [&]() {
+            fs->get_chain(first, &chain);
+        });
+        free_now(fs, chain);
+    }
+}
+
+template <class F>
+static void
+bench_dirs(F *fs)
+{
+    // A directory of files, looked up by name in turn. Small disks stop
+    // before they fill up.
+    int counts[] = {8, 64, 512};
+    for (int c = 0; c < 3 && counts[c] < fs->count_free_blocks() / 2; c++) {
+        std::string dirpath = "/files" + std::to_string(counts[c]);
+        fs->mkdir(dirpath);
+        std::vector<std::string> names;
+        std::string empty;
+        for (int i = 0; i < counts[c]; i++) {
+            names.push_back("file" + std::to_string(i));
+            fs->create_file(dirpath + "/" + names.back(), &empty);
+        }
+        dir_struct *dir = fs->resolve_dir(dirpath);
+        size_t next = 0;
+        measure("find_dir_entry", std::to_string(counts[c]) + " entries", [&]() {
+            fs->find_dir_entry(dir, names[next++ % names.size()]);
+        });
+    }
+
+    // Paths and working directories some levels down
+    int depths[] = {1, 4, 16, 64};
+    std::string path = "";
+    int depth = 0;
+    for (int d = 0; d < 4; d++) {
+        while (depth < depths[d]) {
+            path += "/d" + std::to_string(depth++);
+            fs->mkdir(path);
+        }
+        measure("resolve_dir", "depth " + std::to_string(depth), [&]() {
+            fs->resolve_dir(path);
+        });
+        fs->cd(path);
+        measure("get_pwd_string", "depth " + std::to_string(depth), [&]() {
+            fs->get_pwd_string();
+        });
+        fs->cd("/");
+    }
+}
+
+template <int BlockSize>
+static void
+bench_all()
+{
+    BasicFS<BlockSize> fs(RAM_DISKNAME);
+    fs.format();
+    std::cout << "Block size " << BlockSize << std::endl;
+    std::cout << std::left << std::setw(18) << "path" << std::setw(12) << "case" << std::right
+              << std::setw(12) << "median ns" << std::setw(12) << "min ns" << std::setw(12) << "max ns" << std::endl;
+    bench_alloc(&fs);
+    bench_data<BasicFS<BlockSize>, BlockSize>(&fs);
+    bench_dirs(&fs);
+}
+
+int
+main(int argc, char **argv)
+{
+    int block_size = argc > 1 ? atoi(argv[1]) : BLOCK_SIZE;
+    if (block_size == 1024) {
+        bench_all<1024>();
+    } else if (block_size == 4096) {
+        bench_all<4096>();
+    } else if (block_size == 8192) {
+        bench_all<8192>();
+    } else {
+        std::cerr << "Usage: fs_microbench [1024|4096|8192]" << std::endl;
+        return 1;
+    }
+    return 0;
+}
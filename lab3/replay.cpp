@@ -0,0 +1,163 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <chrono>
+#include <thread>
+#include "replay.h"
+
+static const char *op_names[TRACE_OPS] = {
+    "", "format", "create", "cat", "read", "ls", "cp", "mv", "rm", "append",
+    "mkdir", "cd", "pwd", "chmod", "rm -r", "cp -r", "du", "find", "fsck",
+    "snap create", "snap delete", "snap mount", "snap umount", "snap list", "grep", "df"
+};
+
+Replay::Replay(FS *fs) : fs(fs)
+{
+    sessions.push_back(nullptr);
+}
+
+Replay::~Replay()
+{
+    fs->use_session(nullptr);
+    for (size_t i = 1; i < sessions.size(); i++) {
+        fs->close_session(sessions[i]);
+    }
+}
+
+// Makes the call rec describes. Files get content of the traced length.
+int
+Replay::call(const trace_record &rec, const std::string &path, const std::string &arg)
+{
+    std::string buf;
+    switch (rec.op) {
+    case TRACE_FORMAT:
+        return fs->format();
+    case TRACE_CREATE:
+        buf.assign(rec.size, 'x');
+        return fs->create_file(path, &buf);
+    case TRACE_CAT:
+        return fs->cat(path);
+    case TRACE_READ:
+        return fs->read_file(path, &buf);
+    case TRACE_LS:
+        return fs->ls(path, rec.size != 0);
+    case TRACE_CP:
+        return fs->cp(path, arg);
+    case TRACE_MV:
+        return fs->mv(path, arg);
+    case TRACE_RM:
+        return fs->rm(path);
+    case TRACE_APPEND:
+        return fs->append(path, arg);
+    case TRACE_MKDIR:
+        return fs->mkdir(path);
+    case TRACE_CD:
+        return fs->cd(path);
+    case TRACE_PWD:
+        return fs->pwd();
+    case TRACE_CHMOD:
+        return fs->chmod(path, arg);
+    case TRACE_RM_RECURSIVE:
+        return fs->rm_recursive(path);
+    case TRACE_CP_RECURSIVE:
+        return fs->cp_recursive(path, arg);
+    case TRACE_DU:
+        return fs->du(path);
+    case TRACE_FIND:
+        return fs->find(path, arg);
+    case TRACE_FSCK:
+        return fs->fsck(rec.size & 1, rec.size & 2);
+    case TRACE_SNAPSHOT_CREATE:
+        return fs->snapshot_create(path);
+    case TRACE_SNAPSHOT_DELETE:
+        return fs->snapshot_delete(path);
+    case TRACE_SNAPSHOT_MOUNT:
+        return fs->snapshot_mount(path);
+    case TRACE_SNAPSHOT_UMOUNT:
+        return fs->snapshot_umount();
+    case TRACE_SNAPSHOT_LIST:
+        return fs->snapshot_list();
+    case TRACE_GREP:
+        return fs->grep(path, arg);
+    case TRACE_DF:
+        return fs->df();
+    }
+    return -1;
+}
+
+// Replays the trace in the order the calls returned, printing a summary
+// per kind of call. Whatever the calls print is dropped.
+int
+Replay::run(std::string tracepath, bool paced)
+{
+    std::ifstream trace(tracepath, std::ios::binary);
+    trace_header header;
+    if (!trace.read((char*)&header, sizeof(header)) || header.magic != TRACE_MAGIC) {
+        std::cout << tracepath << " is not a trace" << std::endl;
+        return -1;
+    }
+    if (header.version != TRACE_VERSION) {
+        std::cout << tracepath << " has trace version " << header.version << ", expected " << TRACE_VERSION << std::endl;
+        return -1;
+    }
+
+    std::vector<replay_stats> stats(TRACE_OPS, replay_stats{0, 0, 0, 0});
+    std::ostream sink(nullptr);
+    fs->use_streams(nullptr, &sink);
+    auto start = std::chrono::steady_clock::now();
+    trace_record rec;
+    std::string path, arg;
+    int calls = 0, errors = 0;
+    bool broken = false;
+    while (trace.read((char*)&rec, sizeof(rec))) {
+        path.resize(rec.path_len);
+        arg.resize(rec.arg_len);
+        if (!trace.read(&path[0], rec.path_len) || !trace.read(&arg[0], rec.arg_len) ||
+            rec.op == 0 || rec.op >= TRACE_OPS) {
+            broken = true;
+            break;
+        }
+        while (sessions.size() <= rec.session) {
+            sessions.push_back(fs->open_session());
+        }
+        fs->use_session(sessions[rec.session]);
+        if (paced) {
+            std::this_thread::sleep_until(start + std::chrono::microseconds(rec.start_us));
+        }
+
+        auto begin = std::chrono::steady_clock::now();
+        int ret = call(rec, path, arg);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - begin;
+        replay_stats *s = &stats[rec.op];
+        s->count++;
+        s->errors += ret != 0;
+        s->traced_ms += rec.duration_us / 1000.0;
+        s->replay_ms += elapsed.count();
+        calls++;
+        errors += ret != 0;
+    }
+    std::chrono::duration<double> total = std::chrono::steady_clock::now() - start;
+    fs->use_streams(nullptr, nullptr);
+    fs->use_session(nullptr);
+    if (broken) {
+        std::cout << "The trace is cut short after " << calls << " calls" << std::endl;
+    }
+
+    std::cout << std::left << std::setw(12) << "call" << std::right << std::setw(8) << "count"
+              << std::setw(8) << "errors" << std::setw(12) << "traced ms" << std::setw(12) << "replay ms"
+              << std::endl << std::fixed << std::setprecision(3);
+    for (int op = 1; op < TRACE_OPS; op++) {
+        const replay_stats &s = stats[op];
+        if (s.count > 0) {
+            std::cout << std::left << std::setw(12) << op_names[op] << std::right << std::setw(8) << s.count
+                      << std::setw(8) << s.errors << std::setw(12) << s.traced_ms
+                      << std::setw(12) << s.replay_ms << std::endl;
+        }
+    }
+    std::cout << "Replayed " << calls << " calls in " << total.count() << " s";
+    if (total.count() > 0) {
+        std::cout << ", " << std::setprecision(0) << calls / total.count() << " calls/s";
+    }
+    std::cout << ", " << errors << " errors" << std::endl;
+    return broken ? -1 : 0;
+}
@@ -0,0 +1,32 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include "fs.h"
+
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#define REPLAY_DISKNAME "replayfile.bin" // disk file of filesystem --replay
+
+// Time spent on one kind of call, in the trace and in the replay
+struct replay_stats {
+    int count;
+    int errors;
+    double traced_ms;
+    double replay_ms;
+};
+
+// Runs the calls of a trace recorded with trace start against a file
+// system, as fast as possible or at the pace they were recorded at
+class Replay {
+private:
+    FS *fs;
+    std::vector<fs_session*> sessions; // by the trace's session numbers
+    int call(const trace_record &rec, const std::string &path, const std::string &arg);
+public:
+    Replay(FS *fs);
+    ~Replay();
+    int run(std::string tracepath, bool paced);
+};
+
+#endif // __REPLAY_H__
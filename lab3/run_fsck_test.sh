@@ -0,0 +1,41 @@
+# Corrupts a directory block and checks that fsck -r keeps the tree below
+# it: nothing is freed or removed while the directory cannot be read, and
+# once its checksum is repaired the next run finds everything in place.
+# Run from lab3 after make.
+status=0
+
+rm -f diskfile.bin
+printf 'format\nmkdir d\nmkdir d/fsck_e\nmkdir d/fsck_e/g\nmkdir d/fsck_f\ncreate d/fsck_f/x\nstill here\n\nquit\n' |
+    ./filesystem --batch > /dev/null 2>&1
+
+# The last copy of the name is the home block of d, earlier ones are
+# images left in the journal. A byte in its unused slots is flipped.
+offset=$(grep -obUa "fsck_e" diskfile.bin | tail -1 | cut -d: -f1)
+blk=$((offset / 4096))
+printf '\132' | dd of=diskfile.bin bs=1 seek=$((blk * 4096 + 4000)) conv=notrunc 2> /dev/null
+
+first=$(printf 'fsck -r\nquit\n' | ./filesystem --batch 2> /dev/null)
+second=$(printf 'fsck -r\ncat d/fsck_f/x\nls d/fsck_e\nquit\n' | ./filesystem --batch 2> /dev/null)
+
+check() {
+    if echo "$2" | grep -q "$3"; then
+        echo "ok: $1"
+    else
+        echo "FAILED: $1"
+        echo "$2"
+        status=1
+    fi
+}
+check "the unreadable directory is reported" "$first" "/d: directory could not be read"
+check "its checksum is repaired" "$first" "Block $blk does not match its checksum.*(repaired)"
+if echo "$first" | grep -q "removed\|belong to no file (repaired)"; then
+    echo "FAILED: entries or blocks below the unreadable directory were repaired away"
+    echo "$first"
+    status=1
+fi
+check "the second run finds no problems" "$second" "No problems found"
+check "files below the directory survive" "$second" "still here"
+check "directories below the directory survive" "$second" "^g "
+
+rm -f diskfile.bin
+exit $status
@@ -0,0 +1,423 @@
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <csignal>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "server.h"
+
+// Set by SIGINT and SIGTERM; the handler also writes to the wake pipe so
+// the event loop notices at once
+static volatile sig_atomic_t stop_requested = 0;
+static int signal_wake_fd = -1;
+
+static void
+handle_stop(int sig)
+{
+    stop_requested = 1;
+    if (signal_wake_fd != -1) {
+        char c = 0;
+        if (write(signal_wake_fd, &c, 1) == -1) {
+            ; // the pipe is full, the loop is waking up anyway
+        }
+    }
+}
+
+static int
+set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Requests spend much of their time waiting on the disk and on directory
+// locks, so the pool has MAX_WORKERS threads however few cores there are
+Server::Server(Shell *shell, std::string path)
+    : shell(shell), fs(shell->get_fs()), path(path), listen_fd(-1), pool(WorkPool::MAX_WORKERS)
+{
+    wake_fds[0] = -1;
+    wake_fds[1] = -1;
+}
+
+Server::~Server()
+{
+    pool.wait();
+    for (auto it = connections.begin(); it != connections.end(); ++it) {
+        close(it->second->fd);
+        fs->close_session(it->second->session);
+        delete it->second;
+    }
+    if (listen_fd != -1) {
+        close(listen_fd);
+        unlink(path.c_str());
+    }
+    signal_wake_fd = -1;
+    for (int i = 0; i < 2; i++) {
+        if (wake_fds[i] != -1) {
+            close(wake_fds[i]);
+        }
+    }
+}
+
+int
+Server::setup()
+{
+    sockaddr_un addr;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Server::setup: Socket path too long: " << path << std::endl;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd == -1) {
+        std::cerr << "Server::setup: socket: " << strerror(errno) << std::endl;
+        return -1;
+    }
+    unlink(path.c_str());
+    // Only the owner may connect, so the socket is never open to others,
+    // not even between bind and a chmod
+    mode_t old_mask = umask(0177);
+    int bound = bind(listen_fd, (sockaddr*)&addr, sizeof(addr));
+    umask(old_mask);
+    if (bound == -1 || listen(listen_fd, SOMAXCONN) == -1) {
+        std::cerr << "Server::setup: Cannot listen on " << path << ": " << strerror(errno) << std::endl;
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+    if (pipe(wake_fds) == -1) {
+        std::cerr << "Server::setup: pipe: " << strerror(errno) << std::endl;
+        return -1;
+    }
+    set_nonblocking(listen_fd);
+    set_nonblocking(wake_fds[0]);
+    set_nonblocking(wake_fds[1]);
+
+    signal_wake_fd = wake_fds[1];
+    signal(SIGINT, handle_stop);
+    signal(SIGTERM, handle_stop);
+    signal(SIGPIPE, SIG_IGN);
+    return 0;
+}
+
+// runs the event loop until SIGINT or SIGTERM
+int
+Server::run()
+{
+    if (setup() == -1) {
+        return -1;
+    }
+    std::cout << "Serving " << path << " with " << pool.size() << " workers" << std::endl;
+
+    std::vector<pollfd> fds;
+    std::vector<connection*> polled;
+    while (!stop_requested) {
+        fds.clear();
+        polled.clear();
+        fds.push_back({listen_fd, POLLIN, 0});
+        fds.push_back({wake_fds[0], POLLIN, 0});
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            for (auto it = connections.begin(); it != connections.end(); ++it) {
+                connection *conn = it->second;
+                short events = 0;
+                if (!conn->closing && !conn->dead) {
+                    events |= POLLIN;
+                }
+                if (!conn->out_buf.empty() && !conn->dead) {
+                    events |= POLLOUT;
+                }
+                // poll skips negative descriptors, so a closing client
+                // that hung up does not keep reporting POLLHUP
+                fds.push_back({events != 0 ? conn->fd : -1, events, 0});
+                polled.push_back(conn);
+            }
+        }
+
+        if (poll(fds.data(), fds.size(), -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Server::run: poll: " << strerror(errno) << std::endl;
+            return -1;
+        }
+        if (fds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(wake_fds[0], drain, sizeof(drain)) > 0) {
+                ;
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            accept_clients();
+        }
+        for (size_t i = 0; i < polled.size(); i++) {
+            short revents = fds[i + 2].revents;
+            if (revents & (POLLIN | POLLHUP | POLLERR)) {
+                read_requests(polled[i]);
+            }
+            if (revents & POLLOUT) {
+                write_responses(polled[i]);
+            }
+        }
+
+        // Free connections that are done, once no worker holds them
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto it = connections.begin(); it != connections.end();) {
+            connection *conn = it->second;
+            bool drained = conn->closing && conn->pending.empty() && conn->out_buf.empty();
+            if (!conn->busy && (conn->dead || drained)) {
+                close(conn->fd);
+                fs->close_session(conn->session);
+                delete conn;
+                it = connections.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    std::cout << "Server stopped" << std::endl;
+    return 0;
+}
+
+void
+Server::accept_clients()
+{
+    while (true) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                std::cerr << "Server::accept_clients: accept: " << strerror(errno) << std::endl;
+            }
+            return;
+        }
+        // root may connect whatever the socket's mode, other users may not
+        ucred peer;
+        socklen_t peer_len = sizeof(peer);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) == -1 || peer.uid != getuid()) {
+            std::cerr << "Server::accept_clients: Refusing a client of another user" << std::endl;
+            close(fd);
+            continue;
+        }
+        set_nonblocking(fd);
+        connection *conn = new connection();
+        conn->fd = fd;
+        conn->session = fs->open_session();
+        conn->busy = false;
+        conn->closing = false;
+        conn->dead = false;
+        std::lock_guard<std::mutex> guard(lock);
+        connections[fd] = conn;
+    }
+}
+
+// Reads what the socket has and queues every complete request
+void
+Server::read_requests(connection *conn)
+{
+    char buf[BLOCK_SIZE * 4];
+    bool eof = false;
+    while (true) {
+        ssize_t n = read(conn->fd, buf, sizeof(buf));
+        if (n > 0) {
+            conn->in_buf.append(buf, n);
+            continue;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            eof = true;
+        }
+        break;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    size_t pos = 0;
+    while (conn->in_buf.size() - pos >= sizeof(request_header)) {
+        request_header header;
+        memcpy(&header, conn->in_buf.data() + pos, sizeof(header));
+        if (header.length > MAX_PAYLOAD) {
+            std::cerr << "Server::read_requests: Request of " << header.length << " bytes, dropping client" << std::endl;
+            conn->dead = true;
+            break;
+        }
+        if (conn->in_buf.size() - pos - sizeof(header) < header.length) {
+            break;
+        }
+        request req;
+        req.id = header.id;
+        req.op = header.op;
+        req.payload = conn->in_buf.substr(pos + sizeof(header), header.length);
+        pos += sizeof(header) + header.length;
+        if (!conn->closing) {
+            conn->pending.push_back(req);
+        }
+    }
+    conn->in_buf.erase(0, pos);
+    if (eof) {
+        conn->closing = true;
+    }
+    if (!conn->busy && !conn->pending.empty() && !conn->dead) {
+        schedule(conn);
+    }
+}
+
+void
+Server::write_responses(connection *conn)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    while (!conn->out_buf.empty()) {
+        ssize_t n = send(conn->fd, conn->out_buf.data(), conn->out_buf.size(), MSG_NOSIGNAL);
+        if (n > 0) {
+            conn->out_buf.erase(0, n);
+            continue;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            conn->dead = true;
+        }
+        break;
+    }
+}
+
+// Hands the connection to a worker. Called with lock held.
+void
+Server::schedule(connection *conn)
+{
+    conn->busy = true;
+    pool.submit([this, conn]() { process(conn); });
+}
+
+// Runs the oldest request of the connection, then hands the connection
+// back to the pool if more are queued, so long pipelines do not keep a
+// worker from other clients
+void
+Server::process(connection *conn)
+{
+    request req;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (conn->dead || conn->pending.empty()) {
+            conn->busy = false;
+            wake();
+            return;
+        }
+        req = conn->pending.front();
+        conn->pending.pop_front();
+    }
+
+    std::string payload;
+    int status = execute(conn, req, &payload);
+
+    response_header header;
+    header.length = payload.size();
+    header.id = req.id;
+    header.status = status;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        conn->out_buf.append((char*)&header, sizeof(header));
+        conn->out_buf.append(payload);
+        if (!conn->dead && !conn->pending.empty()) {
+            schedule(conn);
+        } else {
+            conn->busy = false;
+        }
+    }
+    wake();
+}
+
+// Whether line is a command clients may not send: format, fsck -r, every
+// snapshot command, pathindex on|off and checksum cached, which change the
+// whole volume or its settings, and trace, import and export, which open
+// host paths with the server's privileges. They are run from the local
+// shell instead.
+static bool
+local_only(const std::string &line)
+{
+    std::istringstream words(line);
+    std::vector<std::string> args;
+    std::string word;
+    while (words >> word) {
+        args.push_back(word);
+    }
+    if (args.empty()) {
+        return false;
+    }
+    const std::string &cmd = args[0];
+    if (cmd == "fsck") {
+        return std::find(args.begin(), args.end(), "-r") != args.end();
+    }
+    return cmd == "format" || cmd == "snapshot" || cmd == "trace" || cmd == "import" || cmd == "export" ||
+           (cmd == "pathindex" && args.size() > 1) || (cmd == "checksum" && args.size() > 1);
+}
+
+// Runs one request in the connection's session. Whatever the FS prints
+// becomes the response, except for OP_READ, which answers with the file.
+int
+Server::execute(connection *conn, const request &req, std::string *response)
+{
+    std::istringstream in;
+    std::ostringstream out;
+    fs->use_session(conn->session);
+    fs->use_streams(&in, &out);
+
+    int status = -1;
+    if (req.op == OP_COMMAND && local_only(req.payload.substr(0, req.payload.find('\n')))) {
+        *response = "Command not allowed over the socket, run it in the local shell\n";
+    } else if (req.op == OP_COMMAND) {
+        size_t newline = req.payload.find('\n');
+        in.str(newline == std::string::npos ? "" : req.payload.substr(newline + 1));
+        bool running = true;
+        status = shell->run_command(req.payload.substr(0, newline), &running);
+        if (!running) {
+            std::lock_guard<std::mutex> guard(lock);
+            conn->closing = true;
+            conn->pending.clear();
+        }
+        *response = out.str();
+    } else if (req.op == OP_READ) {
+        status = fs->read_file(req.payload, response);
+        if (status != 0) {
+            *response = out.str();
+        }
+    } else if (req.op == OP_WRITE) {
+        size_t end = req.payload.find('\0');
+        if (end == std::string::npos) {
+            out << "Missing file content" << std::endl;
+        } else {
+            std::string data = req.payload.substr(end + 1);
+            status = fs->create_file(req.payload.substr(0, end), &data);
+        }
+        *response = out.str();
+    } else {
+        *response = "Unknown request\n";
+    }
+
+    fs->use_streams(nullptr, nullptr);
+    fs->use_session(nullptr);
+    return status;
+}
+
+void
+Server::wake()
+{
+    char c = 0;
+    if (write(wake_fds[1], &c, 1) == -1) {
+        ; // the pipe is full, the loop is waking up anyway
+    }
+}
@@ -0,0 +1,93 @@
+#include <string>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <cstdint>
+#include "shell.h"
+#include "workpool.h"
+
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#define SOCKET_NAME "filesystem.sock"
+#define MAX_PAYLOAD (16 * 1024 * 1024)
+
+// Request types. Payloads:
+// OP_COMMAND: a shell command line, optionally followed by '\n' and the
+//             lines the command reads (the data of create)
+// OP_READ:    a file path; the response carries the whole file
+// OP_WRITE:   a file path, '\0', then the content of the new file
+#define OP_COMMAND 1
+#define OP_READ 2
+#define OP_WRITE 3
+
+// Every request and response is a header followed by length bytes of
+// payload, in host byte order since the socket is local. A client may send
+// any number of requests before reading a response; the requests of one
+// connection run in order and their responses come back in that order.
+struct request_header {
+    uint32_t length;
+    uint32_t id; // echoed in the response
+    uint8_t op;
+    uint8_t pad[3];
+};
+
+struct response_header {
+    uint32_t length;
+    uint32_t id;
+    int32_t status; // return value of the command, -1 for a bad request
+};
+
+struct request {
+    uint32_t id;
+    uint8_t op;
+    std::string payload;
+};
+
+// One client. in_buf belongs to the event loop, the rest is guarded by
+// Server::lock. While busy, a worker is running the connection's requests
+// and the event loop must not free it.
+struct connection {
+    int fd;
+    fs_session *session;
+    std::string in_buf;
+    std::deque<request> pending;
+    std::string out_buf;
+    bool busy;
+    bool closing; // no more requests will be read
+    bool dead;    // the socket failed, drop the connection
+};
+
+// Serves the shell's commands and binary file reads and writes to local
+// processes over a Unix domain socket. One thread polls every socket and
+// frames requests, a WorkPool runs them. Each connection has its own FS
+// session, so cd in one client does not move the others. Only the user
+// running the server may connect, and commands that change the whole
+// volume or open host paths are refused (see local_only in server.cpp).
+class Server {
+private:
+    Shell *shell;
+    FS *fs;
+    std::string path;
+    int listen_fd;
+    int wake_fds[2];
+    WorkPool pool;
+    std::mutex lock;
+    std::map<int, connection*> connections;
+
+    int setup();
+    void accept_clients();
+    void read_requests(connection *conn);
+    void write_responses(connection *conn);
+    void schedule(connection *conn);
+    void process(connection *conn);
+    int execute(connection *conn, const request &req, std::string *response);
+    void wake();
+public:
+    Server(Shell *shell, std::string path);
+    ~Server();
+    // runs the event loop until SIGINT or SIGTERM
+    int run();
+};
+
+#endif // __SERVER_H__
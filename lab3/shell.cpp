@@ -1,19 +1,23 @@
 #include <iostream>
+#include <iomanip>
 #include <sstream>
 #include <string>
 #include <vector>
+#include <chrono>
+#include <algorithm>
 #include "shell.h"
+#include "bench.h"
 #include "fs.h"
 
 std::string commands_str[] = {
     "format", "create", "cat", "ls",
     "cp", "mv", "rm", "append",
     "mkdir", "cd", "pwd",
-    "chmod",
+    "chmod", "du", "df", "find", "grep", "import", "export", "fsck", "checksum", "pathindex", "snapshot", "bench", "trace",
     "help", "quit"
 };
 
-Shell::Shell()
+Shell::Shell(const std::string &diskname) : filesystem(diskname), interactive(true)
 {
     std::cout << "Starting shell...\n";
 }
@@ -28,225 +32,533 @@ Shell::run()
 {
     bool running = true;
     std::string line;
+    while (running) {
+        std::cout << "filesystem> ";
+        std::getline(std::cin, line);
+        run_command(line, &running);
+    }
+}
+
+static void
+print_stats(const std::string &cmd, const command_stats &cs)
+{
+    double avg = cs.count > 0 ? cs.total_ms / cs.count : 0;
+    std::cerr << std::left << std::setw(10) << cmd << std::right << std::setw(8) << cs.count
+              << std::setw(8) << cs.errors << std::fixed << std::setprecision(3)
+              << std::setw(12) << cs.total_ms << std::setw(10) << avg
+              << std::setw(10) << cs.max_ms << std::endl;
+}
+
+// Runs every line of script as a command, without a prompt. Lines
+// starting with # are comments, and create reads its data from the script.
+int
+Shell::run_batch(std::istream *script)
+{
+    std::map<std::string, command_stats> stats;
+    command_stats total = {0, 0, 0, 0};
+    bool running = true;
+    std::string line;
+    int line_no = 0;
+    interactive = false;
+    filesystem.use_streams(script, nullptr);
+    while (running && std::getline(*script, line)) {
+        line_no++;
+        size_t start = line.find_first_not_of(' ');
+        if (start == std::string::npos || line[start] == '#') {
+            continue;
+        }
+        std::string cmd = line.substr(start, line.find(' ', start) - start);
+        auto begin = std::chrono::steady_clock::now();
+        int ret_val = run_command(line, &running);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - begin;
+
+        command_stats *both[2] = {&stats[cmd], &total};
+        for (int i = 0; i < 2; i++) {
+            both[i]->count++;
+            both[i]->errors += ret_val != 0;
+            both[i]->total_ms += elapsed.count();
+            both[i]->max_ms = std::max(both[i]->max_ms, elapsed.count());
+        }
+        if (ret_val != 0) {
+            std::cerr << "line " << line_no << ": " << line << ": error code " << ret_val << std::endl;
+        }
+    }
+    filesystem.use_streams(nullptr, nullptr);
+    std::cout << std::flush;
+
+    std::cerr << std::left << std::setw(10) << "command" << std::right << std::setw(8) << "count"
+              << std::setw(8) << "errors" << std::setw(12) << "total ms" << std::setw(10) << "avg ms"
+              << std::setw(10) << "max ms" << std::endl;
+    for (auto it = stats.begin(); it != stats.end(); ++it) {
+        print_stats(it->first, it->second);
+    }
+    print_stats("total", total);
+    return total.errors;
+}
+
+// Reads the data of create <file> <<marker from the input stream. A
+// number as marker takes that many bytes as they are, anything else takes
+// the lines up to one that is just the marker, empty lines included.
+int
+Shell::read_heredoc(const std::string &marker, std::string *data)
+{
+    std::istream &in = filesystem.in();
+    if (marker.find_first_not_of("0123456789") == std::string::npos && marker.size() <= 9) {
+        data->resize(std::stoul(marker));
+        if (!in.read(&(*data)[0], data->size())) {
+            filesystem.out() << "Expected " << marker << " bytes of data" << std::endl;
+            return -1;
+        }
+    } else {
+        std::string line;
+        bool ended = false;
+        while (!ended && std::getline(in, line)) {
+            ended = line == marker;
+            if (!ended)
+                data->append(line + '\n');
+        }
+        if (!ended) {
+            filesystem.out() << "Missing end marker " << marker << std::endl;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Parses and runs one command line. Output goes to the calling thread's
+// FS output stream and create reads its data from the FS input stream, so
+// the server can run commands on behalf of clients. quit clears running.
+int
+Shell::run_command(std::string line, bool *running)
+{
+    std::ostream &out = filesystem.out();
     std::string str;
     char c;
     std::vector<std::string> cmd_line;
     std::string cmd, arg1, arg2;
     int ret_val = 0;
-    while (running) {
-        std::cout << "filesystem> ";
-        std::getline(std::cin, line);
-        std::stringstream linestream(line);
-        cmd_line.clear();
-        str.clear();
-        while (linestream.get(c)) {
-            //std::cout << "parsing cmd line: " << c << "\n";
-            if (c != ' ') {
-                str += c;
-            } else {
-                // strip multiple blanks
-                if (!str.empty()) {
-                    cmd_line.push_back(str);
-                    str.clear();
-                }
+    std::stringstream linestream(line);
+    while (linestream.get(c)) {
+        //out << "parsing cmd line: " << c << "\n";
+        if (c != ' ') {
+            str += c;
+        } else {
+            // strip multiple blanks
+            if (!str.empty()) {
+                cmd_line.push_back(str);
+                str.clear();
             }
         }
-        if (!str.empty())
-            cmd_line.push_back(str);
-        if (line.empty())
-            cmd = "";
-        else
-            cmd = cmd_line[0];
+    }
+    if (!str.empty())
+        cmd_line.push_back(str);
+    if (cmd_line.empty())
+        cmd = "";
+    else
+        cmd = cmd_line[0];
 
-        if (DEBUG) {
-            std::cout << "Line: " << line << std::endl;
-            std::cout << "cmd: " << cmd << std::endl;
-            for (unsigned i = 0; i < cmd_line.size(); ++i)
-                std::cout << "cmd/arg: " << cmd_line[i] << "\n";
-        }
+    if (DEBUG) {
+        out << "Line: " << line << std::endl;
+        out << "cmd: " << cmd << std::endl;
+        for (unsigned i = 0; i < cmd_line.size(); ++i)
+            out << "cmd/arg: " << cmd_line[i] << "\n";
+    }
 
-        if (cmd == "format") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: format\n";
-                continue;
-            }
-            // check return value so everything is ok
-            ret_val = filesystem.format();
-            if (ret_val) {
-                std::cout << "Error: format failed, error code " << ret_val << std::endl;
-            }
+    if (cmd == "format") {
+        if (cmd_line.size() != 1) {
+            out << "Usage: format\n";
+            return -1;
         }
+        // check return value so everything is ok
+        ret_val = filesystem.format();
+        if (ret_val) {
+            out << "Error: format failed, error code " << ret_val << std::endl;
+        }
+    }
 
-        else if (cmd == "create") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: create <file>\n";
-                continue;
+    else if (cmd == "create") {
+        bool heredoc = cmd_line.size() == 3 && cmd_line[2].compare(0, 2, "<<") == 0 && cmd_line[2].size() > 2;
+        if (cmd_line.size() != 2 && !heredoc) {
+            out << "Usage: create <file> [<<TAG | <<N]\n";
+            return -1;
+        }
+        arg1 = cmd_line[1];
+        // check return value so everything is ok
+        if (heredoc) {
+            std::string data;
+            ret_val = read_heredoc(cmd_line[2].substr(2), &data);
+            if (ret_val == 0) {
+                ret_val = filesystem.create_file(arg1, &data);
             }
-            arg1 = cmd_line[1];
-            std::cout << "Enter data. Empty line to end.\n";
-            // check return value so everything is ok
+        } else {
+            if (interactive)
+                out << "Enter data. Empty line to end.\n";
             ret_val = filesystem.create(arg1);
-            if (ret_val) {
-                std::cout << "Error: create " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
         }
+        if (ret_val) {
+            out << "Error: create " << arg1;
+            out << " failed, error code " << ret_val << std::endl;
+        }
+    }
 
-        else if (cmd == "cat") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: cat <file>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
-            ret_val = filesystem.cat(arg1);
-            if (ret_val) {
-                std::cout << "Error: cat " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "cat") {
+        if (cmd_line.size() != 2) {
+            out << "Usage: cat <file>\n";
+            return -1;
         }
+        arg1 = cmd_line[1];
+        // check return value so everything is ok
+        ret_val = filesystem.cat(arg1);
+        if (ret_val) {
+            out << "Error: cat " << arg1;
+            out << " failed, error code " << ret_val << std::endl;
+        }
+    }
 
-        else if (cmd == "ls") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: ls\n";
-                continue;
-            }
-            // check return value so everything is ok
-            ret_val = filesystem.ls();
-            if (ret_val) {
-                std::cout << "Error: ls failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "ls") {
+        bool long_format = cmd_line.size() > 1 && cmd_line[1] == "-l";
+        size_t first_arg = long_format ? 2 : 1;
+        if (cmd_line.size() > first_arg + 1) {
+            out << "Usage: ls [-l] [dirpath]\n";
+            return -1;
         }
+        arg1 = cmd_line.size() > first_arg ? cmd_line[first_arg] : "";
+        // check return value so everything is ok
+        ret_val = filesystem.ls(arg1, long_format);
+        if (ret_val) {
+            out << "Error: ls failed, error code " << ret_val << std::endl;
+        }
+    }
 
-        else if (cmd == "cp") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: <oldfile> <newfile>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
+    else if (cmd == "cp") {
+        bool recursive = cmd_line.size() == 4 && cmd_line[1] == "-r";
+        if (cmd_line.size() != 3 && !recursive) {
+            out << "Usage: cp [-r] <oldfile> <newfile>\n";
+            return -1;
+        }
+        arg1 = cmd_line[cmd_line.size() - 2];
+        arg2 = cmd_line[cmd_line.size() - 1];
+        // check return value so everything is ok
+        if (recursive)
+            ret_val = filesystem.cp_recursive(arg1, arg2);
+        else
             ret_val = filesystem.cp(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: cp " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+        if (ret_val) {
+            out << "Error: cp " << arg1 << " " << arg2;
+            out << " failed, error code " << ret_val << std::endl;
         }
+    }
 
-        else if (cmd == "mv") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: mv <sourcepath> <destpath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.mv(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: mv " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "mv") {
+        if (cmd_line.size() != 3) {
+            out << "Usage: mv <sourcepath> <destpath>\n";
+            return -1;
         }
+        arg1 = cmd_line[1];
+        arg2 = cmd_line[2];
+        // check return value so everything is ok
+        ret_val = filesystem.mv(arg1, arg2);
+        if (ret_val) {
+            out << "Error: mv " << arg1 << " " << arg2;
+            out << " failed, error code " << ret_val << std::endl;
+        }
+    }
 
-        else if (cmd == "rm") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: rm <file>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
+    else if (cmd == "rm") {
+        bool recursive = cmd_line.size() == 3 && cmd_line[1] == "-r";
+        if (cmd_line.size() != 2 && !recursive) {
+            out << "Usage: rm [-r] <file>\n";
+            return -1;
+        }
+        arg1 = cmd_line[cmd_line.size() - 1];
+        // check return value so everything is ok
+        if (recursive)
+            ret_val = filesystem.rm_recursive(arg1);
+        else
             ret_val = filesystem.rm(arg1);
-            if (ret_val) {
-                std::cout << "Error: rm " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+        if (ret_val) {
+            out << "Error: rm " << arg1;
+            out << " failed, error code " << ret_val << std::endl;
         }
+    }
 
-        else if (cmd == "append") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: append <filepath1> <filepath2>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.append(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: append " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "append") {
+        if (cmd_line.size() != 3) {
+            out << "Usage: append <filepath1> <filepath2>\n";
+            return -1;
+        }
+        arg1 = cmd_line[1];
+        arg2 = cmd_line[2];
+        // check return value so everything is ok
+        ret_val = filesystem.append(arg1, arg2);
+        if (ret_val) {
+            out << "Error: append " << arg1 << " " << arg2;
+            out << " failed, error code " << ret_val << std::endl;
         }
+    }
 
-        else if (cmd == "mkdir") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: mkdir <dirpath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
-            ret_val = filesystem.mkdir(arg1);
-            if (ret_val) {
-                std::cout << "Error: mkdir " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "mkdir") {
+        if (cmd_line.size() != 2) {
+            out << "Usage: mkdir <dirpath>\n";
+            return -1;
         }
+        arg1 = cmd_line[1];
+        // check return value so everything is ok
+        ret_val = filesystem.mkdir(arg1);
+        if (ret_val) {
+            out << "Error: mkdir " << arg1;
+            out << " failed, error code " << ret_val << std::endl;
+        }
+    }
 
-        else if (cmd == "cd") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: cd <dirpath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
-            ret_val = filesystem.cd(arg1);
-            if (ret_val) {
-                std::cout << "Error: cd " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "cd") {
+        if (cmd_line.size() != 2) {
+            out << "Usage: cd <dirpath>\n";
+            return -1;
         }
+        arg1 = cmd_line[1];
+        // check return value so everything is ok
+        ret_val = filesystem.cd(arg1);
+        if (ret_val) {
+            out << "Error: cd " << arg1;
+            out << " failed, error code " << ret_val << std::endl;
+        }
+    }
 
-        else if (cmd == "pwd") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: pwd\n";
-                continue;
-            }
-            // check return value so everything is ok
-            ret_val = filesystem.pwd();
-            if (ret_val) {
-                std::cout << "Error: pwd failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "pwd") {
+        if (cmd_line.size() != 1) {
+            out << "Usage: pwd\n";
+            return -1;
         }
+        // check return value so everything is ok
+        ret_val = filesystem.pwd();
+        if (ret_val) {
+            out << "Error: pwd failed, error code " << ret_val << std::endl;
+        }
+    }
 
-        else if (cmd == "chmod") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: chmod <accessrights> <filepath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.chmod(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: chmod " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
+    else if (cmd == "chmod") {
+        if (cmd_line.size() != 3) {
+            out << "Usage: chmod <accessrights> <filepath>\n";
+            return -1;
+        }
+        arg1 = cmd_line[1];
+        arg2 = cmd_line[2];
+        // check return value so everything is ok
+        ret_val = filesystem.chmod(arg1, arg2);
+        if (ret_val) {
+            out << "Error: chmod " << arg1 << " " << arg2;
+            out << " failed, error code " << ret_val << std::endl;
+        }
+    }
+
+    else if (cmd == "du") {
+        if (cmd_line.size() > 2) {
+            out << "Usage: du [dirpath]\n";
+            return -1;
+        }
+        arg1 = cmd_line.size() == 2 ? cmd_line[1] : "";
+        // check return value so everything is ok
+        ret_val = filesystem.du(arg1);
+        if (ret_val) {
+            out << "Error: du " << arg1;
+            out << " failed, error code " << ret_val << std::endl;
+        }
+    }
+
+    else if (cmd == "df") {
+        if (cmd_line.size() != 1) {
+            out << "Usage: df\n";
+            return -1;
+        }
+        // check return value so everything is ok
+        ret_val = filesystem.df();
+        if (ret_val) {
+            out << "Error: df failed, error code " << ret_val << std::endl;
+        }
+    }
+
+    else if (cmd == "grep") {
+        if (cmd_line.size() != 3) {
+            out << "Usage: grep <pattern> <dirpath>\n";
+            return -1;
+        }
+        arg1 = cmd_line[1];
+        arg2 = cmd_line[2];
+        // check return value so everything is ok
+        ret_val = filesystem.grep(arg1, arg2);
+        if (ret_val) {
+            out << "Error: grep " << arg1 << " " << arg2;
+            out << " failed, error code " << ret_val << std::endl;
+        }
+    }
+
+    else if (cmd == "find") {
+        if (cmd_line.size() < 2 || cmd_line.size() > 3) {
+            out << "Usage: find <dirpath> [pattern]\n";
+            return -1;
+        }
+        arg1 = cmd_line[1];
+        arg2 = cmd_line.size() == 3 ? cmd_line[2] : "*";
+        // check return value so everything is ok
+        ret_val = filesystem.find(arg1, arg2);
+        if (ret_val) {
+            out << "Error: find " << arg1 << " " << arg2;
+            out << " failed, error code " << ret_val << std::endl;
+        }
+    }
+
+    else if (cmd == "import" || cmd == "export") {
+        bool recursive = cmd_line.size() == 4 && cmd_line[1] == "-r";
+        if (cmd_line.size() != 3 && !recursive) {
+            if (cmd == "import")
+                out << "Usage: import [-r] <hostpath> <filepath>\n";
+            else
+                out << "Usage: export [-r] <filepath> <hostpath>\n";
+            return -1;
+        }
+        arg1 = cmd_line[cmd_line.size() - 2];
+        arg2 = cmd_line[cmd_line.size() - 1];
+        // check return value so everything is ok
+        if (cmd == "import")
+            ret_val = filesystem.import_host(arg1, arg2, recursive);
+        else
+            ret_val = filesystem.export_host(arg1, arg2, recursive);
+        if (ret_val) {
+            out << "Error: " << cmd << " " << arg1 << " " << arg2;
+            out << " failed, error code " << ret_val << std::endl;
+        }
+    }
+
+    else if (cmd == "fsck") {
+        bool quick = false, repair = false;
+        for (size_t i = 1; i < cmd_line.size(); i++) {
+            if (cmd_line[i] == "-q") {
+                quick = true;
+            } else if (cmd_line[i] == "-r") {
+                repair = true;
+            } else {
+                out << "Usage: fsck [-q] [-r]\n";
+                return -1;
             }
         }
+        // check return value so everything is ok
+        ret_val = filesystem.fsck(quick, repair);
+        if (ret_val) {
+            out << "Error: fsck failed, error code " << ret_val << std::endl;
+        }
+    }
 
-        else if (cmd == "quit")
-            running = false;
+    else if (cmd == "checksum") {
+        std::string cached = cmd_line.size() == 3 && cmd_line[1] == "cached" ? cmd_line[2] : "";
+        if (cmd_line.size() != 1 && cached != "on" && cached != "off") {
+            out << "Usage: checksum [cached on|off]\n";
+            return -1;
+        }
+        // check return value so everything is ok
+        ret_val = filesystem.checksum(cached);
+        if (ret_val) {
+            out << "Error: checksum failed, error code " << ret_val << std::endl;
+        }
+    }
 
-        else if (cmd == "help") {
-            std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+    else if (cmd == "pathindex") {
+        arg1 = cmd_line.size() == 2 ? cmd_line[1] : "";
+        if (cmd_line.size() > 2 || (cmd_line.size() == 2 && arg1 != "on" && arg1 != "off")) {
+            out << "Usage: pathindex [on|off]\n";
+            return -1;
         }
+        // check return value so everything is ok
+        ret_val = filesystem.pathindex(arg1);
+        if (ret_val) {
+            out << "Error: pathindex failed, error code " << ret_val << std::endl;
+        }
+    }
 
-        else if (cmd == "") {
-            ; // do nothing
+    else if (cmd == "snapshot") {
+        std::string sub = cmd_line.size() > 1 ? cmd_line[1] : "";
+        bool named = sub == "create" || sub == "delete" || sub == "mount";
+        if ((named && cmd_line.size() != 3) || (!named && (cmd_line.size() != 2 || (sub != "list" && sub != "umount")))) {
+            out << "Usage: snapshot create|delete|mount <name>, snapshot list|umount\n";
+            return -1;
+        }
+        arg1 = named ? cmd_line[2] : "";
+        // check return value so everything is ok
+        if (sub == "create") {
+            ret_val = filesystem.snapshot_create(arg1);
+        } else if (sub == "delete") {
+            ret_val = filesystem.snapshot_delete(arg1);
+        } else if (sub == "mount") {
+            ret_val = filesystem.snapshot_mount(arg1);
+        } else if (sub == "umount") {
+            ret_val = filesystem.snapshot_umount();
+        } else {
+            ret_val = filesystem.snapshot_list();
+        }
+        if (ret_val) {
+            out << "Error: snapshot " << sub << (named ? " " + arg1 : "");
+            out << " failed, error code " << ret_val << std::endl;
         }
+    }
+
+    else if (cmd == "bench") {
+        bench_params params = {200, 1024, 200, 16, 1};
+        int *values[] = {&params.files, &params.file_size, &params.ops, &params.depth};
+        std::string flags = "nsod";
+        bool valid = cmd_line.size() % 2 == 1;
+        for (size_t i = 1; valid && i + 1 < cmd_line.size(); i += 2) {
+            size_t f = cmd_line[i].size() == 2 && cmd_line[i][0] == '-' ? flags.find(cmd_line[i][1]) : std::string::npos;
+            const std::string &value = cmd_line[i + 1];
+            valid = f != std::string::npos && !value.empty() && value.size() <= 6 &&
+                    value.find_first_not_of("0123456789") == std::string::npos;
+            if (valid) {
+                *values[f] = std::stoi(value);
+            }
+        }
+        if (!valid || params.files < 1 || params.ops < 1) {
+            out << "Usage: bench [-n files] [-s filesize] [-o ops] [-d depth]\n";
+            return -1;
+        }
+        // check return value so everything is ok
+        Bench bench(&filesystem, params);
+        ret_val = bench.run();
+        if (ret_val) {
+            out << "Error: bench failed, error code " << ret_val << std::endl;
+        }
+    }
 
-        else {
-            std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+    else if (cmd == "trace") {
+        std::string sub = cmd_line.size() > 1 ? cmd_line[1] : "";
+        if (!(sub == "start" && cmd_line.size() == 3) && !(sub == "stop" && cmd_line.size() == 2)) {
+            out << "Usage: trace start <hostpath>, trace stop\n";
+            return -1;
+        }
+        // check return value so everything is ok
+        if (sub == "start")
+            ret_val = filesystem.trace_start(cmd_line[2]);
+        else
+            ret_val = filesystem.trace_stop();
+        if (ret_val) {
+            out << "Error: trace " << sub << " failed, error code " << ret_val << std::endl;
         }
     }
+
+    else if (cmd == "quit")
+        *running = false;
+
+    else if (cmd == "help") {
+        out << "Available commands:\n";
+        out << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, du, df, find, grep, import, export, fsck, checksum, pathindex, snapshot, bench, trace, help, quit\n";
+    }
+
+    else if (cmd == "") {
+        ; // do nothing
+    }
+
+    else {
+        out << "Available commands:\n";
+        out << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, du, df, find, grep, import, export, fsck, checksum, pathindex, snapshot, bench, trace, help, quit\n";
+        return -1;
+    }
+    return ret_val;
 }
@@ -1,16 +1,32 @@
 #include <iostream>
+#include <map>
 #include "fs.h"
 
 #ifndef __SHELL_H__
 #define __SHELL_H__
 
+// Time and failures of one command name over a batch run
+struct command_stats {
+    int count;
+    int errors;
+    double total_ms;
+    double max_ms;
+};
+
 class Shell {
 private:
     FS filesystem;
+    bool interactive;
+    int read_heredoc(const std::string &marker, std::string *data);
 public:
-    Shell();
+    Shell(const std::string &diskname = DISKNAME);
     ~Shell();
     void run();
+    // runs the commands of script without a prompt and reports the time
+    // and errors of each command on stderr. Returns the number of errors.
+    int run_batch(std::istream *script);
+    int run_command(std::string line, bool *running);
+    FS* get_fs() { return &filesystem; }
 };
 
 #endif // __SHELL_H__
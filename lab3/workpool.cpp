@@ -0,0 +1,72 @@
+#include "workpool.h"
+
+WorkPool::WorkPool(unsigned threads) : busy(0), stopping(false)
+{
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+        if (threads == 0) {
+            threads = 1;
+        }
+        if (threads > MAX_WORKERS) {
+            threads = MAX_WORKERS;
+        }
+    }
+    for (unsigned i = 0; i < threads; i++) {
+        workers.push_back(std::thread(&WorkPool::worker_loop, this));
+    }
+}
+
+WorkPool::~WorkPool()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    task_ready.notify_all();
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+}
+
+void
+WorkPool::submit(std::function<void()> task)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        tasks.push_back(task);
+    }
+    task_ready.notify_one();
+}
+
+void
+WorkPool::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!tasks.empty() || busy != 0) {
+        all_done.wait(lock);
+    }
+}
+
+void
+WorkPool::worker_loop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        while (tasks.empty() && !stopping) {
+            task_ready.wait(lock);
+        }
+        if (tasks.empty() && stopping) {
+            return;
+        }
+        std::function<void()> task = tasks.front();
+        tasks.pop_front();
+        busy++;
+        lock.unlock();
+        task();
+        lock.lock();
+        busy--;
+        if (tasks.empty() && busy == 0) {
+            all_done.notify_all();
+        }
+    }
+}
@@ -0,0 +1,36 @@
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#ifndef __WORKPOOL_H__
+#define __WORKPOOL_H__
+
+// A fixed set of worker threads running queued tasks. Tasks may submit
+// further tasks; wait() returns once the queue is empty and every worker
+// is idle.
+class WorkPool {
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable task_ready;
+    std::condition_variable all_done;
+    unsigned busy;
+    bool stopping;
+
+    void worker_loop();
+public:
+    // threads == 0 picks one worker per core, capped at MAX_WORKERS
+    WorkPool(unsigned threads = 0);
+    ~WorkPool();
+    void submit(std::function<void()> task);
+    void wait();
+    unsigned size() { return workers.size(); }
+
+    static const unsigned MAX_WORKERS = 8;
+};
+
+#endif // __WORKPOOL_H__